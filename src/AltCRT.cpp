@@ -611,6 +611,24 @@ void AltCRT::randomize(const ZZ* seed)
   }
 }
 
+// fills each row i with pseudorandom numbers from the substream (index,i)
+void AltCRT::randomize(const ZZ& seed, long index)
+{
+  if (dryRun) return;
+
+  const IndexSet& s = map.getIndexSet();
+  long phim = context.zMStar.getPhiM();
+
+  for (long i = s.first(); i <= s.last(); i = s.next(i)) {
+    PRGStream prg(seed, ((unsigned long) index << 32) | (unsigned long) i);
+    long pi = context.ithPrime(i);
+    zz_pX& row = map[i];
+    row.rep.SetLength(phim);
+    for (long j = 0; j < phim; j++) row.rep[j].LoopHole() = prg.nextBnd(pi);
+    row.normalize();
+  }
+}
+
 
 
 
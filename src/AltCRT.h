@@ -177,12 +177,10 @@ public:
   void toPoly(ZZX& p, const IndexSet& s, bool positive=false) const;
   void toPoly(ZZX& p, bool positive=false) const;
 
-  // The variant toPolyMod has another argument, which is a modulus Q, and it
-  // computes toPoly() mod Q. This is offerred as a separate function in the
-  // hope that one day we will figure out a more efficient method of computing
-  // this. Right now it is not implemented
-  // 
-  // void toPolyMod(ZZX& p, const ZZ &Q, const IndexSet& s) const;
+  //! @brief The same as toPoly(p,s), reduced modulo q to (-q/2,q/2]
+  void toPolyMod(ZZX& p, long q, const IndexSet& s) const
+  { toPoly(p, s); PolyRed(p, q); }
+  void toPolyMod(ZZX& p, long q) const { toPolyMod(p, q, getIndexSet()); }
 
 
   bool operator==(const AltCRT& other) const {
@@ -302,6 +300,20 @@ public:
     Op(other, MulFun(), matchIndexSets); 
   }
 
+  // Multiply-accumulate wrt the IndexSet of *this, same interface as
+  // in DoubleCRT (but not fused here)
+  AltCRT& MulAdd(const AltCRT& a, const AltCRT& b) {
+    AltCRT tmp = a;
+    tmp.Mul(b, false);
+    Add(tmp, false);
+    return *this;
+  }
+  AltCRT& MulAdd(const AltCRT& a, const AltCRT& b,
+                 const AltCRT& c, const AltCRT& d) {
+    MulAdd(a, b);
+    return MulAdd(c, d);
+  }
+
   // Division by constant
   AltCRT& operator/=(const ZZ &num);
   AltCRT& operator/=(long num) { return (*this /= to_ZZ(num)); }
@@ -328,6 +340,10 @@ public:
   // fills each row i w/ random ints mod pi, uses NTL's PRG
   void randomize(const ZZ* seed=NULL);
 
+  // fills each row i w/ pseudorandom ints mod pi, from the PRGStream of
+  // seed with nonce (index,i), see DoubleCRT.h
+  void randomize(const ZZ& seed, long index);
+
   // Coefficients are -1/0/1, Prob[0]=1/2
   void sampleSmall() {
     ZZX poly; 
@@ -377,6 +393,23 @@ public:
   static bool setDryRun(bool toWhat=true) { dryRun=toWhat; return dryRun; }
 };
 
+//! @brief Same interface as DoubleCRTAccumulator, reducing eagerly
+class AltCRTAccumulator {
+  AltCRT sum;
+
+public:
+  AltCRTAccumulator(const FHEcontext& _context, const IndexSet& s):
+    sum(_context, s) {}
+
+  const FHEcontext& getContext() const { return sum.getContext(); }
+  const IndexSet& getIndexSet() const { return sum.getIndexSet(); }
+
+  void clear() { sum.SetZero(); }
+  void add(const AltCRT& a) { sum.Add(a, false); }
+  void addMul(const AltCRT& a, const AltCRT& b) { sum.MulAdd(a, b); }
+  void reduce(AltCRT& out) const { out = sum; }
+};
+
 
 
 
@@ -30,11 +30,18 @@
  * modulo Phi_m(X). The "frequency domain" are jusr vectors of integers
  * (vec_long or vec_ZZ), that store only the evaluation in primitive m-th
  * roots of unity.
+ *
+ * For single-precision q, the constructor also builds explicit tables for
+ * both directions and for the reduction modulo Phi_m(X), and the FFT/iFFT
+ * routines use only these tables (and thread_local scratch space), never
+ * NTL's current modulus. For m with several distinct prime factors the
+ * transform is a prime-factor FFT over the powerful basis (see powerful.h).
  */
 #include <cassert>
 
 #include "NumbTh.h"
 #include "CModulus.h"
+#include "powerful.h"
 #include "timing.h"
 
 // Some simple functions that should have been provided by NTL but are not
@@ -68,11 +75,14 @@ ZZ_pContext BuildContext(const ZZ& p, long maxroot)
 zz_pContext BuildContext(long p, long maxroot)
   { return zz_pContext(p, maxroot); }
 
+static double InvAsDouble(long q) { return 1/((double) q); }
+static double InvAsDouble(const ZZ& q) { return 1/to_double(q); }
+
 
 // Constructor: it is assumed that zms is already set with m>1
 // If q == 0, then the current context is used
 template <class type> Cmod<type>::
-Cmod(const PAlgebra &zms, const zz &qq, const zz &rt)
+Cmod(const PAlgebra &zms, const zz &qq, const zz &rt, bool explicitTables)
 {
   assert(zms.getM()>1);
   bool explicitModulus = true;
@@ -83,15 +93,23 @@ Cmod(const PAlgebra &zms, const zz &qq, const zz &rt)
   }
   else
     q = qq;
+  qinv = InvAsDouble(q);
 
   zMStar = &zms;
   root = rt;
 
+  if (isWide()) {
+    if (!explicitTables)
+      Error("Cmod: moduli above NTL_SP_BOUND need the explicit tables");
+    initWide();
+    return;
+  }
+
   zz mm;
   mm = zms.getM();
   m_inv = InvMod(mm, q);
 
-  zz_pBak bak; 
+  LockedBak<zz_pBak> bak; // NTL's current modulus is used below
 
   if (explicitModulus) {
     bak.save(); // backup the current modulus
@@ -111,19 +129,103 @@ Cmod(const PAlgebra &zms, const zz &qq, const zz &rt)
   }
   rInv = InvMod(root,q); // set rInv = root^{-1} mod q
 
+  if (explicitTables)
+    initPlans(); // the explicit tables, for single-precision q
+
   // Allocate memory (relative to current modulus that was defined above).
   // These objects will be initialized when anyone calls FFT/iFFT.
 
-  zpx phimx_poly;
-  conv(phimx_poly, zms.getPhimX());
-
   powers  = new zpx();
   Rb      = new fftrep();
   Ra      = new fftrep();
   ipowers = new zpx();
   iRb     = new fftrep();
-  phimx   = new zpxModulus(phimx_poly);
   scratch = new zpx();
+  phimx   = NULL;
+  if (!phimRem && !cycRem && !negaPlan) { // not needed with explicit tables
+    zpx phimx_poly;
+    conv(phimx_poly, zms.getPhimX());
+    phimx = new zpxModulus(phimx_poly);
+  }
+}
+
+// The bigint version uses NTL's routines, with the lazy tables
+template <class type> void Cmod<type>::initPlans() {}
+
+template <class type> void Cmod<type>::initWide()
+{
+  Error("Cmod: wide moduli are single-precision");
+}
+
+template<> void Cmod<CMOD_zz_p>::initWide()
+{
+  long m = getM();
+  m_inv = invModWide(m % q, q);
+  if (root == 0) root = primitiveRootWide(q, 2*m);
+  if (root == 0 || (q-1) % (2*m) != 0)
+    Error("Cmod::initWide(): no 2m'th roots of unity mod q");
+  rInv = invModWide(root, q);
+
+  // none of NTL's tables, the context is left empty
+  powers = ipowers = scratch = NULL;
+  Rb = Ra = iRb = NULL;
+  phimx = NULL;
+
+  initPlans();
+  if (!cycRem && !negaPlan) // should not happen, see initPlans
+    Error("Cmod::initWide(): no reduction modulo Phi_m(X)");
+}
+
+// Called with NTL's current modulus set to q (unless q is wide), in the
+// constructor
+template<> void Cmod<CMOD_zz_p>::initPlans()
+{
+  long m = getM();
+  long phim = getPhiM();
+
+  if ((m & (m-1)) == 0) { // the evaluation points are psi^{2k+1}, psi=root^2
+    long logN = 0;
+    while ((1L << logN) < phim) logN++;
+    negaPlan = make_shared<NegacyclicNTT>(q, mulModWide(root, root, q), logN);
+    return;
+  }
+
+  Vec< Pair<long, long> > factors;
+  factorize(factors, m);
+  if (factors.length() > 1) // a tensor product of prime-power transforms
+    powPlan = make_shared<PowerfulFFT>(factors, m, q, root);
+  else {
+    BluesteinPlan* fwd = new BluesteinPlan;
+    fwd->init(m, q, root);
+    fwdPlan.reset(fwd);
+
+    BluesteinPlan* inv = new BluesteinPlan;
+    inv->init(m, q, rInv, m_inv);
+    invPlan.reset(inv);
+  }
+
+  // The reduction mod Phi_m(X) with sparse binomials, if m has few prime
+  // factors, otherwise by multiplication with precomputed polynomials. The
+  // latter are computed with NTL, so a wide q always takes the former
+  CyclotomicRem* cr = new CyclotomicRem;
+  if (cr->init(q, m, isWide()? NTL_MAX_LONG : 64)) {
+    cycRem.reset(cr);
+    return;
+  }
+  delete cr;
+
+  // Phi_m(X) mod q, and the inverse of its reversal mod X^{m-phi(m)}
+  zz_pX phi, revInv;
+  conv(phi, zMStar->getPhimX());
+  InvTrunc(revInv, reverse(phi, phim), m-phim);
+
+  vector<long> f(phim+1), g(m-phim);
+  for (long i = 0; i <= phim; i++) f[i] = rep(coeff(phi, i));
+  for (long i = 0; i < m-phim; i++) g[i] = rep(coeff(revInv, i));
+
+  FixedPolyRem* r = new FixedPolyRem;
+  r->init(q, &f[0], phim, m, &g[0]);
+  phimRem.reset(r);
 }
 
 template <class type>
@@ -133,15 +235,26 @@ Cmod<type>& Cmod<type>::operator=(const Cmod &other)
 
   zMStar  =  other.zMStar; // Yes, really copy this pointer
   q       = other.q;
+  qinv    = other.qinv;
   m_inv   = other.m_inv;
 
   context = other.context;
-  zz_pBak bak; bak.save(); // backup the current modulus
-  context.restore();       // Set NTL's current modulus to q
+  LockedBak<zz_pBak> bak;
+  if (!isWide()) {
+    bak.save();        // backup the current modulus
+    context.restore(); // Set NTL's current modulus to q
+  }
 
   root = other.root;
   rInv = other.rInv;
 
+  fwdPlan = other.fwdPlan; // the explicit tables are immutable, share them
+  invPlan = other.invPlan;
+  phimRem = other.phimRem;
+  cycRem = other.cycRem;
+  negaPlan = other.negaPlan;
+  powPlan = other.powPlan;
+
   powers_aux = other.powers_aux;
   ipowers_aux = other.ipowers_aux;
   Rb_aux = other.Rb_aux;
@@ -162,9 +275,24 @@ Cmod<type>& Cmod<type>::operator=(const Cmod &other)
 
 template <class type>
 void Cmod<type>::FFT(zzv &y, const ZZX& x) const
+{
+  y.SetLength(zMStar->getPhiM());
+  FFT(y.elts(), x);
+}
+
+template <class type>
+void Cmod<type>::FFT(zz* y, const ZZX& x) const
+{
+  ntlFFT(y, x);
+}
+
+// The FFT with NTL's routines and the lazily-built tables of this object,
+// which are protected by the NTL modulus lock
+template <class type>
+void Cmod<type>::ntlFFT(zz* y, const ZZX& x) const
 {
   FHE_TIMER_START;
-  zpBak bak; bak.save();
+  LockedBak<zpBak> bak; bak.save();
   context.restore();
   zp rt;
   zpx& tmp = getScratch();
@@ -176,7 +304,6 @@ void Cmod<type>::FFT(zzv &y, const ZZX& x) const
 
   // copy the result to the output vector y, keeping only the
   // entries corresponding to primitive roots of unity
-  y.SetLength(zMStar->getPhiM());
   long i,j;
   long m = getM();
   for (i=j=0; i<m; i++)
@@ -184,13 +311,302 @@ void Cmod<type>::FFT(zzv &y, const ZZX& x) const
   FHE_TIMER_STOP;
 }
 
+// Re-entrant, uses only the explicit tables and thread_local scratch (if any)
+template<>
+void Cmod<CMOD_zz_p>::FFT(long* y, const ZZX& x) const
+{
+  const ZZX* px = &x;
+  FFT(&y, &px, 1);
+}
 
 template <class type>
-void Cmod<type>::iFFT(zpx &x, const zzv& y)const
+void Cmod<type>::FFT(zz* y, const zz* x) const
+{
+  long phim = getPhiM();
+  ZZX tmp;
+  tmp.rep.SetLength(phim);
+  for (long i = 0; i < phim; i++) conv(tmp.rep[i], x[i]);
+  tmp.normalize();
+  FFT(y, tmp);
+}
+
+// Re-entrant, the coefficients are already reduced mod q
+template<>
+void Cmod<CMOD_zz_p>::FFT(long* y, const long* x) const
+{
+  FFT(&y, &x, 1);
+}
+
+template <class type>
+void Cmod<type>::iFFT(zz* x, const zz* y) const
 {
-  FHE_TIMER_START;
   zpBak bak; bak.save();
   context.restore();
+  zpx tmp;
+  iFFT(tmp, y);
+
+  long phim = getPhiM();
+  for (long i = 0; i < phim; i++) x[i] = rep(coeff(tmp, i));
+}
+
+// Re-entrant, uses only the explicit tables and thread_local scratch (if any)
+template<>
+void Cmod<CMOD_zz_p>::iFFT(long* x, const long* y) const
+{
+  iFFT(&x, &y, 1);
+}
+
+// The batched versions, one polynomial at a time for bigint q
+template <class type>
+void Cmod<type>::FFT(zz* const* y, const ZZX* const* x, long n) const
+{
+  for (long k = 0; k < n; k++) FFT(y[k], *x[k]);
+}
+
+template <class type>
+void Cmod<type>::FFT(zz* const* y, const zz* const* x, long n) const
+{
+  for (long k = 0; k < n; k++) FFT(y[k], x[k]);
+}
+
+template <class type>
+void Cmod<type>::iFFT(zz* const* x, const zz* const* y, long n) const
+{
+  for (long k = 0; k < n; k++) iFFT(x[k], y[k]);
+}
+
+template <class type>
+void Cmod<type>::FFTsmall(zz* const* y, const long* const* x, long n) const
+{
+  long phim = getPhiM();
+  ZZX tmp;
+  for (long k = 0; k < n; k++) {
+    tmp.rep.SetLength(phim);
+    for (long i = 0; i < phim; i++) conv(tmp.rep[i], x[k][i]);
+    tmp.normalize();
+    FFT(y[k], tmp);
+  }
+}
+
+// For small q the n transforms go through the explicit tables together,
+// see the batched apply/forward/inverse in bluestein.h and ntt.h
+template<>
+void Cmod<CMOD_zz_p>::FFT(long* const* y, const ZZX* const* x, long n) const
+{
+  if (!hasExplicitTables()) {
+    for (long k = 0; k < n; k++) ntlFFT(y[k], *x[k]);
+    return;
+  }
+
+  FHE_TIMER_START;
+  long m = getM();
+  long phim = getPhiM();
+  static thread_local vector<long> buf;
+  static thread_local vector<long*> rows;
+  rows.resize(n);
+
+  if (negaPlan) { // reduce mod (X^{m/2}+1, q) and transform in place
+    for (long k = 0; k < n; k++) {
+      long* b = y[k];
+      for (long i = 0; i < phim; i++) b[i] = 0;
+      long dx = deg(*x[k]);
+      for (long i = 0; i <= dx; i++) {
+        long c = rem(x[k]->rep[i], q);
+        long& t = b[i % phim];
+        t = ((i / phim) & 1)? SubMod(t, c, q) : AddMod(t, c, q);
+      }
+    }
+    negaPlan->forward((unsigned long* const*) y, n);
+    FHE_TIMER_STOP;
+    return;
+  }
+
+  // reduce the coefficients mod q (and the polynomials mod X^m-1)
+  buf.assign(n*m, 0);
+  for (long k = 0; k < n; k++) {
+    long* b = rows[k] = &buf[k*m];
+    long dx = deg(*x[k]);
+    for (long i = 0; i <= dx; i++) {
+      long c = rem(x[k]->rep[i], q);
+      if (i < m) b[i] = c;
+      else       b[i % m] = AddMod(b[i % m], c, q);
+    }
+  }
+
+  if (powPlan)
+    for (long k = 0; k < n; k++) powPlan->forward(y[k], rows[k]);
+  else {
+    fwdPlan->apply(&rows[0], n);
+
+    // keep only the entries corresponding to primitive roots of unity
+    for (long k = 0; k < n; k++) {
+      long i,j;
+      for (i=j=0; i<m; i++)
+        if (zMStar->inZmStar(i)) y[k][j++] = rows[k][i];
+    }
+  }
+  FHE_TIMER_STOP;
+}
+
+template<>
+void Cmod<CMOD_zz_p>::FFT(long* const* y, const long* const* x, long n) const
+{
+  if (!hasExplicitTables()) {
+    long phim = getPhiM();
+    ZZX tmp;
+    for (long k = 0; k < n; k++) {
+      tmp.rep.SetLength(phim);
+      for (long i = 0; i < phim; i++) conv(tmp.rep[i], x[k][i]);
+      tmp.normalize();
+      ntlFFT(y[k], tmp);
+    }
+    return;
+  }
+
+  FHE_TIMER_START;
+  long m = getM();
+  long phim = getPhiM();
+  if (negaPlan) {
+    for (long k = 0; k < n; k++)
+      if (y[k] != x[k]) for (long i = 0; i < phim; i++) y[k][i] = x[k][i];
+    negaPlan->forward((unsigned long* const*) y, n);
+    FHE_TIMER_STOP;
+    return;
+  }
+
+  static thread_local vector<long> buf;
+  static thread_local vector<long*> rows;
+  buf.resize(n*m);
+  rows.resize(n);
+  for (long k = 0; k < n; k++) {
+    long* b = rows[k] = &buf[k*m];
+    for (long i = 0; i < phim; i++) b[i] = x[k][i];
+    for (long i = phim; i < m; i++) b[i] = 0;
+  }
+
+  if (powPlan)
+    for (long k = 0; k < n; k++) powPlan->forward(y[k], rows[k]);
+  else {
+    fwdPlan->apply(&rows[0], n);
+    for (long k = 0; k < n; k++) {
+      long i,j;
+      for (i=j=0; i<m; i++)
+        if (zMStar->inZmStar(i)) y[k][j++] = rows[k][i];
+    }
+  }
+  FHE_TIMER_STOP;
+}
+
+// For |x| < q, x mod q = x + (q if x<0). This is branch-free, so the loop
+// is vectorized by the compiler
+template<>
+void Cmod<CMOD_zz_p>::FFTsmall(long* const* y, const long* const* x,
+                               long n) const
+{
+  long phim = getPhiM();
+  long qq = q;
+  for (long k = 0; k < n; k++) {
+    long* __restrict__ yk = y[k];
+    const long* xk = x[k];
+    if (yk == xk)
+      for (long i = 0; i < phim; i++)
+        yk[i] += qq & (yk[i] >> (NTL_BITS_PER_LONG-1));
+    else
+      for (long i = 0; i < phim; i++)
+        yk[i] = xk[i] + (qq & (xk[i] >> (NTL_BITS_PER_LONG-1)));
+  }
+  FFT(y, (const long* const*) y, n);
+}
+
+template<>
+void Cmod<CMOD_zz_p>::iFFT(long* const* x, const long* const* y, long n) const
+{
+  if (!hasExplicitTables()) {
+    long phim = getPhiM();
+    LockedBak<zz_pBak> bak; bak.save();
+    context.restore();
+    zz_pX tmp;
+    for (long k = 0; k < n; k++) {
+      ntliFFT(tmp, y[k]);
+      for (long i = 0; i < phim; i++) x[k][i] = rep(coeff(tmp, i));
+    }
+    return;
+  }
+
+  FHE_TIMER_START;
+  long m = getM();
+  if (negaPlan) {
+    long phim = getPhiM();
+    for (long k = 0; k < n; k++)
+      if (x[k] != y[k]) for (long i = 0; i < phim; i++) x[k][i] = y[k][i];
+    negaPlan->inverse((unsigned long* const*) x, n);
+    FHE_TIMER_STOP;
+    return;
+  }
+
+  static thread_local vector<long> buf;
+  static thread_local vector<long*> rows;
+  buf.resize(n*m);
+  rows.resize(n);
+  for (long k = 0; k < n; k++) rows[k] = &buf[k*m];
+
+  if (powPlan) // polynomials of degree < m with the same evaluations
+    for (long k = 0; k < n; k++) powPlan->inverse(rows[k], y[k]);
+  else {
+    // the evaluations at non-primitive roots of unity are set to zero
+    for (long k = 0; k < n; k++) {
+      long i,j;
+      for (i=j=0; i<m; i++)
+        rows[k][i] = zMStar->inZmStar(i)? y[k][j++] : 0;
+    }
+    invPlan->apply(&rows[0], n); // the inverse transforms, scaled by 1/m
+  }
+
+  // reduce the results mod (Phi_m(X),q) and copy to the output
+FHE_NTIMER_START("iFFT:division")
+  for (long k = 0; k < n; k++) {
+    if (cycRem) cycRem->rem(x[k], rows[k]);
+    else        phimRem->rem(x[k], rows[k]);
+  }
+FHE_NTIMER_STOP("iFFT:division")
+  FHE_TIMER_STOP;
+}
+
+// Same as above, into a zz_pX with coefficients wrt NTL's current modulus,
+// which must be q
+template<>
+void Cmod<CMOD_zz_p>::iFFT(zz_pX &x, const long* y) const
+{
+  long phim = getPhiM();
+  static thread_local vector<long> buf;
+  buf.resize(phim);
+  iFFT(&buf[0], y);
+
+  x.rep.SetLength(phim);
+  for (long i = 0; i < phim; i++) x.rep[i].LoopHole() = buf[i];
+  x.normalize();
+}
+
+
+template <class type>
+void Cmod<type>::iFFT(zpx &x, const zzv& y) const
+{
+  assert(y.length() == (long)getPhiM());
+  iFFT(x, y.elts());
+}
+
+template <class type>
+void Cmod<type>::iFFT(zpx &x, const zz* y) const
+{
+  ntliFFT(x, y);
+}
+
+template <class type>
+void Cmod<type>::ntliFFT(zpx &x, const zz* y) const
+{
+  FHE_TIMER_START;
+  LockedBak<zpBak> bak; bak.save();
+  context.restore();
   zp rt;
 
   long m = getM();
@@ -200,6 +616,7 @@ void Cmod<type>::iFFT(zpx &x, const zzv& y)const
   long i,j;
   for (i=j=0; i<m; i++)
     if (zMStar->inZmStar(i)) conv(x.rep[i], y[j++]);
+    else clear(x.rep[i]);
   x.normalize();
   conv(rt, rInv);  // convert rInv to zp format
 
@@ -29,6 +29,8 @@
 #include "cloned_ptr.h"
 //NTL_CLIENT
 
+class PowerfulFFT; // see powerful.h
+
 /**
  * @class CMOD_zz_p
  * @brief typedefs for smallint Cmodulus
@@ -64,6 +66,12 @@ public:
 
 #define INJECT_TYPE(type,subtype) typedef typename type::subtype subtype
 
+//! @brief Is the single-precision modulus q too large for NTL's zz_p?
+//! Such "wide" moduli (below 2^62) are supported with the explicit tables
+//! only. A bigint modulus is never wide
+inline bool isWideModulus(long q) { return q >= NTL_SP_BOUND; }
+inline bool isWideModulus(const ZZ& q) { return false; }
+
 
 /**
 * @class Cmod
@@ -79,6 +87,18 @@ public:
 * Thereafter this class provides FFT and iFFT routines that converts between
 * time & frequency domains. Some tables are computed the first time that
 * each dierctions is called, which are then used in subsequent computations.
+*
+* For a single-precision q (Cmodulus) all the tables are computed by the
+* constructor instead, as explicit objects (BluesteinPlan, FixedPolyRem)
+* that do not depend on NTL's current modulus. The FFT and iFFT with long
+* coefficients are then re-entrant, and can be called concurrently from
+* different threads. When m is a power of two these use a negacyclic NTT
+* of length phi(m)=m/2 instead (NegacyclicNTT), with no padding and no
+* reduction modulo Phi_m(X). When m has two or more distinct prime factors
+* the length-m transform is computed as a prime-factor FFT over the powerful
+* basis (PowerfulFFT), one short transform per prime-power factor of m.
+* The final reduction modulo Phi_m(X) of the iFFT uses only sparse binomials
+* (CyclotomicRem) unless m has many prime factors.
 * 
 * The "time domain" polynomials are represented as ZZX, whic are reduced
 * modulo Phi_m(X). The "frequency domain" are jusr vectors of integers
@@ -97,6 +117,7 @@ class Cmod {
   INJECT_TYPE(type,zpxModulus);
 
   zz          q;       // the modulus
+  double      qinv;    // 1/q, for the quotient estimates in the row kernels
   zpContext   context; // NTL's tables for this modulus
 
   const PAlgebra* zMStar;  // points to the Zm* structure, m is FFT size
@@ -120,9 +141,34 @@ class Cmod {
   zpxModulus* phimx; // PhimX modulo q, for faster division w/ remainder
   zpx*        scratch; // temporary space, to satisfy NTL's rules
 
+  // The explicit tables for single-precision q, shared between copies
+  shared_ptr<const BluesteinPlan> fwdPlan; // length-m FFT with root
+  shared_ptr<const BluesteinPlan> invPlan; // with rInv, scaled by m^{-1}
+  shared_ptr<const FixedPolyRem> phimRem;  // remainder mod (Phi_m(X),q)
+  shared_ptr<const CyclotomicRem> cycRem;  // same, replaces phimRem if set
+
+  // For m a power of two Phi_m(X)=X^{m/2}+1, and a negacyclic NTT of
+  // length m/2 replaces all three of the above
+  shared_ptr<const NegacyclicNTT> negaPlan;
+
+  // For m with several prime factors, replaces fwdPlan and invPlan
+  shared_ptr<const PowerfulFFT> powPlan;
+
   // Allocate memory and compute roots
   void privateInit(const PAlgebra&, const zz& rt);
 
+  // Build the explicit tables (a no-op for bigint q)
+  void initPlans();
+
+  // The rest of the constructor for a wide q: no NTL modulus, the root of
+  // unity and the inverses are computed with word arithmetic
+  void initWide();
+
+  // The transforms with NTL's routines, used for bigint q and when there
+  // are no explicit tables
+  void ntlFFT(zz* y, const ZZX& x) const;
+  void ntliFFT(zpx& x, const zz* y) const;
+
   void freeSpace() 
   {
     if (powers!=NULL)  { delete powers;  powers=NULL; }
@@ -141,16 +187,19 @@ class Cmod {
   ~Cmod() { freeSpace(); } // destructor
 
   // Default constructor
-  Cmod(): zMStar(NULL), powers(NULL), Rb(NULL), Ra(NULL), ipowers(NULL), iRb(NULL), 
+  Cmod(): qinv(0.0), zMStar(NULL), powers(NULL), Rb(NULL), Ra(NULL), ipowers(NULL), iRb(NULL), 
           phimx(NULL), scratch(NULL) {}
 
   Cmod(const Cmod &other):
-    zMStar(NULL),powers(NULL),Rb(NULL),Ra(NULL),ipowers(NULL),iRb(NULL),phimx(NULL),scratch(NULL)
+    qinv(0.0),zMStar(NULL),powers(NULL),Rb(NULL),Ra(NULL),ipowers(NULL),iRb(NULL),phimx(NULL),scratch(NULL)
   { *this = other; }
 
   // Specify m and q, and optionally also the root
   // if q == 0, then the current context is used
-  Cmod(const PAlgebra &zms, const zz &qq, const zz &rt);
+  // if explicitTables is false, the single-precision version also uses
+  // NTL's routines (serially, under the NTL modulus lock)
+  Cmod(const PAlgebra &zms, const zz &qq, const zz &rt,
+       bool explicitTables=true);
 
   // Copy operator
   Cmod& operator=(const Cmod &other);
@@ -161,10 +210,19 @@ class Cmod {
   unsigned long getM() const    { return zMStar->getM(); }
   unsigned long getPhiM() const { return zMStar->getPhiM(); }
   const zz& getQ() const          { return q; }
+  double getQInv() const         { return qinv; }
   const zz& getRoot() const       { return root; }
   const zpxModulus& getPhimX() const  { return *phimx; }
   zpx& getScratch() const { return *scratch; }
 
+  //! @brief Are FFT/iFFT computed with the explicit (re-entrant) tables?
+  bool hasExplicitTables() const
+  { return fwdPlan || powPlan || negaPlan; }
+
+  //! @brief Is q above NTL_SP_BOUND? Then NTL's zz_p cannot be used with
+  //! this modulus, nor with NTL's MulMod
+  bool isWide() const { return isWideModulus(q); }
+
   //! @brief Restore NTL's current modulus
   void restoreModulus() const {context.restore();}
 
@@ -172,12 +230,51 @@ class Cmod {
 
   // sets zp context internally
   void FFT(zzv &y, const ZZX& x) const;  // y = FFT(x)
+  void FFT(zz* y, const ZZX& x) const;   // y[0..phi(m)-1] = FFT(x)
+
+  // y[0..phi(m)-1] = FFT(x), where x[0..phi(m)-1] are coefficients in
+  // [0,q), y may alias x
+  void FFT(zz* y, const zz* x) const;
+
+  // x[0..phi(m)-1] = the coefficients of FFT^{-1}(y), in [0,q)
+  void iFFT(zz* x, const zz* y) const;
+
+  // Batched versions of the above: y[k] = FFT(x[k]) (resp. x[k] =
+  // FFT^{-1}(y[k])) for 0<=k<n. For small q the n transforms are done
+  // together, sharing the loads of the tables
+  void FFT(zz* const* y, const ZZX* const* x, long n) const;
+  void FFT(zz* const* y, const zz* const* x, long n) const;
+  void iFFT(zz* const* x, const zz* const* y, long n) const;
+
+  // y[k] = FFT(x[k]) for 0<=k<n, where x[k][0..phi(m)-1] are the signed
+  // coefficients of a polynomial with |x[k][i]| < q (e.g., noise, masks
+  // or plaintexts). There is no ZZ arithmetic: the reduction mod q is a
+  // conditional add, and the transforms are batched. y[k] may alias x[k]
+  void FFTsmall(zz* const* y, const long* const* x, long n) const;
+  void FFTsmall(zz* y, const long* x) const { FFTsmall(&y, &x, 1); }
 
   // expects zp context to be set externally
   void iFFT(zpx &x, const zzv& y) const; // x = FFT^{-1}(y)
+  void iFFT(zpx &x, const zz* y) const;  // same, y has length phi(m)
 };
 
 typedef Cmod<CMOD_zz_p> Cmodulus;
 typedef Cmod<CMOD_ZZ_p> CModulus;
 
+// The single-precision versions use the explicit tables
+template<> void Cmod<CMOD_zz_p>::initPlans();
+template<> void Cmod<CMOD_zz_p>::initWide();
+template<> void Cmod<CMOD_zz_p>::FFT(long* y, const ZZX& x) const;
+template<> void Cmod<CMOD_zz_p>::FFT(long* y, const long* x) const;
+template<> void Cmod<CMOD_zz_p>::iFFT(long* x, const long* y) const;
+template<> void Cmod<CMOD_zz_p>::iFFT(zz_pX& x, const long* y) const;
+template<> void Cmod<CMOD_zz_p>::FFT(long* const* y, const ZZX* const* x,
+                                     long n) const;
+template<> void Cmod<CMOD_zz_p>::FFT(long* const* y, const long* const* x,
+                                     long n) const;
+template<> void Cmod<CMOD_zz_p>::iFFT(long* const* x, const long* const* y,
+                                      long n) const;
+template<> void Cmod<CMOD_zz_p>::FFTsmall(long* const* y,
+                                          const long* const* x, long n) const;
+
 #endif // ifdef _CModulus_H_
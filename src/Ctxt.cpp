@@ -21,6 +21,7 @@ NTL_CLIENT
 #include "Ctxt.h"
 #include "FHE.h"
 #include "timing.h"
+#include <type_traits>
 
 
 // Sanity-check: Check that prime-set is "valid":
@@ -104,6 +105,39 @@ Ctxt& Ctxt::privateAssign(const Ctxt& other)
   return *this;
 }
 
+Ctxt& Ctxt::privateAssign(Ctxt&& other)
+{
+  if (this == &other) return *this; // both point to the same object
+
+  parts.swap(other.parts);
+  std::swap(primeSet, other.primeSet);
+  ptxtSpace = other.ptxtSpace;
+  noiseVar  = other.noiseVar;
+  other.clear(); // releases the old parts of *this
+  return *this;
+}
+
+Ctxt::Ctxt(Ctxt&& other) noexcept:
+  context(other.context), pubKey(other.pubKey), parts(std::move(other.parts)),
+  ptxtSpace(other.ptxtSpace), noiseVar(other.noiseVar)
+{
+  std::swap(primeSet, other.primeSet);
+  other.clear();
+}
+static_assert(std::is_nothrow_move_constructible<Ctxt>::value,
+              "vector<Ctxt> would copy its elements when it grows");
+
+void Ctxt::swap(Ctxt& other)
+{
+  assert(&context == &other.context);
+  assert (&pubKey == &other.pubKey);
+
+  parts.swap(other.parts);
+  std::swap(primeSet, other.primeSet);
+  std::swap(ptxtSpace, other.ptxtSpace);
+  std::swap(noiseVar, other.noiseVar);
+}
+
 // Ciphertext maintenance
 
 // mod-switch up to add the primes in s \setminus primeSet, after this call we
@@ -241,6 +275,7 @@ void Ctxt::reLinearize(long keyID)
 
   long g = ptxtSpace;
   Ctxt tmp(pubKey, ptxtSpace); // an empty ciphertext, same plaintext space
+  tmp.parts.reserve(2);        // the result is relative to (1,s)
 
   double logProd = context.logOfProduct(context.specialPrimes);
   tmp.noiseVar = noiseVar * xexp(2*logProd); // The noise after mod-UP
@@ -267,7 +302,7 @@ void Ctxt::reLinearize(long keyID)
 
     tmp.keySwitchPart(part, W); // switch this part & update noiseVar
   }
-  *this = tmp;
+  *this = std::move(tmp);
   FHE_TIMER_STOP;
 }
 
@@ -298,10 +333,30 @@ void Ctxt::keySwitchPart(const CtxtPart& p, const KeySwitch& W)
 
   // Compute the number of digits that we need and the esitmated added noise
   // from switching this ciphertext part.
+  xdouble addedNoise;
+  long nDigits = keySwitchNumDigits(addedNoise, p.getIndexSet(), W);
+
+  // Break the ciphertext part into digits, if needed, and scale up these
+  // digits using the special primes. This is the most expensive operation
+  // during homormophic evaluation, so it should be thoroughly optimized.
+
+  vector<DoubleCRT> polyDigits;
+  p.breakIntoDigits(polyDigits, nDigits);
+
+  // Finally we multiply the vector of digits by the key-switching matrix
+  keySwitchDigits(polyDigits, W, addedNoise);
+  FHE_TIMER_STOP;
+}
+
+// The number of digits needed to switch a part defined over the primes s
+// using W, and the noise that this switching adds
+long Ctxt::keySwitchNumDigits(xdouble& addedNoise, const IndexSet& s,
+                              const KeySwitch& W) const
+{
   long pSpace = W.ptxtSpace;
   long nDigits = 0;
-  xdouble addedNoise = to_xdouble(0.0);
-  double sizeLeft = context.logOfProduct(p.getIndexSet());
+  addedNoise = to_xdouble(0.0);
+  double sizeLeft = context.logOfProduct(s);
   for (size_t i=0; i<context.digits.size() && sizeLeft>0.0; i++) {    
     nDigits++;
 
@@ -323,7 +378,7 @@ void Ctxt::keySwitchPart(const CtxtPart& p, const KeySwitch& W)
   // the special primes, it should be smaller than the added noise term due
   // to modulus switching, i.e., keyWeight * phi(m) * pSpace^2 / 12
 
-  long keyWeight = pubKey.getSKeyWeight(p.skHandle.getSecretKeyID());
+  long keyWeight = pubKey.getSKeyWeight(W.fromKey.getSecretKeyID());
   double phim = context.zMStar.getPhiM();
   double logModSwitchNoise = log((double)keyWeight) 
     +2*log((double)pSpace) +log(phim) -log(12.0);
@@ -331,46 +386,66 @@ void Ctxt::keySwitchPart(const CtxtPart& p, const KeySwitch& W)
     -2*context.logOfProduct(context.specialPrimes);
   assert(logKeySwitchNoise < logModSwitchNoise);
 
-  // Break the ciphertext part into digits, if needed, and scale up these
-  // digits using the special primes. This is the most expensive operation
-  // during homormophic evaluation, so it should be thoroughly optimized.
-
-  vector<DoubleCRT> polyDigits;
-  p.breakIntoDigits(polyDigits, nDigits);
-
-  // Finally we multiply the vector of digits by the key-switching matrix
-
-  // An object to hold the pseudorandom ai's, note that it must be defined
-  // with the maximum number of levels, else the PRG will go out of synch.
-  // FIXME: This is a bug waiting to happen.
-  DoubleCRT ai(context);
+  return nDigits;
+}
 
-  // Set the first ai using the seed, subsequent ai's (if any) will
-  // use the evolving RNG state (NOTE: this is not thread-safe)
+// Multiply the digits of a part (as returned by breakIntoDigits) by the
+// key-switching matrix W, and add the result to *this. The primes of *this
+// and of the digits are matched by mod-UP, as addPart does: normally they
+// are the same (see the comment before keySwitchPart), otherwise the
+// digits are extended to the extra primes of *this, and *this to the extra
+// primes of the digits.
+void Ctxt::keySwitchDigits(const vector<DoubleCRT>& polyDigits,
+                           const KeySwitch& W, const xdouble& addedNoise)
+{
+  // Make sure that *this has parts relative to 1 and to the base of
+  // W.toKeyID, defined wrt (at least) the primes of the digits
+  const IndexSet& digitSet = polyDigits[0].getIndexSet();
+  if (parts.size()==0) primeSet = digitSet;
+  else if (!(digitSet <= primeSet)) {
+    IndexSet setDiff = digitSet / primeSet; // set minus
+    for (size_t i=0; i<parts.size(); i++) parts[i].addPrimes(setDiff);
+    primeSet.insert(setDiff);
+  }
 
-  RandomState state;
-  SetSeed(W.prgSeed);
+  // The digits may be shared (see hoistedAutomorph), so they are only
+  // extended in a copy
+  const vector<DoubleCRT>* digits = &polyDigits;
+  vector<DoubleCRT> extended;
+  if (primeSet != digitSet) {
+    IndexSet setDiff = primeSet / digitSet;
+    extended = polyDigits;
+    for (size_t i=0; i<extended.size(); i++) extended[i].addPrimes(setDiff);
+    digits = &extended;
+  }
 
-  // Add the columns in, one by one
-  DoubleCRT tmp(context, IndexSet::emptySet());
-  
-  for (unsigned long i=0; i<polyDigits.size(); i++) {
-    ai.randomize();
-    tmp = polyDigits[i];
-  
-    // The operations below all use the IndexSet of tmp
-  
-    // add part*a[i] with a handle pointing to base of W.toKeyID
-    tmp.Mul(ai,  /*matchIndexSet=*/false);
-    addPart(tmp, SKHandle(1,1,W.toKeyID), /*matchPrimeSet=*/true);
-  
-    // add part*b[i] with a handle pointing to one
-    polyDigits[i].Mul(W.b[i], /*matchIndexSet=*/false);
-    addPart(polyDigits[i], SKHandle(), /*matchPrimeSet=*/true);
+  if (getPartIndexByHandle(SKHandle()) < 0)
+    parts.push_back(CtxtPart(context, primeSet, SKHandle()));
+  if (getPartIndexByHandle(SKHandle(1,1,W.toKeyID)) < 0)
+    parts.push_back(CtxtPart(context, primeSet, SKHandle(1,1,W.toKeyID)));
+  CtxtPart& part0 = parts[getPartIndexByHandle(SKHandle())];
+  CtxtPart& part1 = parts[getPartIndexByHandle(SKHandle(1,1,W.toKeyID))];
+
+  // Add the columns in, one by one, into lazily-reduced accumulators that
+  // start from the current content of the parts. The operations below all
+  // use the IndexSet of the parts.
+  DoubleCRTAccumulator acc0(context, primeSet), acc1(context, primeSet);
+  acc0.add(part0);
+  acc1.add(part1);
+
+  // The pseudorandom ai's are regenerated from the seed, only modulo the
+  // primes in primeSet (the rows of every prime do not depend on the other
+  // primes). This does not touch NTL's PRG, so it is thread-safe
+  DoubleCRT ai(context, primeSet);
+  for (unsigned long i=0; i<digits->size(); i++) {
+    ai.randomize(W.prgSeed, i);
+    acc1.addMul((*digits)[i], ai);     // part1 += digit * a[i]
+    acc0.addMul((*digits)[i], W.b[i]); // part0 += digit * b[i]
   }
+  acc0.reduce(part0);
+  acc1.reduce(part1);
   noiseVar += addedNoise;
-  FHE_TIMER_STOP;
-} // restore random state upon destruction of the RandomState, see NumbTh.h
+}
 
 // Find the IndexSet such that modDown to that set of primes makes the
 // additive term due to rounding into the dominant noise term 
@@ -442,6 +517,7 @@ void Ctxt::addPart(const DoubleCRT& part, const SKHandle& handle,
 
   if (parts.size()==0) { // inserting 1st part 
     primeSet = part.getIndexSet();
+    parts.reserve(2);
     parts.push_back(CtxtPart(part,handle));
     if (negative) parts.back().Negate(); // not thread-safe??
   } else {               // adding to a ciphertext with existing parts
@@ -462,7 +538,8 @@ void Ctxt::addPart(const DoubleCRT& part, const SKHandle& handle,
       if (negative) parts[j] -= *ptr;
       else          parts[j] += *ptr;
     } else {    // no mathing part found, just append this part
-      parts.push_back(CtxtPart(*ptr,handle));
+      if (ptr == &tmp) parts.push_back(CtxtPart(std::move(tmp),handle));
+      else             parts.push_back(CtxtPart(*ptr,handle));
       if (negative) parts.back().Negate(); // not thread-safe??
     }
   }
@@ -556,26 +633,42 @@ void Ctxt::tensorProduct(const Ctxt& c1, const Ctxt& c2)
   clear();                // clear *this, before we start adding things to it
   primeSet = c1.primeSet; // set the correct prime-set before we begin
 
-  // The actual tensoring
-  CtxtPart tmpPart(context, IndexSet::emptySet()); // a scratch CtxtPart
-  for (size_t i=0; i<c1.parts.size(); i++) {
-    CtxtPart thisPart = c1.parts[i];
-    if (f!=1) thisPart *= f;
+  // Group the elements c1[i]*c2[j] of the tensor product by the secret-key
+  // handle that they point to, so that each output part can be computed by
+  // multiply-accumulate without any temporaries
+  vector<SKHandle> handles;               // the handles of the output parts
+  vector< vector< pair<long,long> > > terms; // the (i,j)'s for each handle
+  for (size_t i=0; i<c1.parts.size(); i++)
     for (size_t j=0; j<c2.parts.size(); j++) {
-      tmpPart = c2.parts[j];
       // What secret key will the product point to?
-      if (!tmpPart.skHandle.mul(thisPart.skHandle, tmpPart.skHandle))
+      SKHandle h;
+      if (!h.mul(c1.parts[i].skHandle, c2.parts[j].skHandle))
 	Error("Ctxt::tensorProduct: cannot multiply secret-key handles");
 
-      tmpPart *= thisPart; // The element of the tensor product
-
-      // Check if we already have a part relative to this secret-key handle
-      long k = getPartIndexByHandle(tmpPart.skHandle);
-      if (k >= 0) // found a matching part
-	parts[k] += tmpPart;
-      else
-	parts.push_back(tmpPart);
+      size_t k = 0;
+      while (k<handles.size() && handles[k]!=h) k++;
+      if (k==handles.size()) { // a new handle
+	handles.push_back(h);
+	terms.push_back(vector< pair<long,long> >());
+      }
+      terms[k].push_back(pair<long,long>(i,j));
     }
+
+  // The actual tensoring, two products at a time where possible
+  parts.reserve(handles.size());
+  for (size_t k=0; k<handles.size(); k++) {
+    parts.push_back(CtxtPart(context, primeSet, handles[k])); // zero
+    CtxtPart& part = parts.back();
+    const vector< pair<long,long> >& t = terms[k];
+
+    size_t l = 0;
+    for (; l+1 < t.size(); l += 2)
+      part.MulAdd(c1.parts[t[l].first],   c2.parts[t[l].second],
+		  c1.parts[t[l+1].first], c2.parts[t[l+1].second]);
+    if (l < t.size())
+      part.MulAdd(c1.parts[t[l].first], c2.parts[t[l].second]);
+
+    if (f!=1) part *= f; // every product is scaled by f
   }
 
   /* Compute the noise estimate as c1.noiseVar * c2.noiseVar * factor
@@ -639,7 +732,7 @@ Ctxt& Ctxt::operator*=(const Ctxt& other)
     else 
       tmpCtxt.tensorProduct(*this, other);   // compute the actual product
   }
-  *this = tmpCtxt; // copy the result into *this
+  *this = std::move(tmpCtxt); // move the result into *this
 
   FHE_TIMER_STOP;
   return *this;
@@ -678,6 +771,19 @@ void Ctxt::multiplyBy2(const Ctxt& other1, const Ctxt& other2)
   reLinearize(); // re-linearize after all the multiplications
 }
 
+// Add the product other1*other2 to *this, without re-linearizing it. The
+// handles of the parts of *this and of the product are matched by addCtxt,
+// so a sum of canonical products keeps its three parts relative to 1,s,s^2
+void Ctxt::multiplyAdd(const Ctxt& other1, const Ctxt& other2)
+{
+  FHE_TIMER_START;
+  Ctxt tmp = other1;
+  if (&other1 == &other2) tmp *= tmp; // squaring rather than multiplication
+  else                    tmp *= other2;
+  *this += tmp;
+  FHE_TIMER_STOP;
+}
+
 // Multiply-by-constant
 void Ctxt::multByConstant(const DoubleCRT& dcrt, double size)
 {
@@ -797,6 +903,73 @@ void Ctxt::smartAutomorph(long k)
 }
 
 
+// Apply the automorphisms F(X)->F(X^{ks[j]}) to copies of *this, followed
+// by re-linearization. A canonical ciphertext (c0,c1) is rotated to
+// (c0(X^k), c1(X^k)) relative to (1,s(X^k)), and the digits of c1(X^k) can
+// be taken as the images under X->X^k of the digits of c1: they still add up
+// to c1(X^k), and the automorphism does not change their size in the
+// canonical embedding. So c1 is broken into digits only once.
+void Ctxt::hoistedAutomorph(vector<Ctxt>& out, const vector<long>& ks) const
+{
+  FHE_TIMER_START;
+  long m = context.zMStar.getM();
+  long keyID=getKeyID();
+
+  Ctxt c = *this;
+  if (!c.inCanonicalForm(keyID)) {   // Re-linearize the input, if needed
+    c.reLinearize(keyID);
+    assert (c.inCanonicalForm(keyID));
+  }
+  // The digits must not include the special primes
+  if (!c.primeSet.disjointFrom(context.specialPrimes))
+    c.modDownToSet(c.primeSet / context.specialPrimes);
+
+  double logProd = context.logOfProduct(context.specialPrimes);
+
+  vector<DoubleCRT> digits;       // the digits of c1, computed on first use
+  out.clear();
+  out.reserve(ks.size());
+  for (size_t j=0; j<ks.size(); j++) {
+    long k = mcMod(ks[j], m);
+    assert (context.zMStar.inZmStar(k));
+    out.push_back(c);
+    Ctxt& res = out.back();
+    if (k == 1) continue;
+
+    // no direct key-switching matrix for this amount
+    SKHandle from(1,k,keyID);
+    if (!pubKey.haveKeySWmatrix(from,keyID)) {
+      res.smartAutomorph(k);
+      continue;
+    }
+    const KeySwitch& W = pubKey.getKeySWmatrix(from,keyID);
+
+    xdouble addedNoise;
+    long nDigits = keySwitchNumDigits(addedNoise, c.primeSet, W);
+    if (digits.empty())
+      c.parts[1].breakIntoDigits(digits, nDigits);
+    assert((long)digits.size() == nDigits);
+
+    // The result starts from c0(X^k), scaled up by the special primes
+    res.clear();
+    res.ptxtSpace = GCD(W.ptxtSpace, c.ptxtSpace);
+    assert (res.ptxtSpace>1);
+    res.noiseVar = c.noiseVar * xexp(2*logProd);
+    CtxtPart p0 = c.parts[0];
+    p0.automorph(k);
+    p0.addPrimesAndScale(context.specialPrimes);
+    res.addPart(p0, /*matchPrimeSet=*/true);
+
+    // The rotated digits share their rows with digits until automorph
+    // writes them
+    vector<DoubleCRT> rotDigits = digits;
+    for (size_t i=0; i<rotDigits.size(); i++) rotDigits[i].automorph(k);
+    res.keySwitchDigits(rotDigits, W, addedNoise);
+  }
+  FHE_TIMER_STOP;
+}
+
+
 /********************************************************************/
 // Utility methods
 
@@ -920,6 +1093,45 @@ static void recursiveIncrementalProduct(Ctxt array[], long n)
   for (long i=n1; i<n; i++) array[i].multiplyBy(array[n1-1]);
 }
 
+// res = sum_i a[i]*b[i]. The arguments are first mod-switched down to the
+// lowest base level of all of them, so that all the products are defined
+// relative to the same primes and are added without any mod-UP. The sum is
+// re-linearized once, with one key-switching rather than one per product.
+// The sum is accumulated in a temporary, since res may be one of the a[i]
+// or b[i].
+void innerProduct(Ctxt& res, const vector<Ctxt>& a, const vector<Ctxt>& b)
+{
+  FHE_TIMER_START;
+  assert(a.size() == b.size());
+  if (a.size() == 0) {
+    res.clear();
+    return;
+  }
+
+  long lvl = a[0].findBaseLevel();
+  for (size_t i=0; i<a.size(); i++) {
+    lvl = min(lvl, a[i].findBaseLevel());
+    lvl = min(lvl, b[i].findBaseLevel());
+  }
+
+  Ctxt sum(a[0].getPubKey(), a[0].getPtxtSpace());
+  for (size_t i=0; i<a.size(); i++) {
+    Ctxt tmp = a[i];
+    tmp.modDownToLevel(lvl);
+    if (&a[i] == &b[i]) tmp *= tmp;
+    else {
+      Ctxt tmp1 = b[i];  // copies share their rows, so this is cheap
+      tmp1.modDownToLevel(lvl);
+      tmp *= tmp1;
+    }
+    if (i==0) sum = std::move(tmp);
+    else      sum += tmp;
+  }
+  sum.reLinearize();
+  res = std::move(sum);
+  FHE_TIMER_STOP;
+}
+
 // For i=n-1...0, set v[i]=prod_{j<=i} v[j]
 // This implementation uses depth log n and (nlog n)/2 products
 void incrementalProduct(vector<Ctxt>& v)
@@ -61,6 +61,7 @@
 #include <vector>
 #include <NTL/xdouble.h>
 #include "DoubleCRT.h"
+#include "PreparedConstant.h"
 
 class KeySwitch;
 class FHEPubKey;
@@ -198,7 +199,8 @@ public:
   bool operator==(const CtxtPart& other) const;
   bool operator!=(const CtxtPart& other) const {return !(*this==other);}
 
-  // Copy constructor from the base class
+  // Copy/move constructors and assignments: the built-in ones, the copies
+  // share the rows of the DoubleCRT (copy-on-write)
 
   explicit
   CtxtPart(const FHEcontext& _context): DoubleCRT(_context)
@@ -216,7 +218,19 @@ public:
 
   CtxtPart(const DoubleCRT& other, const SKHandle& otherHandle): 
     DoubleCRT(other), skHandle(otherHandle) {}
+
+  //! @brief Take over the rows of other
+  CtxtPart(DoubleCRT&& other, const SKHandle& otherHandle):
+    DoubleCRT(std::move(other)), skHandle(otherHandle) {}
+
+  //! @brief Exchange the polynomials and the handles
+  void swap(CtxtPart& other) {
+    DoubleCRT::swap(other);
+    std::swap(skHandle, other.skHandle);
+  }
 };
+inline void swap(CtxtPart& a, CtxtPart& b) { a.swap(b); }
+
 istream& operator>>(istream& s, CtxtPart& p);
 ostream& operator<<(ostream& s, const CtxtPart& p);
 
@@ -285,6 +299,15 @@ class Ctxt {
   // result to *this.
   void keySwitchPart(const CtxtPart& p, const KeySwitch& W);
 
+  // The two halves of keySwitchPart: keySwitchNumDigits returns the number of
+  // digits needed to switch a part over the primes s (and the noise that
+  // this adds), and keySwitchDigits multiplies the digits of such a part by
+  // W and adds the result to *this.
+  long keySwitchNumDigits(xdouble& addedNoise, const IndexSet& s,
+                          const KeySwitch& W) const;
+  void keySwitchDigits(const vector<DoubleCRT>& polyDigits,
+                       const KeySwitch& W, const xdouble& addedNoise);
+
   long getPartIndexByHandle(const SKHandle& hanle) const {
     for (size_t i=0; i<parts.size(); i++) 
       if (parts[i].skHandle==hanle) return i;
@@ -301,23 +324,42 @@ class Ctxt {
   // public key, this is needed when we copy the pubEncrKey member between
   // different public keys.
   Ctxt& privateAssign(const Ctxt& other);
+  Ctxt& privateAssign(Ctxt&& other); // the same, taking over the parts
  
 public:
   Ctxt(const FHEPubKey& newPubKey, long newPtxtSpace=0); // constructor
 
+  //! @brief Copy constructor, the copy shares the rows of the parts until
+  //! one of them is modified (see RowMap), so copies are cheap
+  Ctxt(const Ctxt& other) = default;
+
+  //! @brief Move constructor, other is left as an empty ciphertext. It
+  //! does not throw, so that vector<Ctxt> moves its elements when it grows
+  Ctxt(Ctxt&& other) noexcept;
+
   Ctxt& operator=(const Ctxt& other) {  // public assignment operator
     assert(&context == &other.context);
     assert (&pubKey == &other.pubKey);
     return privateAssign(other);
   }
 
+  //! @brief Move assignment, other is left as an empty ciphertext
+  Ctxt& operator=(Ctxt&& other) {
+    assert(&context == &other.context);
+    assert (&pubKey == &other.pubKey);
+    return privateAssign(std::move(other));
+  }
+
+  //! @brief Exchange the contents of *this and other (same public key)
+  void swap(Ctxt& other);
+
   bool operator==(const Ctxt& other) const { return equalsTo(other); }
   bool operator!=(const Ctxt& other) const { return !equalsTo(other); }
 
   // a procedural variant with an additional parameter
   bool equalsTo(const Ctxt& other, bool comparePkeys=true) const;
 
-  void clear() { // set as an empty ciphertext
+  void clear() noexcept { // set as an empty ciphertext
     primeSet.clear();
     parts.clear();
     noiseVar = to_xdouble(0.0);
@@ -344,11 +386,20 @@ public:
   // possibly evaluated via a sequence of steps, to ensure that we can
   // re-linearize the result of every step.
 
+  //! @brief Hoisted automorphisms: out[j] is *this after smartAutomorph(ks[j])
+  // The non-trivial part is broken into digits only once, and each
+  // automorphism is then applied to the digits before the key-switching
+  // (automorphisms commute with the decomposition). Amounts with no direct
+  // key-switching matrix fall back on smartAutomorph.
+  void hoistedAutomorph(vector<Ctxt>& out, const vector<long>& ks) const;
+
   // Add a constant polynomial. If the size is not given, we use
   // phi(m)*ptxtSpace^2 as the default value.
   void addConstant(const DoubleCRT& dcrt, double size=0.0);
   void addConstant(const ZZX& poly, double size=0.0)
   { addConstant(DoubleCRT(poly,context,primeSet),size); }
+  void addConstant(const PreparedConstant& c, double size=0.0)
+  { addConstant(c.getDCRT(primeSet),size); }
 
   // Multiply-by-constant. If the size is not given, we use
   // phi(m)*ptxtSpace^2 as the default value.
@@ -357,6 +408,10 @@ public:
   { 
     multByConstant(DoubleCRT(poly,context,primeSet),size); 
   }
+  //! @brief The same for a constant whose DoubleCRT forms are memoized,
+  //! no FFT is needed if it was already used at this level
+  void multByConstant(const PreparedConstant& c, double size=0.0)
+  { multByConstant(c.getDCRT(primeSet),size); }
 
   //! Divide a cipehrtext by 2. It is assumed that the ciphertext
   //! encrypts an even polynomial and has plaintext space 2^r for r>1.
@@ -377,6 +432,12 @@ public:
   void multiplyBy2(const Ctxt& other1, const Ctxt& other2);
   void square() { multiplyBy(*this); }
   void cube() { multiplyBy2(*this, *this); }
+
+  //! @brief Multiply-accumulate: *this += other1*other2, without
+  //! re-linearization. The result may have parts relative to s^2, and any
+  //! number of such products can be added before a single call to
+  //! reLinearize (see also innerProduct below)
+  void multiplyAdd(const Ctxt& other1, const Ctxt& other2);
   ///@}
 
   //! @name Ciphertext maintenance
@@ -415,6 +476,12 @@ public:
   //! Find the highest IndexSet so that mod-switching down to that set results
   //! in the dominant noise term being the additive term due to rounding
   void findBaseSet(IndexSet& s) const;
+
+  //! @brief Bring all the parts to evaluation form, so that the ciphertext
+  //! can be read by several threads at once (see DoubleCRT::toEvalForm)
+  void toEvalForm() const {
+    for (size_t i=0; i<parts.size(); i++) parts[i].toEvalForm();
+  }
   ///@}
 
   //! @name Utility methods
@@ -446,6 +513,8 @@ public:
   friend ostream& operator<<(ostream& str, const Ctxt& ctxt);
 };
 
+inline void swap(Ctxt& a, Ctxt& b) { a.swap(b); }
+
 inline IndexSet baseSetOf(const Ctxt& c) { 
   IndexSet s; c.findBaseSet(s); return s; 
 }
@@ -454,6 +523,10 @@ inline IndexSet baseSetOf(const Ctxt& c) {
 //! This implementation uses depth log n and (nlog n)/2 products
 void incrementalProduct(vector<Ctxt>& v);
 
+//! @brief res = sum_i a[i]*b[i], all the products are brought to a common
+//! level first and the sum is re-linearized only once
+void innerProduct(Ctxt& res, const vector<Ctxt>& a, const vector<Ctxt>& b);
+
 //! print to cerr some info about ciphertext
 void CheckCtxt(const Ctxt& c, const char* label);
 
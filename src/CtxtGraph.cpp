@@ -0,0 +1,270 @@
+/* Copyright (C) 2012,2013 IBM Corp.
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+/* CtxtGraph.cpp - lazy evaluation of ciphertext circuits
+ */
+#include <thread>
+#include <atomic>
+#include "CtxtGraph.h"
+#include "FHE.h"
+#include "timing.h"
+
+CtxtGraph::CtxtGraph(const FHEPubKey& _pubKey)
+  : pubKey(_pubKey), planned(false)
+{}
+
+long CtxtGraph::addNode(const Node& n)
+{
+  long nNodes = nodes.size();
+  assert(n.a < nNodes && (n.op == INPUT || n.a >= 0));
+  assert(n.b < nNodes);
+
+  nodes.push_back(n);
+  values.push_back(shared_ptr<Ctxt>());
+  planned = false;
+  return nNodes;
+}
+
+long CtxtGraph::input(const Ctxt& c)
+{
+  assert(&pubKey == &c.getPubKey());
+  Node n(INPUT);
+  n.ctxt = shared_ptr<const Ctxt>(new Ctxt(c));
+  return addNode(n);
+}
+
+long CtxtGraph::add(long a, long b)
+{
+  assert(b >= 0);
+  return addNode(Node(ADD, a, b));
+}
+
+long CtxtGraph::sub(long a, long b)
+{
+  assert(b >= 0);
+  return addNode(Node(SUB, a, b));
+}
+
+long CtxtGraph::mul(long a, long b)
+{
+  assert(b >= 0);
+  return addNode(Node(MUL, a, b));
+}
+
+long CtxtGraph::negate(long a)
+{
+  return addNode(Node(NEGATE, a));
+}
+
+long CtxtGraph::addConstant(long a, const ZZX& poly, double size)
+{
+  shared_ptr<const PreparedConstant> 
+    c(new PreparedConstant(poly, pubKey.getContext()));
+  return addConstant(a, c, size);
+}
+
+long CtxtGraph::addConstant(long a, const shared_ptr<const PreparedConstant>& c,
+                            double size)
+{
+  Node n(ADD_CONST, a);
+  n.constant = c;
+  n.size = size;
+  return addNode(n);
+}
+
+long CtxtGraph::multByConstant(long a, const ZZX& poly, double size)
+{
+  shared_ptr<const PreparedConstant> 
+    c(new PreparedConstant(poly, pubKey.getContext()));
+  return multByConstant(a, c, size);
+}
+
+long CtxtGraph::multByConstant(long a, 
+                               const shared_ptr<const PreparedConstant>& c,
+                               double size)
+{
+  Node n(MUL_CONST, a);
+  n.constant = c;
+  n.size = size;
+  return addNode(n);
+}
+
+long CtxtGraph::automorph(long a, long k)
+{
+  Node n(AUTOMORPH, a);
+  n.k = k;
+  return addNode(n);
+}
+
+void CtxtGraph::markOutput(long n)
+{
+  assert(n >= 0 && n < (long) nodes.size());
+  nodes[n].output = true;
+  planned = false;
+}
+
+// Compute the depths and the number of uses of every node, and decide which
+// values are re-linearized. The nodes are in topological order, so both are
+// computed in one forward pass: a value needs to be re-linearized if it is
+// not canonical and some node uses it as an argument of a multiplication
+// or an automorphism (or it is an output).
+void CtxtGraph::plan()
+{
+  long n = nodes.size();
+  vector<bool> needCanonical(n, false);
+  for (long i = 0; i < n; i++) {
+    Node& nd = nodes[i];
+    nd.nUses = 0;
+    if (nd.op == INPUT) { nd.depth = 0; continue; }
+
+    nd.depth = nodes[nd.a].depth + 1;
+    if (nd.b >= 0 && nodes[nd.b].depth >= nd.depth)
+      nd.depth = nodes[nd.b].depth + 1;
+    nodes[nd.a].nUses++;
+    if (nd.b >= 0) nodes[nd.b].nUses++;
+
+    if (nd.op == MUL || nd.op == AUTOMORPH) {
+      needCanonical[nd.a] = true;
+      if (nd.b >= 0) needCanonical[nd.b] = true;
+    }
+  }
+
+  for (long i = 0; i < n; i++) {
+    Node& nd = nodes[i];
+    switch (nd.op) {
+    case INPUT:
+      nd.canonical = nd.ctxt->inCanonicalForm(nd.ctxt->getKeyID());
+      break;
+    case MUL:       nd.canonical = false; break;
+    case AUTOMORPH: nd.canonical = true;  break;
+    case ADD: case SUB:
+      nd.canonical = nodes[nd.a].canonical && nodes[nd.b].canonical;
+      break;
+    default:        nd.canonical = nodes[nd.a].canonical;
+    }
+    nd.reLin = !nd.canonical && (needCanonical[i] || nd.output);
+    if (nd.reLin) nd.canonical = true; // as seen by the users of this value
+  }
+  planned = true;
+}
+
+long CtxtGraph::numReLinearizations()
+{
+  if (!planned) plan();
+  long count = 0;
+  for (size_t i = 0; i < nodes.size(); i++)
+    if (nodes[i].reLin) count++;
+  return count;
+}
+
+// Compute the value of node i from the values of its arguments
+void CtxtGraph::evalNode(long i)
+{
+  const Node& nd = nodes[i];
+  shared_ptr<Ctxt> res;
+
+  // Copies share the rows of the parts, until one of them is modified
+  if (nd.op == INPUT) res = shared_ptr<Ctxt>(new Ctxt(*nd.ctxt));
+  else {
+    res = shared_ptr<Ctxt>(new Ctxt(*values[nd.a]));
+    if (nd.b >= 0) {
+      Ctxt* other = values[nd.b].get();
+      Ctxt tmp(pubKey);
+
+      // match the prime-sets, switching down only
+      if (res->getPrimeSet() != other->getPrimeSet()) {
+        IndexSet common = res->getPrimeSet() & other->getPrimeSet();
+        res->modDownToSet(common);
+        if (other->getPrimeSet() != common) {
+          tmp = *other;
+          tmp.modDownToSet(common);
+          other = &tmp;
+        }
+      }
+      if (nd.op == ADD)      *res += *other;
+      else if (nd.op == SUB) *res -= *other;
+      else if (nd.a == nd.b) *res *= *res; // squaring
+      else                   *res *= *other;
+    }
+    else switch (nd.op) {
+      case NEGATE:    res->negate(); break;
+      case ADD_CONST: res->addConstant(*nd.constant, nd.size); break;
+      case MUL_CONST: res->multByConstant(*nd.constant, nd.size); break;
+      case AUTOMORPH: res->smartAutomorph(nd.k); break;
+      default: Error("CtxtGraph: bad node");
+    }
+  }
+
+  if (nd.reLin) res->reLinearize(res->getKeyID());
+
+  // Switch down to the base level, once for all the users of this value
+  res->modDownToLevel(res->findBaseLevel());
+
+  // The users of this value may run concurrently, and they only read it,
+  // which is safe in evaluation form only
+  res->toEvalForm();
+  values[i] = res;
+}
+
+void CtxtGraph::evaluate(long nThreads)
+{
+  FHE_TIMER_START;
+  if (!planned) plan();
+
+  // Group the nodes by depth, the nodes of every group are independent
+  long maxDepth = 0;
+  for (size_t i = 0; i < nodes.size(); i++)
+    if (nodes[i].depth > maxDepth) maxDepth = nodes[i].depth;
+  vector< vector<long> > waves(maxDepth+1);
+  for (size_t i = 0; i < nodes.size(); i++)
+    waves[nodes[i].depth].push_back(i);
+
+  vector<long> usesLeft(nodes.size());
+  for (size_t i = 0; i < nodes.size(); i++) usesLeft[i] = nodes[i].nUses;
+
+  for (long d = 0; d <= maxDepth; d++) {
+    const vector<long>& wave = waves[d];
+    long nWave = wave.size();
+
+    // Every thread takes the next node of this wave until none are left
+    atomic<long> next(0);
+    auto work = [&]() {
+      for (long t = next++; t < nWave; t = next++) evalNode(wave[t]);
+    };
+    long nWorkers = min(nThreads, nWave) - 1;
+    vector<thread> workers;
+    for (long t = 0; t < nWorkers; t++) workers.push_back(thread(work));
+    work();
+    for (size_t t = 0; t < workers.size(); t++) workers[t].join();
+
+    // Release the values that are not needed anymore
+    for (long t = 0; t < nWave; t++) {
+      const Node& nd = nodes[wave[t]];
+      if (nd.op == INPUT) continue;
+      if (--usesLeft[nd.a] == 0 && isReleasable(nd.a))
+        values[nd.a].reset();
+      if (nd.b >= 0 && --usesLeft[nd.b] == 0 && isReleasable(nd.b))
+        values[nd.b].reset();
+    }
+  }
+  FHE_TIMER_STOP;
+}
+
+const Ctxt& CtxtGraph::getResult(long n) const
+{
+  assert(n >= 0 && n < (long) nodes.size());
+  assert(nodes[n].output && values[n]);
+  return *values[n];
+}
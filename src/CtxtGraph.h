@@ -0,0 +1,136 @@
+/* Copyright (C) 2012,2013 IBM Corp.
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+#ifndef _CtxtGraph_H_
+#define _CtxtGraph_H_
+/**
+ * @file CtxtGraph.h
+ * @brief Lazy evaluation of ciphertext circuits, with a global placement
+ * of re-linearization and modulus-switching
+ **/
+#include <vector>
+#include <memory>
+#include "Ctxt.h"
+#include "PreparedConstant.h"
+
+/**
+ * @class CtxtGraph
+ * @brief Records ciphertext operations into a DAG, and evaluates it
+ *
+ * The methods input, add, mul, etc. do not compute anything, they only add
+ * a node to the graph and return its number. Every node refers to earlier
+ * nodes only, so the numbering is a topological order. Once the outputs are
+ * marked, evaluate() plans and runs the whole computation:
+ *
+ * - Re-linearization: the product of two canonical ciphertexts has a part
+ *   relative to s^2, and such parts are kept across additions, negations
+ *   and multiplications by constants. A value is re-linearized only if it
+ *   is used by a multiplication or an automorphism, or is an output, so a
+ *   sum of n products takes one key-switching rather than n, and a product
+ *   that is used many times is re-linearized once.
+ *
+ * - Modulus-switching: every value is switched down to its base level (see
+ *   Ctxt::findBaseLevel, which uses the noiseVar estimate) as soon as it is
+ *   computed, once for all of its uses. The arguments of an operation are
+ *   matched by switching down to their common primes, never up.
+ *
+ * - Parallelism: the nodes at the same depth of the graph are independent,
+ *   and are evaluated concurrently by up to nThreads threads, which share
+ *   the values of the previous waves (every value is brought to evaluation
+ *   form before it is published, see DoubleCRT::toEvalForm). These are
+ *   dedicated threads rather than ThreadPool jobs, since the operations may
+ *   take the NTL modulus lock; the parallel loops inside the operations still
+ *   use the ThreadPool of the context (whenever it is not busy).
+ *
+ * The value of a node that is not an output is released after its last use.
+ * The recorded input ciphertexts are never modified (an INPUT node starts
+ * from a copy of its ciphertext), so the graph can be evaluated again.
+ **/
+class CtxtGraph {
+public:
+  enum OpType { INPUT, ADD, SUB, MUL, NEGATE, ADD_CONST, MUL_CONST, AUTOMORPH };
+
+private:
+  struct Node {
+    OpType op;
+    long a, b;       // the arguments (-1 if not used)
+    long k;          // the automorphism X -> X^k
+    shared_ptr<const PreparedConstant> constant;
+    shared_ptr<const Ctxt> ctxt; // the ciphertext of an INPUT node
+    double size;     // the size of the constant (see Ctxt::multByConstant)
+
+    // the plan
+    long depth;      // 1 + the largest depth of the arguments, 0 for inputs
+    long nUses;      // how many nodes use this value
+    bool output;
+    bool canonical;  // is the value relative to (1,s) only?
+    bool reLin;      // re-linearize the value after computing it
+
+    Node(OpType _op, long _a=-1, long _b=-1)
+      : op(_op), a(_a), b(_b), k(1), size(0.0), depth(0), nUses(0),
+        output(false), canonical(true), reLin(false) {}
+  };
+
+  const FHEPubKey& pubKey;
+  vector<Node> nodes;
+  vector< shared_ptr<Ctxt> > values; // NULL until computed or after release
+  bool planned;
+
+  long addNode(const Node& n);
+  bool isReleasable(long i) const { return !nodes[i].output; }
+  void plan();
+  void evalNode(long i);
+
+  CtxtGraph(const CtxtGraph&);            // not copyable
+  CtxtGraph& operator=(const CtxtGraph&);
+
+public:
+  explicit CtxtGraph(const FHEPubKey& pubKey);
+
+  //! @name Recording the circuit
+  //! Each method adds a node and returns its number
+  ///@{
+  long input(const Ctxt& c); // the ciphertext is copied (cheaply)
+  long add(long a, long b);
+  long sub(long a, long b);
+  long mul(long a, long b);
+  long negate(long a);
+  long addConstant(long a, const ZZX& poly, double size=0.0);
+  long addConstant(long a, const shared_ptr<const PreparedConstant>& c,
+                   double size=0.0);
+  long multByConstant(long a, const ZZX& poly, double size=0.0);
+  long multByConstant(long a, const shared_ptr<const PreparedConstant>& c,
+                      double size=0.0);
+  //! @brief Apply X -> X^k followed by re-linearization (as smartAutomorph)
+  long automorph(long a, long k);
+
+  //! @brief The value of node n will be available after evaluate()
+  void markOutput(long n);
+  ///@}
+
+  //! @brief Evaluate the graph, using up to nThreads threads
+  void evaluate(long nThreads=1);
+
+  //! @brief The value of an output node, after evaluate()
+  const Ctxt& getResult(long n) const;
+
+  long numNodes() const { return nodes.size(); }
+
+  //! @brief The number of re-linearizations in the plan (that many
+  //! key-switchings, besides those of the automorphisms)
+  long numReLinearizations();
+};
+
+#endif // _CtxtGraph_H_
@@ -34,12 +34,16 @@
 #else
 
 
+#include <string.h>
+#include <cmath>
+#include <algorithm>
 #include <NTL/ZZX.h>
 #include "NumbTh.h"
 #include "PAlgebra.h"
 #include "CModulus.h"
 #include "SingleCRT.h"
 #include "timing.h"
+#include "ThreadPool.h"
 
 // NTL implementation of mat_long
 
@@ -50,6 +54,169 @@
 
 bool DoubleCRT::dryRun = false;
 
+// Operations on fewer entries than this are not worth splitting
+#define PARALLEL_MIN_WORK (1L << 14)
+
+// Call fn(i, first, last) to process the entries [first,last) of the row
+// of every prime i in s. If the context has a thread pool, the work is
+// split among its threads: across primes, and (if split is set) across
+// chunks of each row when there are fewer primes than threads. Chunks
+// start on a cache-line boundary. Without the explicit FFT tables the
+// transforms take the NTL modulus lock, so everything is serial.
+template<class Fun>
+static void forEachRow(const FHEcontext& context, const IndexSet& s,
+                       Fun fn, bool split=true)
+{
+  long phim = context.zMStar.getPhiM();
+  long nPrimes = card(s);
+  ThreadPool* pool = context.getThreadPool();
+
+  if (pool == NULL || pool->size() <= 1 || nPrimes*phim < PARALLEL_MIN_WORK
+      || !context.explicitFFT) {
+    for (long i = s.first(); i <= s.last(); i = s.next(i)) fn(i, 0, phim);
+    return;
+  }
+
+  vector<long> primes;
+  primes.reserve(nPrimes);
+  for (long i = s.first(); i <= s.last(); i = s.next(i)) primes.push_back(i);
+
+  long nChunks = 1;
+  if (split && nPrimes < pool->size()) {
+    const long perLine = ROWMAP_ALIGN / sizeof(long);
+    nChunks = (pool->size() + nPrimes - 1) / nPrimes;
+    nChunks = max(1L, min(nChunks, phim / (4*perLine)));
+  }
+
+  pool->parallelFor(nPrimes*nChunks, [&](long first, long last) {
+    const long perLine = ROWMAP_ALIGN / sizeof(long);
+    for (long t = first; t < last; t++) {
+      long c = t % nChunks;
+      long lo = ((phim*c / nChunks) / perLine) * perLine;
+      long hi = (c == nChunks-1)? phim : ((phim*(c+1) / nChunks) / perLine) * perLine;
+      fn(primes[t / nChunks], lo, hi);
+    }
+  });
+}
+
+// If deg(poly) < phi(m) and all the coefficients of poly are smaller (in
+// absolute value) than the primes in s, set c to the phi(m) coefficients of
+// poly and return true. The ZZ coefficients are thus converted once, rather
+// than reduced separately modulo every prime
+static bool smallCoeffs(vector<long>& c, const ZZX& poly,
+                        const FHEcontext& context, const IndexSet& s)
+{
+  long phim = context.zMStar.getPhiM();
+  long d = deg(poly);
+  if (d >= phim) return false;
+
+  long bound = 0;
+  for (long i = s.first(); i <= s.last(); i = s.next(i))
+    if (bound == 0 || context.ithPrime(i) < bound) bound = context.ithPrime(i);
+
+  c.assign(phim, 0);
+  for (long i = 0; i <= d; i++) {
+    const ZZ& a = poly.rep[i];
+    if (NumBits(a) >= NTL_BITS_PER_LONG) return false;
+    long v = to_long(a);
+    if (v >= bound || v <= -bound) return false;
+    c[i] = v;
+  }
+  return true;
+}
+
+// The same for a vector of coefficients
+static bool smallCoeffs(vector<long>& c, const vector<long>& poly,
+                        const FHEcontext& context, const IndexSet& s)
+{
+  long phim = context.zMStar.getPhiM();
+  long n = poly.size();
+  if (n > phim) return false;
+
+  long bound = 0;
+  for (long i = s.first(); i <= s.last(); i = s.next(i))
+    if (bound == 0 || context.ithPrime(i) < bound) bound = context.ithPrime(i);
+
+  for (long i = 0; i < n; i++)
+    if (poly[i] >= bound || poly[i] <= -bound) return false;
+
+  c.assign(phim, 0);
+  for (long i = 0; i < n; i++) c[i] = poly[i];
+  return true;
+}
+
+void DoubleCRT::smallFFT(DoubleCRT* const* dst, const long* const* x, long n)
+{
+  if (n <= 0) return;
+  const FHEcontext& context = dst[0]->context;
+  const IndexSet& s = dst[0]->getIndexSet();
+  for (long k = 0; k < n; k++) dst[k]->map.unshare();
+
+  forEachRow(context, s, [&](long i, long, long) {
+    vector<long*> out(n);
+    for (long k = 0; k < n; k++) out[k] = dst[k]->map[i];
+    context.ithModulus(i).FFTsmall(&out[0], x, n);
+  }, /*split=*/false);
+}
+
+void DoubleCRT::setSmall(const vector<long>& c)
+{
+  const IndexSet& s = map.getIndexSet();
+  if (!context.lazyCRT) {
+    dropCoeffs();
+    DoubleCRT* self = this;
+    const long* in = &c[0];
+    smallFFT(&self, &in, 1);
+    return;
+  }
+
+  long phim = context.zMStar.getPhiM();
+  cmap.clear();
+  cmap.insert(s);
+  cmap.unshare();
+  stale = s;
+  forEachRow(context, s, [&](long i, long, long) {
+    long q = context.ithPrime(i);
+    long* row = cmap[i];
+    for (long j = 0; j < phim; j++) row[j] = (c[j] < 0)? c[j]+q : c[j];
+  }, /*split=*/false);
+}
+
+// The two forms are a cache of one another, so converting to evaluations
+// does not change the value of *this (hence evalForm is const). It does
+// change the rows, so an object with stale rows must not be shared between
+// threads (see toEvalForm)
+void DoubleCRT::evalForm(const IndexSet& s) const
+{
+  if (!context.lazyCRT) return;
+  IndexSet todo = s & stale;
+  if (empty(todo)) return;
+
+  if (!dryRun) {
+    RowMap& evals = const_cast<RowMap&>(map);
+    evals.unshare();
+    forEachRow(context, todo, [&](long i, long, long) {
+      context.ithModulus(i).FFT(evals[i], coeffRows()[i]);
+    }, /*split=*/false);
+  }
+  stale.remove(todo);
+}
+
+void DoubleCRT::coeffForm(const IndexSet& s)
+{
+  if (!context.lazyCRT) return;
+  IndexSet todo = s / cmap.getIndexSet(); // these are not stale
+  if (empty(todo)) return;
+
+  cmap.insert(todo);
+  if (dryRun) return;
+  cmap.unshare();
+  const RowMap& evals = map;
+  forEachRow(context, todo, [&](long i, long, long) {
+    context.ithModulus(i).iFFT(cmap[i], evals[i]);
+  }, /*split=*/false);
+}
+
 // representing an integer polynomial as DoubleCRT. If the number of moduli
 // to use is not specified, the resulting object uses all the moduli in
 // the context. If the coefficients of poly are larger than the product of
@@ -60,16 +227,18 @@ bool DoubleCRT::dryRun = false;
 // moduli chain an error is raised if they are not consistent
 void DoubleCRT::verify()
 {
+  evalForm();
   assert(map.getIndexSet() <= (context.specialPrimes | context.ctxtPrimes));
   const IndexSet& s = map.getIndexSet();
 
   long phim = context.zMStar.getPhiM();
+  const RowMap& rows = map; // read-only, map may be shared
 
   // check that the content of i'th row is in [0,pi) for all i
   for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    vec_long& row = map[i];
+    const long* row = rows[i];
 
-    if (row.length() != phim) 
+    if (map.rowLength() != phim) 
       Error("DoubleCRT object has bad row length");
 
     long pi = context.ithPrime(i); // the i'th modulus
@@ -82,7 +251,11 @@ void DoubleCRT::verify()
 // Arithmetic operations. Only the "destructive" versions are used,
 // i.e., a += b is implemented but not a + b.
 
-// Generic operation, Fnc is AddMod, SubMod, or MulMod (from NTL's ZZ module)
+// Generic operation, Fun is AddFun, SubFun, or MulFun, each of them
+// processes a whole row at a time using the kernels from rowops.h.
+// In lazy mode, a linear operation is applied to every form that is valid
+// for both operands, and only the primes where there is no such form are
+// converted to evaluations
 template<class Fun>
 DoubleCRT& DoubleCRT::Op(const DoubleCRT &other, Fun fun,
 			 bool matchIndexSets)
@@ -98,25 +271,44 @@ DoubleCRT& DoubleCRT::Op(const DoubleCRT &other, Fun fun,
 
   // If you need to mod-up the other, do it on a temporary scratch copy
   DoubleCRT tmp(context, IndexSet()); 
-  const IndexMap<vec_long>* other_map = &other.map;
+  const DoubleCRT* src = &other;
   if (!(map.getIndexSet() <= other.map.getIndexSet())){ // Even more expensive
     tmp = other;
     tmp.addPrimes(map.getIndexSet() / other.map.getIndexSet());
-    other_map = &tmp.map;
+    src = &tmp;
   }
 
   const IndexSet& s = map.getIndexSet();
-  long phim = context.zMStar.getPhiM();
-
-  // add/sub/mul the data, element by element, modulo the respective primes
-  for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    long pi = context.ithPrime(i);
-    vec_long& row = map[i];
-    const vec_long& other_row = (*other_map)[i];
-    
-    for (long j = 0; j < phim; j++)
-      row[j] = fun.apply(row[j], other_row[j], pi);
+  map.unshare();
+  if (!Fun::linear() || (empty(cmap.getIndexSet()) && empty(src->stale))) {
+    evalForm();
+    src->evalForm(s);
+
+    // add/sub/mul the data, row by row, modulo the respective primes
+    forEachRow(context, s, [&](long i, long lo, long hi) {
+      fun.apply(map[i]+lo, src->map[i]+lo, hi-lo, context.ithModulus(i));
+    });
+    dropCoeffs();
+    return *this;
   }
+
+  IndexSet inCoeffs = s & cmap.getIndexSet() & src->cmap.getIndexSet();
+  IndexSet inEvals = s / (stale | src->stale);
+  IndexSet neither = s / (inCoeffs | inEvals);
+  evalForm(neither);
+  src->evalForm(neither);
+  inEvals.insert(neither);
+  cmap.unshare();
+
+  forEachRow(context, inEvals, [&](long i, long lo, long hi) {
+    fun.apply(map[i]+lo, src->map[i]+lo, hi-lo, context.ithModulus(i));
+  });
+  forEachRow(context, inCoeffs, [&](long i, long lo, long hi) {
+    fun.apply(cmap[i]+lo, src->coeffRows()[i]+lo, hi-lo,
+              context.ithModulus(i));
+  });
+  cmap.remove(cmap.getIndexSet() / inCoeffs);
+  stale = inCoeffs / inEvals;
   return *this;
 }
 
@@ -138,15 +330,20 @@ DoubleCRT& DoubleCRT::Op(const ZZ &num, Fun fun)
   if (dryRun) return *this;
 
   const IndexSet& s = map.getIndexSet();
+  vector<long> n(s.last()+1);
+  for (long i = s.first(); i <= s.last(); i = s.next(i))
+    n[i] = rem(num, context.ithPrime(i));  // n = num % pi
+  map.unshare();
+  cmap.unshare();
+
+  forEachRow(context, s / stale, [&](long i, long lo, long hi) {
+    fun.apply(map[i]+lo, n[i], hi-lo, context.ithModulus(i));
+  });
+
   long phim = context.zMStar.getPhiM();
-  
-  for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    long pi = context.ithPrime(i);
-    long n = rem(num, pi);  // n = num % pi
-    vec_long& row = map[i];
-    for (long j = 0; j < phim; j++)
-      row[j] = fun.apply(row[j], n, pi);
-  }
+  forEachRow(context, cmap.getIndexSet(), [&](long i, long, long) {
+    fun.applyCoeff(cmap[i], n[i], phim, context.ithModulus(i));
+  }, /*split=*/false);
   return *this;
 }
 
@@ -166,18 +363,24 @@ DoubleCRT& DoubleCRT::Negate(const DoubleCRT& other)
   if (&context != &other.context) 
     Error("DoubleCRT Negate: incompatible contexts");
 
-  if (map.getIndexSet() != other.map.getIndexSet()) {
-    map = other.map; // copy the data
-  }
-  const IndexSet& s = map.getIndexSet();
-  long phim = context.zMStar.getPhiM();
-  for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    long pi = context.ithPrime(i);
-    vec_long& row = map[i];
-    const vec_long& other_row = other.map[i];
-    for (long j = 0; j < phim; j++)
-      row[j] = NegateMod(other_row[j], pi);
+  if (this != &other) { // take the index sets of other, then negate its rows
+    if (map.getIndexSet() != other.map.getIndexSet()) {
+      map.clear();
+      map.insert(other.map.getIndexSet());
+    }
+    cmap.clear();
+    cmap.insert(other.cmap.getIndexSet());
+    stale = other.stale;
   }
+  map.unshare();
+  cmap.unshare();
+  forEachRow(context, map.getIndexSet() / stale, [&](long i, long lo, long hi) {
+    rowNegateMod(map[i]+lo, other.map[i]+lo, hi-lo, context.ithPrime(i));
+  });
+  forEachRow(context, cmap.getIndexSet(), [&](long i, long lo, long hi) {
+    rowNegateMod(cmap[i]+lo, other.coeffRows()[i]+lo, hi-lo,
+                 context.ithPrime(i));
+  });
   return *this;
 }
 
@@ -202,6 +405,15 @@ template
 DoubleCRT& DoubleCRT::Op<DoubleCRT::SubFun>(const ZZX &poly, SubFun fun);
 
 // break *this into n digits,according to the primeSets in context.digits
+//
+// Digit i is the balanced representative of y_i modulo the product P_i of
+// its primes, where y_0 = *this and y_{i+1} = (y_i - digit_i)/P_i. All of
+// this is done in RNS: the rows of *this are converted to coefficients
+// once, and each digit is extended from its own primes to all the others
+// with the constants of the mod-down table for this pair of sets (see
+// ModDownTable), so there is one FFT per output row not on the digit's
+// own primes. The rows of a digit on its own primes are those of y_i,
+// which are updated in evaluation representation.
 void DoubleCRT::breakIntoDigits(vector<DoubleCRT>& digits, long n) const
 {
   FHE_TIMER_START;
@@ -211,22 +423,113 @@ void DoubleCRT::breakIntoDigits(vector<DoubleCRT>& digits, long n) const
   digits.resize(n, DoubleCRT(context, IndexSet::emptySet()));
   if (dryRun) return;
 
-  for (long i=0; i<(long)digits.size(); i++) {
-    digits[i]=*this;
-    IndexSet notInDigit = digits[i].getIndexSet()/context.digits[i];
-    digits[i].removePrimes(notInDigit); // reduce modulo the digit primes
+  long phim = context.zMStar.getPhiM();
+  vector<IndexSet> own(n);       // the primes of each digit
+  vector<long> digitOf(context.numPrimes(), -1);
+  IndexSet inDigits;
+  for (long i = 0; i < n; i++) {
+    own[i] = getIndexSet() & context.digits[i];
+    for (long j = own[i].first(); j <= own[i].last(); j = own[i].next(j))
+      digitOf[j] = i;
+    inDigits.insert(own[i]);
   }
-  
-  for (long i=0; i<(long)digits.size(); i++) {
-    IndexSet notInDigit = allPrimes / digits[i].getIndexSet();
-    digits[i].addPrimes(notInDigit); // add back all the primes
 
-    // subtract this digits from all the others, then divide by pi
-    ZZ pi = context.productOfPrimes(context.digits[i]);
-    for (long j=i+1; j<(long)digits.size(); j++) {
-      digits[j].Sub(digits[i], /*matchIndexSets=*/false);
-      digits[j] /= pi;
+  // Digit i starts as *this on its own primes, the other rows are filled
+  // when the digit is extended
+  evalForm(inDigits);
+  for (long i = 0; i < n; i++) {
+    if (empty(own[i])) { // nothing left for this digit
+      digits[i] = DoubleCRT(context, allPrimes);
+      continue;
+    }
+    digits[i].map.clear();
+    digits[i].map.insert(allPrimes);
+    digits[i].map.unshare();
+    digits[i].dropCoeffs();
+    for (long j = own[i].first(); j <= own[i].last(); j = own[i].next(j))
+      memcpy(digits[i].map[j], map[j], phim*sizeof(long));
+  }
+
+  // y = the coefficients of *this modulo all the primes of the digits
+  RowMap y(phim);
+  y.insert(inDigits);
+  forEachRow(context, inDigits, [&](long j, long, long) {
+    if (cmap.getIndexSet().contains(j))
+      memcpy(y[j], coeffRows()[j], phim*sizeof(long));
+    else
+      context.ithModulus(j).iFFT(y[j], map[j]);
+  }, /*split=*/false);
+
+  vector<long> pos(context.numPrimes()); // positions in the table
+  vector<long> v(phim);
+  for (long i = 0; i < n; i++) {
+    if (empty(own[i])) continue;
+    IndexSet others = allPrimes / own[i];
+    shared_ptr<const ModDownTable> tab = context.getModDownTable(own[i], others);
+    const vector<long>& src = tab->dropped;
+    long ns = src.size();
+    for (long k = 0; k < ns; k++) pos[src[k]] = k;
+    for (long j = 0; j < (long) tab->kept.size(); j++) pos[tab->kept[j]] = j;
+
+    // z_k = y*(P_i/p_k)^{-1} mod p_k, in place since y is not needed
+    // anymore on the primes of this digit
+    forEachRow(context, own[i], [&](long j, long lo, long hi) {
+      unsigned long p = context.ithPrime(j);
+      unsigned long h = tab->hatInv[pos[j]], hPre = tab->hatInvPre[pos[j]];
+      long* z = y[j];
+      for (long k = lo; k < hi; k++) z[k] = shoupMulMod(z[k], h, hPre, p);
+    });
+
+    // v = round(sum_k z_k/p_k), then digit_i = sum_k z_k*(P_i/p_k) - v*P_i
+    for (long k = 0; k < phim; k++) {
+      double frac = 0.0;
+      for (long t = 0; t < ns; t++) frac += y[src[t]][k] * tab->dRecip[t];
+      v[k] = (long) floor(frac + 0.5);
     }
+
+    forEachRow(context, others, [&](long j, long, long) {
+      const Cmodulus& mod = context.ithModulus(j);
+      unsigned long q = mod.getQ();
+      long jj = pos[j];
+      const unsigned long* hat = &tab->hatMod[jj*ns];
+      const unsigned long* hatPre = &tab->hatModPre[jj*ns];
+
+      // w = digit_i mod q, in coefficient representation
+      static thread_local vector<long> w;
+      w.resize(phim);
+      for (long k = 0; k < phim; k++) {
+        unsigned long t = shoupMulMod(v[k], tab->DMod[jj], tab->DModPre[jj], q);
+        w[k] = (t == 0)? 0 : q-t;
+      }
+      for (long t = 0; t < ns; t++) {
+        const long* z = y[src[t]];
+        for (long k = 0; k < phim; k++) {
+          unsigned long sum = w[k] + shoupMulMod(z[k], hat[t], hatPre[t], q);
+          w[k] = (sum >= q)? sum-q : sum;
+        }
+      }
+
+      long* out = digits[i].map[j];
+      long later = digitOf[j]; // the digit of q, if it comes after this one
+      unsigned long DInv = tab->DInv[jj], DInvPre = tab->DInvPre[jj];
+      if (later > i) { // y = (y - digit_i)/P_i mod q
+        long* yj = y[j];
+        for (long k = 0; k < phim; k++) {
+          long d = (yj[k] >= w[k])? yj[k]-w[k] : yj[k]+(long)q-w[k];
+          yj[k] = shoupMulMod(d, DInv, DInvPre, q);
+        }
+      }
+
+      mod.FFT(out, &w[0]);
+
+      if (later > i) { // same for the evaluations of y on the later digit
+        long* e = digits[later].map[j];
+        for (long k = 0; k < phim; k++) {
+          long d = (e[k] >= out[k])? e[k]-out[k] : e[k]+(long)q-out[k];
+          e[k] = shoupMulMod(d, DInv, DInvPre, q);
+        }
+      }
+    }, /*split=*/false);
   }
 #if 0
   dgts.resize(n, DoubleCRT(context, IndexSet::emptySet()));
@@ -261,11 +564,27 @@ void DoubleCRT::addPrimes(const IndexSet& s1)
 
   map.insert(s1);  // add new rows to the map
   if (dryRun) return;
+  map.unshare();
+
+  if (context.lazyCRT) { // the new rows are only reduced mod p_i
+    long phim = context.zMStar.getPhiM();
+    long d = deg(poly);
+    cmap.insert(s1);
+    cmap.unshare();
+    stale.insert(s1);
+    forEachRow(context, s1, [&](long i, long, long) {
+      long pi = context.ithPrime(i);
+      long* row = cmap[i];
+      for (long j = 0; j < phim; j++)
+        row[j] = (j <= d)? rem(poly.rep[j], pi) : 0;
+    }, /*split=*/false);
+    return;
+  }
 
   // fill in new rows
-  for (long i = s1.first(); i <= s1.last(); i = s1.next(i)) {
+  forEachRow(context, s1, [&](long i, long, long) {
     context.ithModulus(i).FFT(map[i], poly); // reduce mod p_i and store FFT image
-  }
+  }, /*split=*/false);
 }
 
 // Expand index set by s1, and multiply by \prod{q \in s1}. s1 is assumed to
@@ -286,21 +605,23 @@ double DoubleCRT::addPrimesAndScale(const IndexSet& s1)
 
   // scale existing rows
   long phim = context.zMStar.getPhiM();
+  map.unshare();
+  cmap.unshare();
   const IndexSet& iSet = map.getIndexSet();
   for (long i = iSet.first(); i <= iSet.last(); i = iSet.next(i)) {
     long qi = context.ithPrime(i);
     long f = rem(factor, qi);     // f = factor % qi
-    vec_long& row = map[i];
-    // scale row by a factor of f modulo qi
-    mulmod_precon_t bninv = PrepMulModPrecon(f, qi, 1.0/(double)qi);
-    for (long j=0; j<phim; j++) 
-      row[j] = MulModPrecon(row[j], f, qi, bninv);
+    // scale row by a factor of f modulo qi, in every valid form
+    if (!stale.contains(i))
+      rowMulModConst(map[i], f, phim, qi, context.ithModulus(i).getQInv());
+    if (cmap.getIndexSet().contains(i))
+      rowMulModConst(cmap[i], f, phim, qi, context.ithModulus(i).getQInv());
   }
 
   // insert new rows and fill them with zeros
   map.insert(s1);  // add new rows to the map
   for (long i = s1.first(); i <= s1.last(); i = s1.next(i)) {
-    vec_long& row = map[i];
+    long* row = map[i];
     for (long j=0; j<phim; j++) row[j] = 0;
   }
 
@@ -308,7 +629,8 @@ double DoubleCRT::addPrimesAndScale(const IndexSet& s1)
 }
 
 DoubleCRT::DoubleCRT(const ZZX& poly, const FHEcontext &_context, const IndexSet& s)
-: context(_context), map(new DoubleCRTHelper(_context))
+: context(_context), map(_context.zMStar.getPhiM()),
+  cmap(_context.zMStar.getPhiM())
 {
   FHE_NTIMER_START("poly->DoubleCRT");
   assert(s.last() < context.numPrimes());
@@ -316,16 +638,13 @@ DoubleCRT::DoubleCRT(const ZZX& poly, const FHEcontext &_context, const IndexSet
   map.insert(s);
   if (dryRun) return;
 
-  // convert the integer polynomial to FFT representation modulo the primes
-  for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    const Cmodulus &pi = context.ithModulus(i);
-    pi.FFT(map[i], poly); // reduce mod pi and store FFT image
-  }
+  *this = poly; // reduce mod the primes and store the FFT images
   FHE_NTIMER_STOP("poly->DoubleCRT");
 }
 
 DoubleCRT::DoubleCRT(const ZZX& poly, const FHEcontext &_context)
-: context(_context), map(new DoubleCRTHelper(_context))
+: context(_context), map(_context.zMStar.getPhiM()),
+  cmap(_context.zMStar.getPhiM())
 {
   FHE_NTIMER_START("poly->DoubleCRT");
   IndexSet s = IndexSet(0, context.numPrimes()-1);
@@ -334,16 +653,28 @@ DoubleCRT::DoubleCRT(const ZZX& poly, const FHEcontext &_context)
   map.insert(s);
   if (dryRun) return;
 
-  // convert the integer polynomial to FFT representation modulo the primes
-  for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    const Cmodulus &pi = context.ithModulus(i);
-    pi.FFT(map[i], poly); // reduce mod pi and store FFT image
-  }
+  *this = poly; // reduce mod the primes and store the FFT images
+  FHE_NTIMER_STOP("poly->DoubleCRT");
+}
+
+DoubleCRT::DoubleCRT(const vector<long>& poly, const FHEcontext &_context,
+                     const IndexSet& s)
+: context(_context), map(_context.zMStar.getPhiM()),
+  cmap(_context.zMStar.getPhiM())
+{
+  FHE_NTIMER_START("poly->DoubleCRT");
+  assert(s.last() < context.numPrimes());
+
+  map.insert(s);
+  if (dryRun) return;
+
+  *this = poly;
   FHE_NTIMER_STOP("poly->DoubleCRT");
 }
 
 DoubleCRT::DoubleCRT(const ZZX& poly)
-: context(*activeContext), map(new DoubleCRTHelper(*activeContext))
+: context(*activeContext), map(activeContext->zMStar.getPhiM()),
+  cmap(activeContext->zMStar.getPhiM())
 {
   FHE_NTIMER_START("poly->DoubleCRT");
   IndexSet s = IndexSet(0, context.numPrimes()-1);
@@ -352,16 +683,89 @@ DoubleCRT::DoubleCRT(const ZZX& poly)
   map.insert(s);
   if (dryRun) return;
 
-  // convert the integer polynomial to FFT representation modulo the primes
-  for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    const Cmodulus &pi = context.ithModulus(i);
-    pi.FFT(map[i], poly); // reduce mod pi and store FFT image
+  *this = poly; // reduce mod the primes and store the FFT images
+  FHE_NTIMER_STOP("poly->DoubleCRT");
+}
+
+void DoubleCRT::fromPolys(vector<DoubleCRT>& dcrts, const vector<ZZX>& polys,
+                          const FHEcontext& context, const IndexSet& s)
+{
+  FHE_NTIMER_START("poly->DoubleCRT");
+  assert(s.last() < context.numPrimes());
+
+  long n = polys.size();
+  dcrts.clear();
+  dcrts.resize(n, DoubleCRT(context, IndexSet::emptySet()));
+  for (long k = 0; k < n; k++) dcrts[k].map.insert(s);
+  if (dryRun || n == 0) return;
+
+  // the polynomials with small coefficients skip the ZZ arithmetic, the
+  // others are reduced modulo every prime
+  vector< vector<long> > c(n);
+  vector<DoubleCRT*> smallOut, bigOut;
+  vector<const long*> smallIn;
+  vector<const ZZX*> bigIn;
+  for (long k = 0; k < n; k++) {
+    if (smallCoeffs(c[k], polys[k], context, s)) {
+      smallOut.push_back(&dcrts[k]);
+      smallIn.push_back(&c[k][0]);
+    }
+    else {
+      bigOut.push_back(&dcrts[k]);
+      bigIn.push_back(&polys[k]);
+    }
+  }
+  smallFFT(smallOut.data(), smallIn.data(), smallOut.size());
+
+  long nBig = bigOut.size();
+  for (long k = 0; k < nBig; k++) bigOut[k]->map.unshare();
+  if (nBig > 0)
+    forEachRow(context, s, [&](long i, long, long) {
+      vector<long*> out(nBig);
+      for (long k = 0; k < nBig; k++) out[k] = bigOut[k]->map[i];
+      context.ithModulus(i).FFT(&out[0], &bigIn[0], nBig);
+    }, /*split=*/false);
+  FHE_NTIMER_STOP("poly->DoubleCRT");
+}
+
+void DoubleCRT::fromPolys(vector<DoubleCRT>& dcrts,
+                          const vector< vector<long> >& polys,
+                          const FHEcontext& context, const IndexSet& s)
+{
+  long n = polys.size();
+  vector< vector<long> > c(n);
+  bool allSmall = true;
+  for (long k = 0; k < n && allSmall; k++)
+    allSmall = smallCoeffs(c[k], polys[k], context, s);
+
+  if (!allSmall) { // unusual, go through ZZX
+    vector<ZZX> tmp(n);
+    for (long k = 0; k < n; k++) convert(tmp[k], polys[k]);
+    fromPolys(dcrts, tmp, context, s);
+    return;
+  }
+
+  FHE_NTIMER_START("poly->DoubleCRT");
+  assert(s.last() < context.numPrimes());
+  dcrts.clear();
+  dcrts.resize(n, DoubleCRT(context, IndexSet::emptySet()));
+  for (long k = 0; k < n; k++) dcrts[k].map.insert(s);
+
+  if (!dryRun && n > 0) {
+    vector<DoubleCRT*> out(n);
+    vector<const long*> in(n);
+    for (long k = 0; k < n; k++) {
+      out[k] = &dcrts[k];
+      in[k] = &c[k][0];
+    }
+    smallFFT(&out[0], &in[0], n);
   }
   FHE_NTIMER_STOP("poly->DoubleCRT");
 }
 
 DoubleCRT::DoubleCRT(const FHEcontext &_context, const IndexSet& s)
-: context(_context), map(new DoubleCRTHelper(_context))
+: context(_context), map(_context.zMStar.getPhiM()),
+  cmap(_context.zMStar.getPhiM())
 {
   assert(s.last() < context.numPrimes());
 
@@ -371,13 +775,14 @@ DoubleCRT::DoubleCRT(const FHEcontext &_context, const IndexSet& s)
   long phim = context.zMStar.getPhiM();
 
   for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    vec_long& row = map[i];
+    long* row = map[i];
     for (long j = 0; j < phim; j++) row[j] = 0;
   }
 }
 
 DoubleCRT::DoubleCRT(const FHEcontext &_context)
-: context(_context), map(new DoubleCRTHelper(_context))
+: context(_context), map(_context.zMStar.getPhiM()),
+  cmap(_context.zMStar.getPhiM())
 {
   IndexSet s = IndexSet(0, context.numPrimes()-1);
   // FIXME: maybe the default index set should be determined by context?
@@ -388,7 +793,7 @@ DoubleCRT::DoubleCRT(const FHEcontext &_context)
   long phim = context.zMStar.getPhiM();
 
   for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    vec_long& row = map[i];
+    long* row = map[i];
     for (long j = 0; j < phim; j++) row[j] = 0;
   }
 }
@@ -401,22 +806,43 @@ DoubleCRT& DoubleCRT::operator=(const DoubleCRT& other)
    if (&context != &other.context) 
       Error("DoubleCRT assignment: incompatible contexts");
 
-   if (map.getIndexSet() != other.map.getIndexSet()) {
-      map = other.map; // copy the data
-   }
-   else {
-      const IndexSet& s = map.getIndexSet();
-      long phim = context.zMStar.getPhiM();
-      for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-         vec_long& row = map[i];
-         const vec_long& other_row = other.map[i];
-         for (long j = 0; j < phim; j++)
-            row[j] = other_row[j];
-      }
-   }
+   map = other.map; // shares the rows until one of the copies is modified
+   cmap = other.cmap;
+   stale = other.stale;
    return *this;
 }
 
+DoubleCRT::DoubleCRT(DoubleCRT&& other) noexcept
+: context(other.context), map(std::move(other.map)),
+  cmap(std::move(other.cmap))
+{
+  std::swap(stale, other.stale);
+}
+
+DoubleCRT& DoubleCRT::operator=(DoubleCRT&& other)
+{
+  if (this == &other) return *this;
+
+  if (&context != &other.context) 
+    Error("DoubleCRT assignment: incompatible contexts");
+
+  map = std::move(other.map);
+  cmap = std::move(other.cmap);
+  stale.clear();
+  std::swap(stale, other.stale);
+  return *this;
+}
+
+void DoubleCRT::swap(DoubleCRT& other)
+{
+  if (&context != &other.context) 
+    Error("DoubleCRT swap: incompatible contexts");
+
+  map.swap(other.map);
+  cmap.swap(other.cmap);
+  std::swap(stale, other.stale);
+}
+
 #if 0
 // Copy only the primes in s \intersect other.getIndexSet()
 void DoubleCRT::partialCopy(const DoubleCRT& other, const IndexSet& _s)
@@ -432,8 +858,8 @@ void DoubleCRT::partialCopy(const DoubleCRT& other, const IndexSet& _s)
 
    long phim = context.zMStar.getPhiM();
    for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-     vec_long& row = map[i];
-     const vec_long& other_row = other.map[i];
+     long* row = map[i];
+     const long* other_row = other.map[i];
      for (long j = 0; j < phim; j++)
        row[j] = other_row[j];
    }
@@ -445,10 +871,31 @@ DoubleCRT& DoubleCRT::operator=(const ZZX&poly)
   if (dryRun) return *this;
 
   const IndexSet& s = map.getIndexSet();
+  vector<long> c;
+  if (smallCoeffs(c, poly, context, s))
+    setSmall(c);
+  else {
+    dropCoeffs();
+    map.unshare();
+    forEachRow(context, s, [&](long i, long, long) {
+      context.ithModulus(i).FFT(map[i],poly); // reduce mod pi and store FFT image
+    }, /*split=*/false);
+  }
+  return *this;
+}
 
-  for (long i = s.first(); i <= s.last(); i = s.next(i)) 
-    context.ithModulus(i).FFT(map[i],poly); // reduce mod pi and store FFT image
+DoubleCRT& DoubleCRT::operator=(const vector<long>& poly)
+{
+  if (dryRun) return *this;
 
+  vector<long> c;
+  if (smallCoeffs(c, poly, context, map.getIndexSet()))
+    setSmall(c);
+  else {
+    ZZX tmp;
+    convert(tmp, poly);
+    *this = tmp;
+  }
   return *this;
 }
 
@@ -459,8 +906,10 @@ DoubleCRT& DoubleCRT::operator=(const ZZ& num)
 
   long phim = context.zMStar.getPhiM();
 
+  dropCoeffs();
+  map.unshare();
   for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    vec_long& row = map[i];
+    long* row = map[i];
     long pi = context.ithPrime(i);
     long n = rem(num, pi);
 
@@ -483,27 +932,189 @@ FHE_TIMER_START
     return;
   }
 
-  clear(poly);
-  ZZ prod;
-  prod = 1;
+  // The inverse FFT of all the rows, in parallel, then z_k = x_k*(P/p_k)^{-1}
+  // mod p_k (see CRTTable). This does not use NTL's current modulus, so it
+  // is safe to call from any thread
+  shared_ptr<const CRTTable> tab = context.getCRTTable(s1);
+  long phim = context.zMStar.getPhiM();
+  RowMap coeffs(phim);
+  crtCoeffs(coeffs, *tab);
+  crtCombine(poly, coeffs, *tab, phim, positive);
+FHE_TIMER_STOP
+}
+
+void DoubleCRT::toPolys(vector<ZZX>& polys, const vector<const DoubleCRT*>& dcrts,
+                        const IndexSet& s, bool positive)
+{
+FHE_TIMER_START
+  long n = dcrts.size();
+  polys.resize(n);
+  if (dryRun || n == 0) return;
 
-  zz_pBak bak; bak.save();
+  const FHEcontext& context = dcrts[0]->context;
+  IndexSet s1 = dcrts[0]->map.getIndexSet() & s;
+  for (long k = 1; k < n; k++)
+    assert(dcrts[k]->map.getIndexSet() == dcrts[0]->map.getIndexSet());
 
-  for (long i = s1.first(); i <= s1.last(); i = s1.next(i)) {
-    context.ithModulus(i).restoreModulus();
-    zz_pX& tmp = context.ithModulus(i).getScratch();
-    context.ithModulus(i).iFFT(tmp, map[i]); 
-    CRT(poly, prod, tmp);  // NTL :-)
+  if (empty(s1)) {
+    for (long k = 0; k < n; k++) clear(polys[k]);
+    return;
   }
 
-  if (positive) {
-    long d = deg(poly);
-    for (long j = 0; j <= d; j++) 
-      if (poly.rep[j] < 0)
-        poly.rep[j] += prod;   
+  shared_ptr<const CRTTable> tab = context.getCRTTable(s1);
+  long phim = context.zMStar.getPhiM();
+  vector<RowMap> coeffs(n, RowMap(phim));
+  crtCoeffs(&coeffs[0], &dcrts[0], n, *tab);
+  for (long k = 0; k < n; k++)
+    crtCombine(polys[k], coeffs[k], *tab, phim, positive);
+FHE_TIMER_STOP
+}
+
+void DoubleCRT::crtCombine(ZZX& poly, const RowMap& coeffs,
+                           const CRTTable& tab, long phim, bool positive)
+{
+  // Accumulate sum_k z_k*(P/p_k) - v*P in 64-bit limbs, then convert to ZZ.
+  // The rounding of v can only be off by one for coefficients extremely
+  // close to +-P/2, those are corrected at the end
+  const vector<long>& primes = tab.primes;
+  long n = primes.size();
+  long nLimbs = tab.nLimbs;
+  const unsigned long* P = &tab.prodLimbs[0];
+  vector<unsigned long> acc(nLimbs);
+  poly.rep.SetLength(phim);
+  for (long j = 0; j < phim; j++) {
+    for (long l = 0; l < nLimbs; l++) acc[l] = 0;
+    double frac = 0.0;
+    for (long k = 0; k < n; k++) {
+      unsigned long z = coeffs[primes[k]][j];
+      frac += z * tab.recip[k];
+      const unsigned long* hat = &tab.hatLimbs[k*nLimbs];
+      unsigned long carry = 0;
+      for (long l = 0; l < nLimbs; l++) {
+        unsigned __int128 t = (unsigned __int128) z * hat[l] + acc[l] + carry;
+        acc[l] = (unsigned long) t;
+        carry = (unsigned long) (t >> 64);
+      }
+    }
+    unsigned long v = (unsigned long) floor(frac + 0.5);
+    unsigned long carry = 0, borrow = 0;
+    for (long l = 0; l < nLimbs; l++) { // acc -= v*P
+      unsigned __int128 t = (unsigned __int128) v * P[l] + carry;
+      unsigned long lo = (unsigned long) t;
+      carry = (unsigned long) (t >> 64);
+      unsigned long a = acc[l];
+      acc[l] = a - lo - borrow;
+      borrow = (a < lo || (a == lo && borrow))? 1 : 0;
+    }
+
+    bool negative = (acc[nLimbs-1] >> 63) != 0;
+    if (negative) { // two's complement
+      unsigned long c = 1;
+      for (long l = 0; l < nLimbs; l++) {
+        acc[l] = ~acc[l] + c;
+        c = (c && acc[l] == 0)? 1 : 0;
+      }
+    }
+    ZZ& x = poly.rep[j];
+    ZZFromLimbs(x, &acc[0], nLimbs);
+    if (negative) NTL::negate(x, x);
+
+    if (x > tab.halfProd)         x -= tab.prod;
+    else if (x < tab.negHalfProd) x += tab.prod;
+    if (positive && sign(x) < 0)   x += tab.prod;
+  }
+  poly.normalize();
+}
+
+void DoubleCRT::crtCoeffs(RowMap& coeffs, const CRTTable& tab) const
+{
+  const DoubleCRT* self = this;
+  crtCoeffs(&coeffs, &self, 1, tab);
+}
+
+void DoubleCRT::crtCoeffs(RowMap* coeffs, const DoubleCRT* const* src, long n,
+                          const CRTTable& tab)
+{
+  const FHEcontext& context = src[0]->context;
+  long phim = context.zMStar.getPhiM();
+  IndexSet s;
+  for (size_t k = 0; k < tab.primes.size(); k++) s.insert(tab.primes[k]);
+  for (long t = 0; t < n; t++) {
+    coeffs[t].insert(s);
+    coeffs[t].unshare();
+  }
+  forEachRow(context, s, [&](long i, long, long) {
+    const Cmodulus& mod = context.ithModulus(i);
+    unsigned long p = mod.getQ();
+    long k = lower_bound(tab.primes.begin(), tab.primes.end(), i)
+             - tab.primes.begin();
+
+    // the rows whose coefficients are not cached need an inverse FFT
+    vector<const long*> c(n);
+    vector<long*> z;
+    vector<const long*> x;
+    for (long t = 0; t < n; t++) {
+      if (src[t]->cmap.getIndexSet().contains(i))
+        c[t] = src[t]->coeffRows()[i];
+      else {
+        c[t] = coeffs[t][i];
+        z.push_back(coeffs[t][i]);
+        x.push_back(src[t]->map[i]);
+      }
+    }
+    if (!z.empty()) mod.iFFT(&z[0], &x[0], z.size());
+    for (long t = 0; t < n; t++) {
+      long* out = coeffs[t][i];
+      for (long j = 0; j < phim; j++)
+        out[j] = shoupMulMod(c[t][j], tab.hatInv[k], tab.hatInvPre[k], p);
+    }
+  }, /*split=*/false);
+}
+
+// The same as toPoly(p,s), reduced to (-q/2,q/2] for a single-precision q
+void DoubleCRT::toPolyMod(ZZX& poly, long q, const IndexSet& s) const
+{
+FHE_TIMER_START
+  if (dryRun) return;
+  assert(q >= 2);
+
+  IndexSet s1 = map.getIndexSet() & s;
+  if (empty(s1)) {
+    clear(poly);
+    return;
+  }
 
-    // no need to normalize poly here
+  shared_ptr<const CRTTable> tab = context.getCRTTable(s1);
+  long phim = context.zMStar.getPhiM();
+  RowMap coeffs(phim);
+  crtCoeffs(coeffs, *tab);
+
+  // c mod q = sum_k z_k*(P/p_k mod q) - v*(P mod q)
+  const vector<long>& primes = tab->primes;
+  long n = primes.size();
+  vector<long> hatModQ(n);
+  ZZ hat;
+  for (long k = 0; k < n; k++) {
+    div(hat, tab->prod, context.ithPrime(primes[k]));
+    hatModQ[k] = rem(hat, q);
   }
+  long prodModQ = rem(tab->prod, q);
+
+  poly.rep.SetLength(phim);
+  for (long j = 0; j < phim; j++) {
+    double frac = 0.0;
+    long c = 0;
+    for (long k = 0; k < n; k++) {
+      long z = coeffs[primes[k]][j];
+      frac += z * tab->recip[k];
+      c = AddMod(c, MulMod(z % q, hatModQ[k], q), q);
+    }
+    long v = (long) floor(frac + 0.5);
+    c = SubMod(c, MulMod(v % q, prodModQ, q), q);
+    if (c > q/2) c -= q;
+    conv(poly.rep[j], c);
+  }
+  poly.normalize();
 FHE_TIMER_STOP
 }
 
@@ -568,21 +1179,183 @@ void DoubleCRT::toPoly(ZZX& p, bool positive) const
   toPoly(p, s, positive);
 }
 
+// Fused multiply-accumulate, *this += a*b, wrt the primes of *this.
+// Each row of *this is updated in a single pass, without temporaries.
+DoubleCRT& DoubleCRT::MulAdd(const DoubleCRT& a, const DoubleCRT& b)
+{
+  if (dryRun) return *this;
+
+  if (&context != &a.context || &context != &b.context)
+    Error("DoubleCRT MulAdd: incompatible contexts");
+
+  const IndexSet& s = map.getIndexSet();
+  assert(s <= a.map.getIndexSet() && s <= b.map.getIndexSet());
+  evalForm();
+  a.evalForm(s);
+  b.evalForm(s);
+  map.unshare();
+
+  forEachRow(context, s, [&](long i, long lo, long hi) {
+    const Cmodulus& mod = context.ithModulus(i);
+    rowMulAddMod(map[i]+lo, a.map[i]+lo, b.map[i]+lo, hi-lo,
+                 mod.getQ(), mod.getQInv());
+  });
+  dropCoeffs();
+  return *this;
+}
+
+// *this += a*b + c*d, wrt the primes of *this
+DoubleCRT& DoubleCRT::MulAdd(const DoubleCRT& a, const DoubleCRT& b,
+                             const DoubleCRT& c, const DoubleCRT& d)
+{
+  if (dryRun) return *this;
+
+  if (&context != &a.context || &context != &b.context
+      || &context != &c.context || &context != &d.context)
+    Error("DoubleCRT MulAdd: incompatible contexts");
+
+  const IndexSet& s = map.getIndexSet();
+  assert(s <= a.map.getIndexSet() && s <= b.map.getIndexSet()
+         && s <= c.map.getIndexSet() && s <= d.map.getIndexSet());
+  evalForm();
+  a.evalForm(s);
+  b.evalForm(s);
+  map.unshare();
+  c.evalForm(s);
+  d.evalForm(s);
+
+  forEachRow(context, s, [&](long i, long lo, long hi) {
+    const Cmodulus& mod = context.ithModulus(i);
+    rowMulAddMod(map[i]+lo, a.map[i]+lo, b.map[i]+lo, c.map[i]+lo,
+                 d.map[i]+lo, hi-lo, mod.getQ(), mod.getQInv());
+  });
+  dropCoeffs();
+  return *this;
+}
+
+DoubleCRTAccumulator::DoubleCRTAccumulator(const FHEcontext& _context,
+                                           const IndexSet& s):
+  context(_context), map(2*_context.zMStar.getPhiM())
+{
+  map.insert(s);
+  clear();
+}
+
+void DoubleCRTAccumulator::clear()
+{
+  nTerms = 0;
+  if (DoubleCRT::dryRun) return;
+
+  const IndexSet& s = map.getIndexSet();
+  long len = map.rowLength();
+  map.unshare();
+  for (long i = s.first(); i <= s.last(); i = s.next(i))
+    memset(map[i], 0, len*sizeof(long));
+}
+
+// Reduce all the sums to [0,q) in place, so more terms can be added
+void DoubleCRTAccumulator::fold()
+{
+  map.unshare();
+  long phim = context.zMStar.getPhiM();
+  forEachRow(context, map.getIndexSet(), [&](long i, long first, long last) {
+    const Cmodulus& mod = context.ithModulus(i);
+    long* lo = map[i] + first;
+    long* hi = map[i] + phim + first;
+    rowReduceLazy(lo, lo, hi, last-first, mod.getQ(), mod.getQInv());
+    memset(hi, 0, (last-first)*sizeof(long));
+  });
+  nTerms = 0;
+}
+
+void DoubleCRTAccumulator::add(const DoubleCRT& a)
+{
+  if (DoubleCRT::dryRun) return;
+
+  if (&context != &a.context)
+    Error("DoubleCRTAccumulator add: incompatible contexts");
+
+  const IndexSet& s = map.getIndexSet();
+  assert(s <= a.map.getIndexSet());
+  a.evalForm(s);
+  if (nTerms >= ROWOPS_LAZY_TERMS) fold();
+  map.unshare();
+
+  forEachRow(context, s, [&](long i, long lo, long hi) {
+    rowAddLazy(map[i]+lo, a.map[i]+lo, hi-lo, context.ithPrime(i));
+  });
+  nTerms++;
+}
+
+void DoubleCRTAccumulator::addMul(const DoubleCRT& a, const DoubleCRT& b)
+{
+  if (DoubleCRT::dryRun) return;
+
+  if (&context != &a.context || &context != &b.context)
+    Error("DoubleCRTAccumulator addMul: incompatible contexts");
+
+  const IndexSet& s = map.getIndexSet();
+  assert(s <= a.map.getIndexSet() && s <= b.map.getIndexSet());
+  a.evalForm(s);
+  b.evalForm(s);
+  if (nTerms >= ROWOPS_LAZY_TERMS) fold();
+  map.unshare();
+
+  long phim = context.zMStar.getPhiM();
+  forEachRow(context, s, [&](long i, long first, long last) {
+    const Cmodulus& mod = context.ithModulus(i);
+    long* lo = map[i] + first;
+    rowMulAddLazy(lo, lo + phim, a.map[i]+first, b.map[i]+first, last-first,
+                  mod.getQ(), mod.getQInv());
+  });
+  nTerms++;
+}
+
+void DoubleCRTAccumulator::reduce(DoubleCRT& out) const
+{
+  if (&context != &out.context)
+    Error("DoubleCRTAccumulator reduce: incompatible contexts");
+
+  const IndexSet& s = map.getIndexSet();
+  if (out.map.getIndexSet() != s) {
+    out.map.clear();
+    out.map.insert(s);
+  }
+  out.dropCoeffs();
+  if (DoubleCRT::dryRun) return;
+  out.map.unshare();
+
+  long phim = context.zMStar.getPhiM();
+  forEachRow(context, s, [&](long i, long first, long last) {
+    const Cmodulus& mod = context.ithModulus(i);
+    const long* lo = map[i] + first;
+    rowReduceLazy(out.map[i]+first, lo, lo + phim, last-first,
+                  mod.getQ(), mod.getQInv());
+  });
+}
+
 // Division by constant
 DoubleCRT& DoubleCRT::operator/=(const ZZ &num)
 {
   if (dryRun) return *this;
 
   const IndexSet& s = map.getIndexSet();
-  long phim = context.zMStar.getPhiM();
-  
+  vector<long> n(s.last()+1);
   for (long i = s.first(); i <= s.last(); i = s.next(i)) {
     long pi = context.ithPrime(i);
-    long n = InvMod(rem(num, pi),pi);  // n = num^{-1} mod pi
-    vec_long& row = map[i];
-    for (long j = 0; j < phim; j++)
-      row[j] = MulMod(row[j], n, pi);
+    n[i] = InvMod(rem(num, pi),pi);  // n = num^{-1} mod pi
   }
+  map.unshare();
+  cmap.unshare();
+
+  forEachRow(context, s / stale, [&](long i, long lo, long hi) {
+    const Cmodulus& mod = context.ithModulus(i);
+    rowMulModConst(map[i]+lo, n[i], hi-lo, mod.getQ(), mod.getQInv());
+  });
+  forEachRow(context, cmap.getIndexSet(), [&](long i, long lo, long hi) {
+    const Cmodulus& mod = context.ithModulus(i);
+    rowMulModConst(cmap[i]+lo, n[i], hi-lo, mod.getQ(), mod.getQInv());
+  });
   return *this;
 }
 
@@ -591,15 +1364,18 @@ void DoubleCRT::Exp(long e)
 {
   if (dryRun) return;
 
-  const IndexSet& s = map.getIndexSet();
-  long phim = context.zMStar.getPhiM();
-  
-  for (long i = s.first(); i <= s.last(); i = s.next(i)) {
+  evalForm();
+  dropCoeffs();
+  map.unshare();
+
+  forEachRow(context, map.getIndexSet(), [&](long i, long lo, long hi) {
     long pi = context.ithPrime(i);
-    vec_long& row = map[i];
-    for (long j = 0; j < phim; j++)
-      row[j] = PowerMod(row[j], e, pi);
-  }
+    long* row = map[i];
+    if (pi < NTL_SP_BOUND)
+      for (long j = lo; j < hi; j++) row[j] = PowerMod(row[j], e, pi);
+    else // a wide prime
+      for (long j = lo; j < hi; j++) row[j] = powModWide(row[j], e, pi);
+  });
 }
 
 // Apply the automorphism F(X) --> F(X^k)  (with gcd(k,m)=1)
@@ -607,30 +1383,24 @@ void DoubleCRT::automorph(long k)
 {
   if (dryRun) return;
 
-  const PAlgebra& zMStar = context.zMStar;
-  if (!zMStar.inZmStar(k))
-    Error("DoubleCRT::automorph: k not in Zm*");
-
-  long m = zMStar.getM();
-  vector<long> tmp(m);  // temporary array of size m
-
-  const IndexSet& s = map.getIndexSet();
-
-  // go over the rows, permute them one at a time
-  for (long i = s.first(); i <= s.last(); i = s.next(i)) {
-    vec_long& row = map[i];
-
-    for (long j=1; j<m; j++) { // 1st pass: copy to temporary array
-      long idx = zMStar.indexInZmstar(j); // returns -1 if j \notin (Z/mZ)*
-      if (idx>=0) tmp[j] = row[idx];
-    }
+  // the gather table new[i] = old[t[i]], cached in the context
+  shared_ptr< const vector<long> > table = context.getAutomorphTable(k);
+  const long* t = &(*table)[0];
 
-    for (long j=1; j<m; j++) { // 2nd pass: copy back from temporary array
-      long idx = zMStar.indexInZmstar(j); // returns -1 if j \notin (Z/mZ)*
-      if (idx>=0) row[idx] = tmp[MulMod(j,k,m)];
-                                           // new[j] = old[j*k mod m]
-    }    
-  }
+  long phim = context.zMStar.getPhiM();
+  evalForm(); // the automorphism is a permutation of the evaluations only
+  dropCoeffs();
+  map.unshare();
+
+  // go over the rows, permute them one at a time (a gather reads the
+  // whole row, so rows are not split among threads)
+  forEachRow(context, map.getIndexSet(), [&](long i, long, long) {
+    static thread_local vector<long> tmp;  // temporary row
+    tmp.resize(phim);
+    long* row = map[i];
+    rowGather(&tmp[0], row, t, phim);
+    memcpy(row, &tmp[0], phim*sizeof(long));
+  }, /*split=*/false);
 }
 
 // fills each row i with random integers mod pi
@@ -639,18 +1409,39 @@ void DoubleCRT::randomize(const ZZ* seed)
   if (dryRun) return;
 
   if (seed != NULL) SetSeed(*seed);
+  dropCoeffs();
+  map.unshare();
 
   const IndexSet& s = map.getIndexSet();
   long phim = context.zMStar.getPhiM();
   
   for (long i = s.first(); i <= s.last(); i = s.next(i)) {
     long pi = context.ithPrime(i);
-    vec_long& row = map[i];
+    long* row = map[i];
     for (long j = 0; j < phim; j++)
       row[j] = RandomBnd(pi);   // RandomBnd is defined in NTL's module ZZ
   }
 }
 
+// fills each row i with pseudorandom integers mod pi, from the substream
+// of the seed with nonce (index,i); different rows use different streams,
+// so they can be generated in parallel, and the row of each prime does not
+// depend on the other primes in the IndexSet
+void DoubleCRT::randomize(const ZZ& seed, long index)
+{
+  if (dryRun) return;
+  dropCoeffs();
+  map.unshare();
+
+  long phim = context.zMStar.getPhiM();
+  forEachRow(context, map.getIndexSet(), [&](long i, long, long) {
+    PRGStream prg(seed, ((unsigned long) index << 32) | (unsigned long) i);
+    long pi = context.ithPrime(i);
+    long* row = map[i];
+    for (long j = 0; j < phim; j++) row[j] = prg.nextBnd(pi);
+  }, /*split=*/false);
+}
+
 DoubleCRT& DoubleCRT::operator=(const SingleCRT& scrt)
 {
   if (&context != &scrt.getContext())
@@ -659,11 +1450,14 @@ DoubleCRT& DoubleCRT::operator=(const SingleCRT& scrt)
   map.clear();  // empty the map
   const IndexSet& s = scrt.getMap().getIndexSet();
   map.insert(s);
+  dropCoeffs();
   
   if (dryRun) return *this;
+  map.unshare();
 
-  for (long i = s.first(); i <= s.last(); i = s.next(i)) 
+  forEachRow(context, s, [&](long i, long, long) {
     context.ithModulus(i).FFT(map[i],scrt.getMap()[i]); // compute FFT image
+  }, /*split=*/false);
   return *this;
 }
 
@@ -676,11 +1470,18 @@ void DoubleCRT::toSingleCRT(SingleCRT& scrt, const IndexSet& s) const
   scrt.map.clear();
   scrt.map.insert(s1);
 
+  long phim = context.zMStar.getPhiM();
+  vector<long> tmp(phim);
   for (long i = s1.first(); i <= s1.last(); i = s1.next(i)) {
-    context.ithModulus(i).restoreModulus();
-    zz_pX tmp;
-    context.ithModulus(i).iFFT(tmp, map[i]); // inverse FFT
-    conv(scrt.map[i], tmp);
+    const long* c = &tmp[0];
+    if (cmap.getIndexSet().contains(i))
+      c = coeffRows()[i];
+    else
+      context.ithModulus(i).iFFT(&tmp[0], map[i]); // inverse FFT
+    ZZX& poly = scrt.map[i];
+    poly.rep.SetLength(phim);
+    for (long j = 0; j < phim; j++) conv(poly.rep[j], c[j]);
+    poly.normalize();
   }
 }
 
@@ -704,51 +1505,131 @@ void DoubleCRT::scaleDownToSet(const IndexSet& s, long ptxtSpace)
     return;
   }
 
-  ZZX delta;
-  ZZ diffProd = context.productOfPrimes(diff); // mod-down by this factor
-  toPoly(delta, diff); // convert to coeff-representation modulo diffProd
+  // We subtract from *this the polynomial delta, which equals *this modulo
+  // the product D of the dropped primes, is divisible by ptxtSpace, and has
+  // small coefficients, and then divide by D. Everything is done in RNS,
+  // with the constants from the mod-down table (see ModDownTable).
+  //
+  // For each coefficient, let c = sum_i y_i*(D/d_i) - v*D be the balanced
+  // representative of *this mod D and e = c*D^{-1} mod ptxtSpace (also
+  // balanced), then delta = c - e*D and modulo every kept prime q_j
+  //   (x - delta)/D = x*D^{-1} - sum_i y_i*d_i^{-1} + v + e.
+  IndexSet kept = getIndexSet() & s;
+  shared_ptr<const ModDownTable> tab = context.getModDownTable(diff, kept);
+  const vector<long>& dropped = tab->dropped;
+  long nd = dropped.size();
+  long phim = context.zMStar.getPhiM();
 
-  long delta_len = delta.rep.length();
-  if (ptxtSpace == 2) { // simpler handling for plaintext space mod 2
-    for (long i = 0; i < delta_len; i++) {
-      if (IsOdd(delta.rep[i])) { // add or subtract diffProd to make it even
-	if (sign(delta.rep[i]) < 0) delta.rep[i] += diffProd;
-	else                        delta.rep[i] -= diffProd;
-      }
+  // The coefficients modulo the dropped primes, y_i = x_i*(D/d_i)^{-1} mod d_i
+  RowMap y(phim);
+  y.insert(diff);
+  vector<long> pos(context.numPrimes()); // positions in dropped or kept
+  for (long i = 0; i < nd; i++) pos[dropped[i]] = i;
+  for (long j = 0; j < (long) tab->kept.size(); j++) pos[tab->kept[j]] = j;
+  coeffForm(diff);
+  const RowMap& evals = map; // read-only here, map may still be shared
+  forEachRow(context, diff, [&](long i, long, long) {
+    const Cmodulus& mod = context.ithModulus(i);
+    unsigned long di = mod.getQ();
+    unsigned long h = tab->hatInv[pos[i]], hPre = tab->hatInvPre[pos[i]];
+    long* yi = y[i];
+    const long* c = yi;
+    if (cmap.getIndexSet().contains(i))
+      c = coeffRows()[i];
+    else
+      mod.iFFT(yi, evals[i]);
+    for (long k = 0; k < phim; k++) yi[k] = shoupMulMod(c[k], h, hPre, di);
+  }, /*split=*/false);
+
+  // ve[k] = v+e for the k'th coefficient
+  vector<long> ve(phim);
+  vector<long> dInvP(nd); // d_i^{-1} mod ptxtSpace
+  if (ptxtSpace > 2)
+    for (long i = 0; i < nd; i++)
+      dInvP[i] = InvMod(context.ithPrime(dropped[i]) % ptxtSpace, ptxtSpace);
+  long p_over_2 = ptxtSpace/2;
+  for (long k = 0; k < phim; k++) {
+    double frac = 0.0;
+    for (long i = 0; i < nd; i++) frac += y[dropped[i]][k] * tab->dRecip[i];
+    long v = (long) floor(frac + 0.5);
+    long e;
+    if (ptxtSpace == 2) { // all the d_i are odd, so e = c mod 2
+      e = v;
+      for (long i = 0; i < nd; i++) e += y[dropped[i]][k];
+      // for odd c, add or subtract D to make it even, whichever is smaller
+      e = (e & 1)? ((frac < v)? -1 : 1) : 0;
     }
-  }
-  // The general case of plaintext space modulo some p > 2, we need to
-  // subtract from each coefficient delta[i] the ineteger
-  //               diffProd * (delta[i] * diffProd^{-1} mod ptxtSpace).
-  // This does not change delta modulo diffProd, but makes it divisible
-  // by ptxtSpace.
-  else {
-    long p_over_2 = ptxtSpace/2;
-    long prodInv = InvMod(rem(diffProd,ptxtSpace), ptxtSpace);
-    for (long i = 0; i < delta_len; i++) {
-      long delta_i_modP = rem(delta.rep[i],ptxtSpace);
-      if (delta_i_modP != 0) { // if not already 0 mod ptxtSpace
-	delta_i_modP = MulMod(delta_i_modP, prodInv, ptxtSpace);
-	if (delta_i_modP > p_over_2) delta_i_modP -= ptxtSpace;
-	delta.rep[i] -= diffProd * delta_i_modP;
-      }
+    else {
+      e = 0;
+      for (long i = 0; i < nd; i++)
+        e = AddMod(e, MulMod(y[dropped[i]][k] % ptxtSpace, dInvP[i],
+                             ptxtSpace), ptxtSpace);
+      e = SubMod(e, v % ptxtSpace, ptxtSpace);
+      if (e > p_over_2) e -= ptxtSpace;
     }
+    ve[k] = v + e;
   }
-  delta.normalize(); // need to normalize after working directly on then coeffs
 
+  // The kept rows whose coefficients are known are updated in coefficient
+  // form, without the FFT of w, and their evaluations become stale
   removePrimes(diff);// remove the primes from consideration
-  *this -= delta;    // convert delta to DoubleCRT, then subtract
-  *this /= diffProd; // *this is divisible by diffProd, so this operation actually scales it down
+  IndexSet inCoeffs = kept & cmap.getIndexSet();
+  map.unshare();
+  cmap.unshare();
+  forEachRow(context, kept, [&](long j, long, long) {
+    const Cmodulus& mod = context.ithModulus(j);
+    unsigned long q = mod.getQ();
+    long jj = pos[j];
+    const unsigned long* dInv = &tab->dInv[jj*nd];
+    const unsigned long* dInvPre = &tab->dInvPre[jj*nd];
+    assert(nd + ptxtSpace < (long) q); // so |v+e| < q
+
+    // w = sum_i y_i*d_i^{-1} - (v+e) mod q, then x = x*D^{-1} - FFT(w)
+    static thread_local vector<long> w;
+    w.resize(phim);
+    for (long k = 0; k < phim; k++)
+      w[k] = (ve[k] > 0)? q - ve[k] : -ve[k];
+    for (long i = 0; i < nd; i++) {
+      const long* yi = y[dropped[i]];
+      for (long k = 0; k < phim; k++) {
+        unsigned long t = w[k] + shoupMulMod(yi[k], dInv[i], dInvPre[i], q);
+        w[k] = (t >= q)? t-q : t;
+      }
+    }
+    long* row;
+    if (inCoeffs.contains(j))
+      row = cmap[j];
+    else {
+      mod.FFT(&w[0], &w[0]);
+      row = map[j];
+    }
+    unsigned long DInv = tab->DInv[jj], DInvPre = tab->DInvPre[jj];
+    for (long k = 0; k < phim; k++) {
+      unsigned long t = shoupMulMod(row[k], DInv, DInvPre, q);
+      row[k] = (t >= (unsigned long) w[k])? t-w[k] : t+q-w[k];
+    }
+  }, /*split=*/false);
+  stale.insert(inCoeffs);
 }
 
 ostream& operator<< (ostream &str, const DoubleCRT &d)
 {
+  d.evalForm();
   const IndexSet& set = d.map.getIndexSet();
 
   // check that the content of i'th row is in [0,pi) for all i
   str << "[" << set << endl;
-  for (long i = set.first(); i <= set.last(); i = set.next(i))
-    str << " " << d.map[i] << "\n";
+  long phim = d.context.zMStar.getPhiM();
+  for (long i = set.first(); i <= set.last(); i = set.next(i)) {
+    // same format as vec_long
+    const long* row = d.map[i];
+    str << " [";
+    for (long j = 0; j < phim; j++) {
+      if (j > 0) str << " ";
+      str << row[j];
+    }
+    str << "]\n";
+  }
   str << "]";
   return str;
 }
@@ -767,14 +1648,20 @@ istream& operator>> (istream &str, DoubleCRT &d)
   assert(set <= (context.specialPrimes | context.ctxtPrimes));
   d.map.clear();
   d.map.insert(set); // fix the index set for the data
+  d.map.unshare();
+  d.dropCoeffs();
 
+  vec_long v;
   for (long i = set.first(); i <= set.last(); i = set.next(i)) {
-    str >> d.map[i]; // read the actual data
+    str >> v; // read the actual data
 
     // verify that the data is valid
-    assert (d.map[i].length() == phim);
-    for (long j=0; j<phim; j++)
-      assert(d.map[i][j]>=0 && d.map[i][j]<context.ithPrime(i));
+    assert (v.length() == phim);
+    long* row = d.map[i];
+    for (long j=0; j<phim; j++) {
+      assert(v[j]>=0 && v[j]<context.ithPrime(i));
+      row[j] = v[j];
+    }
   }
 
   // Advance str beyond closing ']'
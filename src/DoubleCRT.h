@@ -25,6 +25,7 @@
 
 #ifdef USE_ALT_CRT
 #define DoubleCRT AltCRT
+#define DoubleCRTAccumulator AltCRTAccumulator
 #include "AltCRT.h"
 
 #else
@@ -35,41 +36,13 @@
 #include <NTL/ZZX.h>
 #include <NTL/vec_vec_long.h>
 #include "NumbTh.h"
-#include "IndexMap.h"
+#include "RowMap.h"
+#include "rowops.h"
 #include "FHEContext.h"
 NTL_CLIENT
 
 class SingleCRT;
 
-/**
-* @class DoubleCRTHelper
-* @brief A helper class to enforce consistency within an DoubleCRTHelper object
-*
-* See Section 2.6.2 of the design document (IndexMap)
-*/
-class DoubleCRTHelper : public IndexMapInit<vec_long> {
-private: 
-  long val;
-
-public:
-  DoubleCRTHelper(const FHEcontext& context) { 
-    val = context.zMStar.getPhiM(); 
-  }
-
-  /** @brief the init method ensures that all rows have the same size */
-  virtual void init(vec_long& v) { 
-    v.FixLength(val); 
-  }
-
-  /** @brief clone allocates a new object and copies the content */
-  virtual IndexMapInit<vec_long> * clone() const { 
-    return new DoubleCRTHelper(*this); 
-  }
-private:
-  DoubleCRTHelper(); // disable default constructor
-};
-
-
 /**
  * @class DoubleCRT
  * @brief Implementatigs polynomials (elements in the ring R_Q) in double-CRT form
@@ -80,44 +53,148 @@ private:
  * The polynomial thus represented is defined modulo the product of all the
  * primes in use.
  *
- * The list of primes is defined by the data member indexMap.
- * indexMap.getIndexSet() defines the set of indices of primes
+ * The list of primes is defined by the data member map.
+ * map.getIndexSet() defines the set of indices of primes
  * associated with this DoubleCRT object: they index the
  * primes stored in the associated FHEContext.
  *
+ * The rows are kept in a RowMap, i.e., in one cache-line-aligned buffer
+ * with direct row indexing by prime index. Removing primes only releases
+ * their rows, and adding primes reuses released rows when possible. The
+ * buffer is copy-on-write, so copies of a DoubleCRT (and of ciphertexts)
+ * share their rows until one of them is modified.
+ *
  * Arithmetic operations are computed modulo the product of the primes in use
  * and also modulo Phi_m(X). Arithmetic operations can only be applied to
  * DoubleCRT objects relative to the same context, trying to add/multiply
  * objects that have different FHEContext objects will raise an error.
+ *
+ * When context.lazyCRT is set, the object may also hold the coefficients
+ * of the polynomial modulo some of its primes, and for each prime at least
+ * one of the two forms is valid. The coefficients are kept when they are
+ * computed by an operation that modifies the object (scaleDownToSet, ...),
+ * and polynomials with small coefficients are stored as such, without an
+ * FFT.
+ * Additions, subtractions and multiplications by constants are done in
+ * every form that is valid for both operands, modulus switching is done in
+ * coefficient form when the coefficients are known, and the other
+ * operations (multiplication, automorphisms) convert to evaluation form
+ * first. None of this is visible through the interface, except that
+ * the const methods that need evaluations (using the object as an argument
+ * of arithmetic, breakIntoDigits, getMap) convert the stale rows in place.
+ * Hence an object in mixed form must not be read by several threads at
+ * once; the library calls toEvalForm on every DoubleCRT that it shares
+ * between threads (keys, key-switching matrices, prepared constants, the
+ * values of CtxtGraph), and the const methods never modify an object that
+ * is in evaluation form.
  **/
 class DoubleCRT {
   const FHEcontext& context; // the context
-  IndexMap<vec_long> map; // the data itself: if the i'th prime is in use then
-                          // map[i] is the vector of evaluations wrt this prime
+  RowMap map; // the data itself: if the i'th prime is in use then map[i]
+              // points to the phi(m) evaluations wrt this prime
+
+  // The lazy dual representation (see context.lazyCRT): cmap[i] holds the
+  // coefficients in [0,p_i) for the primes i in cmap.getIndexSet(), and
+  // the rows in map of the primes in stale are not valid. Always
+  // stale <= cmap.getIndexSet(), both are empty unless context.lazyCRT
+  mutable RowMap cmap;
+  mutable IndexSet stale;
+
+  // Make the rows of map valid for the primes in s, with FFTs of cmap. The
+  // rows of map are written through a const_cast: a mutable map would make
+  // every read of map in a const method go through the non-const
+  // operator[] of RowMap, which requires a private buffer
+  void evalForm(const IndexSet& s) const;
+  void evalForm() const { if (context.lazyCRT) evalForm(map.getIndexSet()); }
+
+  // In lazy mode, make cmap valid for the primes in s, with inverse FFTs
+  void coeffForm(const IndexSet& s);
+
+  // Called after map was modified in place: the rows of cmap are obsolete
+  void dropCoeffs() { cmap.clear(); stale.clear(); }
+
+  // Read-only access to cmap (which is mutable), the non-const operator[]
+  // of RowMap requires a private buffer
+  const RowMap& coeffRows() const { return cmap; }
 
   //! a "sanity check" method, verifies consistency of the map with
   //! current moduli chain, an error is raised if they are not consistent
   void verify();
 
+  // The coefficients of the rows in tab.primes, times (P/p_k)^{-1} mod p_k,
+  // for CRT reconstruction (see CRTTable)
+  void crtCoeffs(RowMap& coeffs, const CRTTable& tab) const;
+
+  // The same for the n objects src[0..n-1] together, into coeffs[0..n-1]
+  static void crtCoeffs(RowMap* coeffs, const DoubleCRT* const* src, long n,
+                        const CRTTable& tab);
+
+  // poly = the CRT reconstruction from the output of crtCoeffs
+  static void crtCombine(ZZX& poly, const RowMap& coeffs,
+                         const CRTTable& tab, long phim, bool positive);
+
+  // The rows of dst[k] = the FFTs of x[k][0..phi(m)-1], for 0<=k<n, where
+  // the coefficients are smaller (in absolute value) than all the primes.
+  // All the dst[k] must be defined over the same primes
+  static void smallFFT(DoubleCRT* const* dst, const long* const* x, long n);
+
+  // *this = the polynomial with the phi(m) coefficients c, all smaller (in
+  // absolute value) than the primes. In lazy mode only the coefficient
+  // rows are set, the FFTs are deferred until they are needed
+  void setSmall(const vector<long>& c);
+
   // Generic operators. 
   // The behavior when *this and other use different primes depends on the flag
   // matchIndexSets. When it is set to true then the effective modulus is
   // determined by the union of the two index sets; otherwise, the index set
   // of *this.
 
+  // The functors apply the operation to a whole row modulo the prime
+  // of that row, using the (possibly vectorized) kernels from rowops.h
+
+  // A linear operation can also be applied to the coefficient rows, and
+  // applyCoeff is the operation with a constant on a whole coefficient row
+
   class AddFun {
   public:
-    long apply(long a, long b, long n) { return AddMod(a, b, n); }
+    static bool linear() { return true; }
+
+    void apply(long* a, const long* b, long n, const Cmodulus& mod)
+    { rowAddMod(a, b, n, mod.getQ()); }
+
+    void apply(long* a, long b, long n, const Cmodulus& mod)
+    { rowAddModConst(a, b, n, mod.getQ()); }
+
+    void applyCoeff(long* a, long b, long, const Cmodulus& mod)
+    { rowAddModConst(a, b, 1, mod.getQ()); }
   };
 
   class SubFun {
   public:
-    long apply(long a, long b, long n) { return SubMod(a, b, n); }
+    static bool linear() { return true; }
+
+    void apply(long* a, const long* b, long n, const Cmodulus& mod)
+    { rowSubMod(a, b, n, mod.getQ()); }
+
+    void apply(long* a, long b, long n, const Cmodulus& mod)
+    { rowAddModConst(a, NegateMod(b, mod.getQ()), n, mod.getQ()); }
+
+    void applyCoeff(long* a, long b, long, const Cmodulus& mod)
+    { rowAddModConst(a, NegateMod(b, mod.getQ()), 1, mod.getQ()); }
   };
 
   class MulFun {
   public:
-    long apply(long a, long b, long n) { return MulMod(a, b, n); }
+    static bool linear() { return false; }
+
+    void apply(long* a, const long* b, long n, const Cmodulus& mod)
+    { rowMulMod(a, b, n, mod.getQ(), mod.getQInv()); }
+
+    void apply(long* a, long b, long n, const Cmodulus& mod)
+    { rowMulModConst(a, b, n, mod.getQ(), mod.getQInv()); }
+
+    void applyCoeff(long* a, long b, long n, const Cmodulus& mod)
+    { rowMulModConst(a, b, n, mod.getQ(), mod.getQInv()); }
   };
 
 
@@ -142,7 +219,11 @@ public:
   // the context. If the coefficients of poly are larger than the product of
   // the used primes, they are effectively reduced modulo that product
 
-  // copy constructor: default
+  //! @brief Copy constructor, the copy shares the rows (copy-on-write)
+  DoubleCRT(const DoubleCRT& other) = default;
+
+  //! @brief Move constructor, other is left without any primes
+  DoubleCRT(DoubleCRT&& other) noexcept;
 
   //! @brief Initializing DoubleCRT from a ZZX polynomial
   //! @param poly The ring element itself, zero if not specified
@@ -156,6 +237,13 @@ public:
   //  declared "explicit" to avoid implicit type conversion
   explicit DoubleCRT(const ZZX&poly); 
 
+  //! @brief Initializing DoubleCRT from the coefficients poly[0..n-1] of
+  //! a polynomial with small coefficients (noise, plaintexts, masks). When
+  //! n <= phi(m) and the coefficients are smaller than the primes, the
+  //! conversion needs no ZZ arithmetic at all
+  DoubleCRT(const vector<long>& poly, const FHEcontext& _context,
+            const IndexSet& indexSet);
+
  // Without specifying a ZZX, we get the zero polynomial
   explicit DoubleCRT(const FHEcontext &_context);
   // declare "explicit" to avoid implicit type conversion
@@ -169,12 +257,17 @@ public:
   //    DoubleCRT dCRT(context, indexSet); dCRT = poly;
 
   DoubleCRT& operator=(const DoubleCRT& other);
+  DoubleCRT& operator=(DoubleCRT&& other);
+
+  //! @brief Exchange the contents of *this and other (same context)
+  void swap(DoubleCRT& other);
 
   // Copy only the primes in s \intersect other.getIndexSet()
   //  void partialCopy(const DoubleCRT& other, const IndexSet& s);
 
   DoubleCRT& operator=(const SingleCRT& other);
   DoubleCRT& operator=(const ZZX& poly);
+  DoubleCRT& operator=(const vector<long>& poly);
   DoubleCRT& operator=(const ZZ& num);
   DoubleCRT& operator=(const long num) { *this = to_ZZ(num); return *this; }
 
@@ -187,16 +280,30 @@ public:
   void toPoly(ZZX& p, const IndexSet& s, bool positive=false) const;
   void toPoly(ZZX& p, bool positive=false) const;
 
-  // The variant toPolyMod has another argument, which is a modulus Q, and it
-  // computes toPoly() mod Q. This is offerred as a separate function in the
-  // hope that one day we will figure out a more efficient method of computing
-  // this. Right now it is not implemented
-  // 
-  // void toPolyMod(ZZX& p, const ZZ &Q, const IndexSet& s) const;
+  //! @brief The same as toPoly(p,s), reduced modulo a single-precision q
+  //! to the interval (-q/2,q/2]. The result is computed directly from the
+  //! residues, without reconstructing the large coefficients
+  void toPolyMod(ZZX& p, long q, const IndexSet& s) const;
+  void toPolyMod(ZZX& p, long q) const { toPolyMod(p, q, getIndexSet()); }
+
+  //! @brief Batched conversions: dcrts[k] = DoubleCRT(polys[k], context, s)
+  //! for all k, with the FFTs modulo each prime done together
+  static void fromPolys(vector<DoubleCRT>& dcrts, const vector<ZZX>& polys,
+                        const FHEcontext& context, const IndexSet& s);
+  static void fromPolys(vector<DoubleCRT>& dcrts,
+                        const vector< vector<long> >& polys,
+                        const FHEcontext& context, const IndexSet& s);
+
+  //! @brief polys[k] = dcrts[k]->toPoly(s, positive) for all k, with the
+  //! inverse FFTs modulo each prime done together. All the dcrts must be
+  //! defined over the same primes
+  static void toPolys(vector<ZZX>& polys, const vector<const DoubleCRT*>& dcrts,
+                      const IndexSet& s, bool positive=false);
 
 
   bool operator==(const DoubleCRT& other) const {
     assert(&context == &other.context);
+    evalForm(); other.evalForm();
     return map == other.map;
   }
 
@@ -231,6 +338,8 @@ public:
   //! @brief Remove s1 from the index set
   void removePrimes(const IndexSet& s1) {
     map.remove(s1);
+    cmap.remove(s1);
+    stale.remove(s1);
   }
 
 
@@ -318,6 +427,17 @@ public:
     Op(other, MulFun(), matchIndexSets); 
   }
 
+  //! @brief Fused multiply-accumulate, *this += a*b.
+  //! The operation is done wrt the IndexSet of *this, and a,b must be
+  //! defined (at least) wrt all the primes in that set. Either of a,b may
+  //! be *this itself.
+  DoubleCRT& MulAdd(const DoubleCRT& a, const DoubleCRT& b);
+
+  //! @brief Fused multiply-accumulate of two products, *this += a*b + c*d.
+  //! Same conventions as the two-argument version.
+  DoubleCRT& MulAdd(const DoubleCRT& a, const DoubleCRT& b,
+                    const DoubleCRT& c, const DoubleCRT& d);
+
   // Division by constant
   DoubleCRT& operator/=(const ZZ &num);
   DoubleCRT& operator/=(long num) { return (*this /= to_ZZ(num)); }
@@ -333,7 +453,7 @@ public:
   // Utilities
 
   const FHEcontext& getContext() const { return context; }
-  const IndexMap<vec_long>& getMap() const { return map; }
+  const RowMap& getMap() const { evalForm(); return map; }
   const IndexSet& getIndexSet() const { return map.getIndexSet(); }
 
   // Choose random DoubleCRT's, either at random or with small/Gaussian
@@ -342,16 +462,21 @@ public:
   //! @brief Fills each row i with random ints mod pi, uses NTL's PRG
   void randomize(const ZZ* seed=NULL);
 
+  //! @brief Fills each row i with pseudorandom ints mod pi, from the
+  //! PRGStream of seed with nonce (index,i). Thread-safe, and the row of
+  //! each prime is the same for every IndexSet that contains it
+  void randomize(const ZZ& seed, long index);
+
   //! @brief Coefficients are -1/0/1, Prob[0]=1/2
   void sampleSmall() {
-    ZZX poly; 
+    vector<long> poly; 
     ::sampleSmall(poly,context.zMStar.getPhiM()); // degree-(phi(m)-1) polynomial
     *this = poly; // convert to DoubleCRT
   }
 
   //! @brief Coefficients are -1/0/1 with pre-specified number of nonzeros
   void sampleHWt(long Hwt) {
-    ZZX poly; 
+    vector<long> poly; 
     ::sampleHWt(poly,Hwt,context.zMStar.getPhiM());
     *this = poly; // convert to DoubleCRT
   }
@@ -359,7 +484,7 @@ public:
   //! @brief Coefficients are Gaussians
   void sampleGaussian(double stdev=0.0) {
     if (stdev==0.0) stdev=to_double(context.stdev); 
-    ZZX poly; 
+    vector<long> poly; 
     ::sampleGaussian(poly, context.zMStar.getPhiM(), stdev);
     *this = poly; // convert to DoubleCRT
   }
@@ -372,6 +497,15 @@ public:
   }
 
 
+  //! @brief Bring all the rows to evaluation form (a no-op unless
+  //! context.lazyCRT). After this call, and until *this is modified, no
+  //! const method modifies *this, so it can be read by several threads at
+  //! once. An object that is not in evaluation form must not be shared
+  void toEvalForm() const { evalForm(); }
+
+  //! @brief Is every row valid in evaluation form? (see toEvalForm)
+  bool inEvalForm() const { return empty(stale); }
+
   //! @brief Makes a corresponding SingleCRT object.
   // Restricted to the given index set, if specified
   void toSingleCRT(SingleCRT& scrt, const IndexSet& s) const;
@@ -391,10 +525,57 @@ public:
   //! us quickly go over the evaluation of a circuit and estimate the
   //! resulting noise magnitude, without having to actually compute anything. 
   static bool setDryRun(bool toWhat=true) { dryRun=toWhat; return dryRun; }
+
+  friend class DoubleCRTAccumulator;
 };
 
 
+/**
+ * @class DoubleCRTAccumulator
+ * @brief A sum of DoubleCRT objects and products, with lazy reduction
+ *
+ * Each entry holds an unreduced sum as two words, hi*2^52 + lo (see the
+ * lazy kernels in rowops.h), so adding a product costs one multiplication
+ * and no modular reduction. The sums are reduced only when they are read
+ * out with reduce(), or when too many terms were added for them to fit.
+ * This is meant for long accumulation chains, such as inner products and
+ * the digit sums in key-switching.
+ *
+ * All the operations are done wrt the IndexSet of the accumulator, the
+ * DoubleCRT arguments must be defined (at least) wrt all the primes in it.
+ **/
+class DoubleCRTAccumulator {
+  const FHEcontext& context;
+  RowMap map;   // row i holds the phi(m) lo words followed by the hi words
+  long nTerms;  // the number of terms added since the last reduction
+
+  void fold();  // reduce all the sums in place
+
+public:
+  //! @brief A zero sum wrt the primes in s
+  DoubleCRTAccumulator(const FHEcontext& _context, const IndexSet& s);
+
+  const FHEcontext& getContext() const { return context; }
+  const IndexSet& getIndexSet() const { return map.getIndexSet(); }
+
+  //! @brief Set to zero
+  void clear();
+
+  //! @brief *this += a
+  void add(const DoubleCRT& a);
+
+  //! @brief *this += a*b
+  void addMul(const DoubleCRT& a, const DoubleCRT& b);
+
+  //! @brief out = the sum, reduced modulo the primes. The IndexSet of out
+  //! is set to that of *this.
+  void reduce(DoubleCRT& out) const;
+};
+
+
+
 
+inline void swap(DoubleCRT& a, DoubleCRT& b) { a.swap(b); }
 
 inline void conv(DoubleCRT &d, const ZZX &p) { d=p; }
 
@@ -28,7 +28,7 @@ EncryptedArrayBase* buildEncryptedArray(const FHEcontext& context, const ZZX& G)
     }
 
     case PA_zz_p_tag: {
-      zz_pBak bak; bak.save(); context.alMod.restoreContext();
+      PA_zz_p::RBak bak; bak.save(); context.alMod.restoreContext();
       return new EncryptedArrayDerived<PA_zz_p>(context, conv<zz_pX>(G));
     }
 
@@ -93,11 +93,11 @@ void EncryptedArrayDerived<type>::rotate1D(Ctxt& ctxt, long i, long amt, bool dc
     long val = PowerMod(al.ZmStarGen(i), amt, al.getM());
     long ival = PowerMod(al.ZmStarGen(i), amt-ord, al.getM());
 
-    const RX& mask = maskTable[i][ord-amt];
-    DoubleCRT m1(conv<ZZX>(mask), context, ctxt.getPrimeSet());
+    shared_ptr<const PreparedConstant> m1 =
+      getMask(MASK_TABLE, i, ord-amt, maskTable[i][ord-amt]);
     Ctxt tmp(ctxt); // a copy of the ciphertext
 
-    tmp.multByConstant(m1);    // only the slots in which m1=1
+    tmp.multByConstant(*m1);   // only the slots in which m1=1
     ctxt -= tmp;               // only the slots in which m1=0
     ctxt.smartAutomorph(val);  // shift left by val
     tmp.smartAutomorph(ival);  // shift right by ord-val
@@ -106,6 +106,40 @@ void EncryptedArrayDerived<type>::rotate1D(Ctxt& ctxt, long i, long amt, bool dc
   FHE_TIMER_STOP;
 }
 
+// Rotate ctxt by all the amounts in ks along the i'th dimension. Native
+// rotations (and all rotations in the "don't care" case) are automorphisms,
+// they are computed together by Ctxt::hoistedAutomorph. The non-native ones
+// mask the input differently for every amount, so there is nothing to share.
+template<class type>
+void EncryptedArrayDerived<type>::rotate1D(vector<Ctxt>& out, const Ctxt& ctxt,
+                                           long i, const vector<long>& ks,
+                                           bool dc) const
+{
+  FHE_TIMER_START;
+  const PAlgebra& al = context.zMStar;
+  assert(&context == &ctxt.getContext());
+  assert(i >= 0 && i < (long)al.numOfGens());
+
+  if (al.SameOrd(i) || dc) {
+    long ord = al.OrderOf(i);
+    vector<long> vals(ks.size());
+    for (size_t j = 0; j < ks.size(); j++) {
+      long amt = ks[j] % ord; // the signed amount, as in rotate1D
+      vals[j] = PowerMod(al.ZmStarGen(i), amt, al.getM());
+    }
+    ctxt.hoistedAutomorph(out, vals);
+  }
+  else {
+    out.clear();
+    out.reserve(ks.size());
+    for (size_t j = 0; j < ks.size(); j++) {
+      out.push_back(ctxt);
+      rotate1D(out.back(), i, ks[j]);
+    }
+  }
+  FHE_TIMER_STOP;
+}
+
 // Shift k positions along the i'th dimension with zero fill.
 // Negative shift amount denotes shift in the opposite direction.
 template<class type>
@@ -135,17 +169,17 @@ void EncryptedArrayDerived<type>::shift1D(Ctxt& ctxt, long i, long k) const
   if (amt == 0) return;
   if (amt < 0) amt += ord;
 
-  RX mask = maskTable[i][ord-amt];
-
+  shared_ptr<const PreparedConstant> m1;
   long val;
-  if (k < 0)
+  if (k < 0) {
+    m1 = getMask(MASK_TABLE, i, ord-amt, maskTable[i][ord-amt]);
     val = PowerMod(al.ZmStarGen(i), amt-ord, al.getM());
+  }
   else {
-    mask = 1 - mask;
+    m1 = getMask(MASK_TABLE_COMPL, i, ord-amt, 1 - maskTable[i][ord-amt]);
     val = PowerMod(al.ZmStarGen(i), amt, al.getM());
   }
-  DoubleCRT m1(conv<ZZX>(mask), context, ctxt.getPrimeSet());
-  ctxt.multByConstant(m1);   // zero out slots where mask=0
+  ctxt.multByConstant(*m1);  // zero out slots where mask=0
   ctxt.smartAutomorph(val);  // shift left by val
   FHE_TIMER_STOP;
 }
@@ -195,10 +229,11 @@ void EncryptedArrayDerived<type>::rotate(Ctxt& ctxt, long amt) const
     long val = PowerMod(al.ZmStarGen(i), v, al.getM());
     long ival = PowerMod(al.ZmStarGen(i), v-ord, al.getM());
 
-    DoubleCRT m1(conv<ZZX>(maskTable[i][ord-v]), context, ctxt.getPrimeSet());
+    shared_ptr<const PreparedConstant> m1 =
+      getMask(MASK_TABLE, i, ord-v, maskTable[i][ord-v]);
     tmp = ctxt;  // a copy of the ciphertext
 
-    tmp.multByConstant(m1);    // only the slots in which m1=1
+    tmp.multByConstant(*m1);   // only the slots in which m1=1
     ctxt -= tmp;               // only the slots in which m1=0
     ctxt.smartAutomorph(val);  // shift left by val
     tmp.smartAutomorph(ival);  // shift right by ord-val
@@ -220,9 +255,10 @@ void EncryptedArrayDerived<type>::rotate(Ctxt& ctxt, long amt) const
   for (i--; i >= 0; i--) {
     v = al.coordinate(i, amt);
 
-    DoubleCRT m1(conv<ZZX>(mask), context, ctxt.getPrimeSet());
+    // the mask at this step depends only on i and amt
+    shared_ptr<const PreparedConstant> m1 = getMask(MASK_COMBINED, i, amt, mask);
     tmp = ctxt;
-    tmp.multByConstant(m1); // only the slots in which mask=1
+    tmp.multByConstant(*m1); // only the slots in which mask=1
     ctxt -= tmp;            // only the slots in which mask=0
 
     rotate1D(tmp, i, v); 
@@ -281,9 +317,10 @@ void EncryptedArrayDerived<type>::shift(Ctxt& ctxt, long k) const
   for (i--; i >= 0; i--) {
     v = al.coordinate(i, amt);
 
-    DoubleCRT m1(conv<ZZX>(mask), context, ctxt.getPrimeSet());
+    // the mask at this step depends only on i and amt
+    shared_ptr<const PreparedConstant> m1 = getMask(MASK_COMBINED, i, amt, mask);
     tmp = ctxt;
-    tmp.multByConstant(m1); // only the slots in which mask=1
+    tmp.multByConstant(*m1); // only the slots in which mask=1
     ctxt -= tmp;            // only the slots in which mask=0
     if (i>0) {
       rotate1D(ctxt, i, v+1);
@@ -305,52 +342,41 @@ void EncryptedArrayDerived<type>::shift(Ctxt& ctxt, long k) const
 
 
 
+// The generalized diagonal of mat for the hypercube rotation by offs[d]
+// along every dimension d: diag[j] = mat(idx[j], j), where idx is the
+// identity rotated by offs. Returns false if this diagonal is all zero.
 template<class type>
-void EncryptedArrayDerived<type>::
-  rec_mul(long dim, 
-          Ctxt& res, 
-          const Ctxt& pdata, const vector<long>& idx,
-          const PlaintextMatrixInterface<type>& mat) const
+bool EncryptedArrayDerived<type>::
+  getRotatedDiag(vector<RX>& diag, const vector<long>& offs,
+                 const PlaintextMatrixInterface<type>& mat) const
 {
-  long ndims = dimension();
   long nslots = size();
-
-  if (dim >= ndims) {
-    vector<RX> pmat;
-    pmat.resize(nslots);
-    for (long j = 0; j < nslots; j++) {
-      long i = idx[j];
-      RX val;
-      mat.get(val, i, j);
-      pmat[j] = val;
-    }
-
-    ZZX epmat;
-    encode(epmat, pmat);
-
-    Ctxt tmp = pdata;
-    tmp.multByConstant(epmat);
-    res += tmp;
-  }
-  else {
-    long sdim = sizeOfDimension(dim);
-
-    for (long offset = 0; offset < sdim; offset++) {
-      Ctxt pdata1 = pdata;
-      vector<long> idx1;
-      rotate1D(pdata1, dim, offset);
-      this->EncryptedArrayBase::rotate1D(idx1, idx, dim, offset);
-      rec_mul(dim+1, res, pdata1, idx1, mat);
-    }
+  vector<long> idx(nslots), idx1;
+  for (long j = 0; j < nslots; j++) idx[j] = j;
+  for (long d = 0; d < dimension(); d++) {
+    if (offs[d] == 0) continue;
+    this->EncryptedArrayBase::rotate1D(idx1, idx, d, offs[d]);
+    idx.swap(idx1);
   }
+  return mat.getDiag(diag, idx);
 }
 
-
-
-
+// The diagonal method with a baby-step/giant-step split in every dimension.
+// With ctxt = Enc(v), v*mat = sum_o rot_o(v) * D_o over all the hypercube
+// rotations o, where D_o is the generalized diagonal of mat for o. Every
+// offset in dimension d is written as o_d = g_d*B_d + b_d with b_d < B_d
+// ~ sqrt(n_d), so that
+//
+//   v*mat = sum_g rot_g( sum_b rot_b(v) * rot_{-g}(D_{g+b}) ).
+//
+// The baby steps rot_b(v) are computed once (hoisted), and there is one
+// giant step per non-zero inner sum, so only O(sqrt(nslots)) rotations are
+// needed in total. Zero diagonals are skipped altogether, and so are the
+// baby steps and giant steps that only they use.
 template<class type>
 void EncryptedArrayDerived<type>::mat_mul(Ctxt& ctxt, const PlaintextMatrixBaseInterface& mat) const
 {
+  FHE_TIMER_START;
   assert(this == &mat.getEA().getDerived(type()));
   assert(&context == &ctxt.getContext());
 
@@ -360,22 +386,128 @@ void EncryptedArrayDerived<type>::mat_mul(Ctxt& ctxt, const PlaintextMatrixBaseI
   const PlaintextMatrixInterface<type>& mat1 = 
     dynamic_cast< const PlaintextMatrixInterface<type>& >( mat );
 
+  // The baby/giant split of every dimension; baby and giant steps are
+  // numbered in mixed radix, with dimension 0 as the least significant digit
+  long ndims = dimension();
+  vector<long> nB(ndims), nG(ndims), strideB(ndims+1), strideG(ndims+1);
+  strideB[0] = strideG[0] = 1;
+  for (long d = 0; d < ndims; d++) {
+    long sdim = sizeOfDimension(d);
+    nB[d] = ceil(sqrt((double) sdim));
+    nG[d] = (sdim + nB[d] - 1) / nB[d];
+    strideB[d+1] = strideB[d] * nB[d];
+    strideG[d+1] = strideG[d] * nG[d];
+  }
+  long totalB = strideB[ndims], totalG = strideG[ndims];
+
+  // The offsets in every dimension of giant step gi and baby step bi,
+  // returns false if they are out of range in some dimension
+  auto offsetsOf = [&](vector<long>& offs, long gi, long bi) -> bool {
+    offs.resize(ndims);
+    for (long d = 0; d < ndims; d++) {
+      offs[d] = ((gi / strideG[d]) % nG[d]) * nB[d] + (bi / strideB[d]) % nB[d];
+      if (offs[d] >= sizeOfDimension(d)) return false;
+    }
+    return true;
+  };
+
+  // The diagonal for giant step gi and baby step bi, rotated by minus the
+  // giant step; returns false if it is out of range or all zero
+  vector<long> offs;
+  vector<RX> diag1;
+  auto diagOf = [&](vector<RX>& diag, long gi, long bi) -> bool {
+    if (!offsetsOf(offs, gi, bi) || !getRotatedDiag(diag, offs, mat1))
+      return false;
+    for (long d = 0; d < ndims; d++) {
+      long g = offs[d] - (bi / strideB[d]) % nB[d];
+      if (g == 0) continue;
+      this->EncryptedArrayBase::rotate1D(diag1, diag, d, -g);
+      diag.swap(diag1);
+    }
+    return true;
+  };
+
+  // First pass: which diagonals are non-zero, and which steps are needed.
+  // Only these flags are kept: the diagonals are extracted again in the
+  // second pass, one at a time, rather than keeping all the non-zero
+  // diagonals alive
+  vector<bool> nonZero(totalG * totalB, false), babyNeeded(totalB, false);
+  vector<RX> diag;
+  for (long gi = 0; gi < totalG; gi++)
+    for (long bi = 0; bi < totalB; bi++) {
+      if (!offsetsOf(offs, gi, bi) || !getRotatedDiag(diag, offs, mat1))
+        continue;
+      nonZero[gi*totalB + bi] = true;
+      babyNeeded[bi] = true;
+    }
+
+  // The baby steps, one dimension at a time: babies[t] is ctxt rotated by
+  // the baby step babyIdx[t] (restricted to the dimensions done so far)
+  vector<Ctxt> babies(1, ctxt);
+  vector<long> babyIdx(1, 0);
+  for (long d = 0; d < ndims; d++) {
+    // the prefixes (over dimensions 0..d) of the needed baby steps
+    vector<bool> prefixNeeded(strideB[d+1], false);
+    for (long bi = 0; bi < totalB; bi++)
+      if (babyNeeded[bi]) prefixNeeded[bi % strideB[d+1]] = true;
+
+    vector<Ctxt> nextBabies;
+    vector<long> nextIdx;
+    for (size_t t = 0; t < babies.size(); t++) {
+      vector<long> amts;
+      for (long b = 0; b < nB[d]; b++)
+        if (prefixNeeded[babyIdx[t] + b*strideB[d]]) amts.push_back(b);
+      if (amts.empty()) continue;
+
+      vector<Ctxt> rotated;
+      rotate1D(rotated, babies[t], d, amts);
+      for (size_t k = 0; k < amts.size(); k++) {
+        nextBabies.push_back(std::move(rotated[k]));
+        nextIdx.push_back(babyIdx[t] + amts[k]*strideB[d]);
+      }
+    }
+    babies.swap(nextBabies);
+    babyIdx.swap(nextIdx);
+  }
+  vector<long> babyPos(totalB, -1);
+  for (size_t t = 0; t < babyIdx.size(); t++) babyPos[babyIdx[t]] = t;
+
+  // Second pass: the inner sums, each followed by its giant step
   Ctxt res(ctxt.getPubKey(), ctxt.getPtxtSpace());
   // a new ciphertext, encrypting zero
 
-  vector<long> idx;
-  idx.resize(size());
-  for (long i = 0; i < size(); i++)
-     idx[i] = i;
+  for (long gi = 0; gi < totalG; gi++) {
+    Ctxt inner(ctxt.getPubKey(), ctxt.getPtxtSpace());
+    bool empty = true;
+    for (long bi = 0; bi < totalB; bi++) {
+      if (!nonZero[gi*totalB + bi]) continue;
+
+      ZZX epmat;
+      diagOf(diag, gi, bi);
+      encode(epmat, diag);
+
+      // Every diagonal is used only once per call, and mat_mul cannot tell
+      // if mat is used again, so there is nothing for a PreparedConstant
+      // to reuse here
+      Ctxt tmp = babies[babyPos[bi]];
+      tmp.multByConstant(epmat);
+      inner += tmp;
+      empty = false;
+    }
+    if (empty) continue;
 
-  rec_mul(0, res, ctxt, idx, mat1);
+    for (long d = 0; d < ndims; d++) {
+      long g = ((gi / strideG[d]) % nG[d]) * nB[d];
+      if (g != 0) rotate1D(inner, d, g);
+    }
+    res += inner;
+  }
 
-  ctxt = res;
+  ctxt = std::move(res);
+  FHE_TIMER_STOP;
 }
 
 
-
-
 template<class type>
 void EncryptedArrayDerived<type>::encodeUnitSelector(ZZX& ptxt, long i) const
 {
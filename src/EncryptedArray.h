@@ -57,6 +57,21 @@ public:
   PA_INJECT(type)
 
   virtual void get(RX& out, long i, long j) const = 0;
+
+  //! @brief Bulk extraction of a generalized diagonal: diag[j] = the
+  //! element at row idx[j] column j, for all j. Returns false if all these
+  //! elements are zero (diag may then be left unset), so that mat_mul can
+  //! skip this diagonal. The default calls get for every element, sparse or
+  //! banded matrices should override it.
+  virtual bool getDiag(vector<RX>& diag, const vector<long>& idx) const {
+    bool nonZero = false;
+    diag.resize(idx.size());
+    for (long j = 0; j < (long) idx.size(); j++) {
+      get(diag[j], idx[j], j);
+      if (!IsZero(diag[j])) nonZero = true;
+    }
+    return nonZero;
+  }
 };
 
 
@@ -117,6 +132,12 @@ public:
   //! optimizations that would not otherwise be possible
   virtual void rotate1D(Ctxt& ctxt, long i, long k, bool dc=false) const = 0; 
 
+  //! @brief out[j] = ctxt left-rotated by ks[j] positions along the i'th
+  //! dimension. Native rotations are hoisted (see Ctxt::hoistedAutomorph),
+  //! so the key-switching digits of ctxt are computed only once
+  virtual void rotate1D(vector<Ctxt>& out, const Ctxt& ctxt, long i,
+                        const vector<long>& ks, bool dc=false) const = 0;
+
   //! @brief Left shift k positions along the i'th dimension with zero fill
   virtual void shift1D(Ctxt& ctxt, long i, long k) const = 0; 
 
@@ -235,6 +256,19 @@ private:
   const FHEcontext& context;
   MappingData<type> mappingData;
 
+  // The DoubleCRT forms of the masks used by rotations and shifts, keyed by
+  // (kind, generator, amount) and then by level
+  enum { MASK_TABLE, MASK_TABLE_COMPL, MASK_COMBINED };
+  mutable PreparedConstantCache maskCache;
+
+  // The mask with the given key, mask is only converted on a cache miss
+  shared_ptr<const PreparedConstant>
+  getMask(long kind, long i, long amt, const RX& mask) const
+  {
+    return maskCache.get(kind, i, amt, context,
+                         [&mask](ZZX& poly) { conv(poly, mask); });
+  }
+
 public:
   explicit
   EncryptedArrayDerived(const FHEcontext& _context, const RX& _G = RX(1, 1));
@@ -268,14 +302,14 @@ public:
   virtual void rotate(Ctxt& ctxt, long k) const;
   virtual void shift(Ctxt& ctxt, long k) const;
   virtual void rotate1D(Ctxt& ctxt, long i, long k, bool dc=false) const;
+  virtual void rotate1D(vector<Ctxt>& out, const Ctxt& ctxt, long i,
+                        const vector<long>& ks, bool dc=false) const;
   virtual void shift1D(Ctxt& ctxt, long i, long k) const;
 
 
   // helper routine for mat_mul
-  void rec_mul(long dim, 
-               Ctxt& res, 
-               const Ctxt& pdata, const vector<long>& idx,
-               const PlaintextMatrixInterface<type>& mat) const;
+  bool getRotatedDiag(vector<RX>& diag, const vector<long>& offs,
+                      const PlaintextMatrixInterface<type>& mat) const;
 
   virtual void mat_mul(Ctxt& ctxt, const PlaintextMatrixBaseInterface& mat) const;
 
@@ -464,6 +498,9 @@ public:
   void rotate(Ctxt& ctxt, long k) const { rep->rotate(ctxt, k); }
   void shift(Ctxt& ctxt, long k) const { rep->shift(ctxt, k); }
   void rotate1D(Ctxt& ctxt, long i, long k, bool dc=false) const { rep->rotate1D(ctxt, i, k, dc); }
+  void rotate1D(vector<Ctxt>& out, const Ctxt& ctxt, long i,
+                const vector<long>& ks, bool dc=false) const
+  { rep->rotate1D(out, ctxt, i, ks, dc); }
   void shift1D(Ctxt& ctxt, long i, long k) const { rep->shift1D(ctxt, i, k); }
 
   void mat_mul(Ctxt& ctxt, const PlaintextMatrixBaseInterface& mat) const 
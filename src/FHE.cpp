@@ -139,23 +139,20 @@ void KeySwitch::verify(FHESecKey& sk)
   vector<DoubleCRT> a;
   a.resize(n, DoubleCRT(context, allPrimes)); // defined modulo all primes
 
-  { RandomState state;
-
-    SetSeed(prgSeed);
-    for (long i = 0; i < n; i++)
-      a[i].randomize();
-
-  } // the RandomState destructor "restores the state" (see NumbTh.h)
+  for (long i = 0; i < n; i++)
+    a[i].randomize(prgSeed, i); // the same a[i]'s as in GenKeySWmatrix
 
   vector<ZZX> A, B;
 
   A.resize(n);
   B.resize(n);
 
-  for (long i = 0; i < n; i++) {
-    a[i].toPoly(A[i]);
+  vector<const DoubleCRT*> aPtrs(n);
+  for (long i = 0; i < n; i++) aPtrs[i] = &a[i];
+  DoubleCRT::toPolys(A, aPtrs, allPrimes); // all of them at once
+
+  for (long i = 0; i < n; i++)
     b[i].toPoly(B[i]);
-  }
 
   ZZX FromKey, ToKey;
   _fromKey.toPoly(FromKey, allPrimes);
@@ -211,8 +208,10 @@ void KeySwitch::readMatrix(istream& str, const FHEcontext& context)
   long nDigits;
   str >> nDigits;
   b.resize(nDigits, DoubleCRT(context, IndexSet::emptySet()));
-  for (long i=0; i<nDigits; i++)
+  for (long i=0; i<nDigits; i++) {
     str >> b[i];
+    b[i].toEvalForm(); // shared by the key-switching threads
+  }
   str >> prgSeed;
   seekPastChar(str,']');
   //  cerr << "]";
@@ -327,14 +326,14 @@ long FHEPubKey::Encrypt(Ctxt &ctxt, const ZZX& ptxt, long ptxtSpace,
   ctxt = pubEncrKey;  // already an encryption of zero, just not a random one
 
   // choose a random small scalar r and a small random error vector e,
-  // then set ctxt = r*pubEncrKey + ptstSpace*e + (ptxt,0)
-  DoubleCRT e(context, context.ctxtPrimes);
-  DoubleCRT r(context, context.ctxtPrimes);
-  r.sampleSmall();
-
-  for (size_t i=0; i<ctxt.parts.size(); i++) {  // add noise to all the parts
-    ctxt.parts[i] *= r;
-
+  // then set ctxt = r*pubEncrKey + ptstSpace*e + (ptxt,0). The polynomials
+  // r, e_0, e_1, ... are sampled first and converted to DoubleCRT together
+  long phim = context.zMStar.getPhiM();
+  long nParts = ctxt.parts.size();
+  vector<ZZX> polys(nParts+1);
+  sampleSmall(polys[0], phim); // r
+  for (long i=0; i<nParts; i++) {  // the noise of all the parts
+    ZZX& e = polys[i+1];
     if (highNoise && i == 0) {
       // we sample e so that coefficients are uniform over 
       // [-Q/(8*ptxtSpace)..Q/(8*ptxtSpace)]
@@ -343,14 +342,19 @@ long FHEPubKey::Encrypt(Ctxt &ctxt, const ZZX& ptxt, long ptxtSpace,
       B = context.productOfPrimes(context.ctxtPrimes);
       B /= ptxtSpace;
       B /= 8;
-      e.sampleUniform(B);
+      sampleUniform(e, B, phim);
     }
     else { 
-      e.sampleGaussian();
+      sampleGaussian(e, phim, to_double(context.stdev));
     }
-
     e *= ptxtSpace;
-    ctxt.parts[i] += e;
+  }
+
+  vector<DoubleCRT> dcrts;
+  DoubleCRT::fromPolys(dcrts, polys, context, context.ctxtPrimes);
+  for (long i=0; i<nParts; i++) {
+    ctxt.parts[i] *= dcrts[0];
+    ctxt.parts[i] += dcrts[i+1];
   }
 
   // add in the plaintext
@@ -537,9 +541,14 @@ long FHESecKey::ImportSecKey(const DoubleCRT& sKey, long Hwt, long ptxtSpace)
     xdouble phim = to_xdouble(context.zMStar.getPhiM());
     pubEncrKey.noiseVar = context.stdev * context.stdev
       * phim * ptxtSpace * ptxtSpace;
+
+    // the keys are read concurrently, see DoubleCRT::toEvalForm
+    pubEncrKey.parts[0].toEvalForm();
+    pubEncrKey.parts[1].toEvalForm();
   }
   skHwts.push_back(Hwt); // record the Hamming weight of the new secret-key
   sKeys.push_back(sKey); // add to the list of secret keys
+  sKeys.back().toEvalForm();
   long keyID = sKeys.size()-1; // not thread-safe?
 
   GenKeySWmatrix(2,1,keyID,keyID); // At least we need the s^2 -> s matrix
@@ -581,11 +590,10 @@ void FHESecKey::GenKeySWmatrix(long fromSPower, long fromXPower,
   vector<DoubleCRT> a; 
   a.resize(n, DoubleCRT(context));
 
-  { RandomState state;
-    SetSeed(ksMatrix.prgSeed);
-    for (long i = 0; i < n; i++) 
-      a[i].randomize();
-  } // restore state upon destruction of state
+  // The pseudorandom ai's are derived from the seed without using NTL's
+  // global PRG, so key switching can regenerate them in any thread
+  for (long i = 0; i < n; i++) 
+    a[i].randomize(ksMatrix.prgSeed, i);
 
   // Record the plaintext space for this key-switching matrix
   if (p<2) p = context.alMod.getPPowR();  // default plaintext space is p^r
@@ -603,73 +611,97 @@ void FHESecKey::GenKeySWmatrix(long fromSPower, long fromXPower,
     fromKey *= context.productOfPrimes(context.digits[i]);
   }
 
-  // Push the new matrix onto our list
+  // Push the new matrix onto our list, the key-switching threads share it
+  for (long i = 0; i < n; i++) ksMatrix.b[i].toEvalForm();
   keySwitching.push_back(ksMatrix);
   FHE_TIMER_STOP;
 }
 
 // Decryption
+// Multiply the plaintext by Q^{-1} mod p (Q is the product of the primes
+// of the ciphertext), then reduce to [0,p-1]
+static void scalePtxt(ZZX& plaintxt, const Ctxt &ciphertxt)
+{
+  long ptxtSpace = ciphertxt.getPtxtSpace();
+  if (ptxtSpace>2) { // if p>2, multiply by Q^{-1} mod p
+    long qModP = rem(ciphertxt.getContext().productOfPrimes(ciphertxt.getPrimeSet()),
+		     ptxtSpace);
+    if (qModP != 1) {
+      qModP = InvMod(qModP, ptxtSpace);
+      MulMod(plaintxt, plaintxt, qModP, ptxtSpace);
+    }
+  }
+  PolyRed(plaintxt, ptxtSpace, true/*reduce to [0,p-1]*/);
+}
+
+// The plaintext is only needed modulo ptxtSpace, so it is computed directly
+// from the residues, without reconstructing the polynomial before reduction
 void FHESecKey::Decrypt(ZZX& plaintxt, const Ctxt &ciphertxt) const
 {
-  ZZX f;
-  Decrypt(plaintxt, ciphertxt, f);
+  FHE_TIMER_START;
+  DoubleCRT ptxt(context, ciphertxt.primeSet);
+  decryptRaw(ptxt, ciphertxt);
+  ptxt.toPolyMod(plaintxt, ciphertxt.ptxtSpace);
+  scalePtxt(plaintxt, ciphertxt);
+  FHE_TIMER_STOP;
 }
+
 void FHESecKey::Decrypt(ZZX& plaintxt, const Ctxt &ciphertxt,
 			ZZX& f) const // plaintext before modular reduction
+{
+  FHE_TIMER_START;
+  DoubleCRT ptxt(context, ciphertxt.primeSet);
+  decryptRaw(ptxt, ciphertxt);
+
+  // convert to coefficient representation & reduce modulo the plaintext space
+  ptxt.toPoly(plaintxt);
+  f = plaintxt;
+  scalePtxt(plaintxt, ciphertxt);
+  FHE_TIMER_STOP;
+}
+
+// ptxt = the sum of all the ciphertext parts times the matching keys
+void FHESecKey::decryptRaw(DoubleCRT& ptxt, const Ctxt &ciphertxt) const
 {
 #ifdef DEBUG_PRINTOUT
   // The call to findBaseSet is only for the purpose of printing a
   // warning if the noise is large enough so as to risk decryption error
   IndexSet s; ciphertxt.findBaseSet(s);
 #endif
-  FHE_TIMER_START;
   assert(getContext()==ciphertxt.getContext());
   const IndexSet& ptxtPrimes = ciphertxt.primeSet;
-  DoubleCRT ptxt(context, ptxtPrimes); // Set to zero
+  DoubleCRTAccumulator acc(context, ptxtPrimes); // Set to zero
 
   // for each ciphertext part, fetch the right key, multiply and add
   for (size_t i=0; i<ciphertxt.parts.size(); i++) {
     const CtxtPart& part = ciphertxt.parts[i];
     //  cout << "decrypt part: "<<part.skHandle<<" "<< part.getIndexSet()<<"\n";
     if (part.skHandle.isOne()) { // No need to multiply
-      ptxt += part;
+      acc.add(part);
       continue;
     }
 
     long keyIdx = part.skHandle.getSecretKeyID();
+    long xPower = part.skHandle.getPowerOfX();
+    long sPower = part.skHandle.getPowerOfS();
+    if (xPower<=1 && sPower<=1) { // use the key itself, no need for a copy
+      acc.addMul(part, sKeys.at(keyIdx)); // ptxt += part * key
+      continue;
+    }
+
     DoubleCRT key = sKeys.at(keyIdx); // copy object, not a reference
     const IndexSet extraPrimes = key.getIndexSet() / ptxtPrimes;
     key.removePrimes(extraPrimes);    // drop extra primes, for efficiency
 
-    /* Perhaps a slightly more efficient way of doing the same thing is:
-       DoubleCRT key(context, ptxtPrimes); // a zero object wrt ptxtPrimes
-       key.Add(sKeys.at(keyIdx), false); // add without mathcing primesSet
-    */
-    long xPower = part.skHandle.getPowerOfX();
-    long sPower = part.skHandle.getPowerOfS();
     if (xPower>1) { 
       key.automorph(xPower); // s(X^t)
     }
     if (sPower>1) {
       key.Exp(sPower);       // s^r(X^t)
     }
-    key *= part;
-    ptxt += key;
+    acc.addMul(part, key);   // ptxt += part * key
   }
-  // convert to coefficient representation & reduce modulo the plaintext space
-  ptxt.toPoly(plaintxt);
-  f = plaintxt;
-
-  if (ciphertxt.ptxtSpace>2) { // if p>2, multiply by Q^{-1} mod p
-    long qModP = rem(context.productOfPrimes(ciphertxt.getPrimeSet()), 
-		     ciphertxt.ptxtSpace);
-    if (qModP != 1) {
-      qModP = InvMod(qModP, ciphertxt.ptxtSpace);
-      MulMod(plaintxt, plaintxt, qModP, ciphertxt.ptxtSpace);
-    }
-  }
-  PolyRed(plaintxt, ciphertxt.ptxtSpace, true/*reduce to [0,p-1]*/);
-  FHE_TIMER_STOP;
+  acc.reduce(ptxt);
 }
 
 // Encryption using the secret key, this is useful, e.g., to put an
@@ -224,6 +224,9 @@ public:
  * @brief The secret key
 ******************************************************************/
 class FHESecKey: public FHEPubKey { // The secret key
+  // ptxt = the sum of all the ciphertext parts times the matching keys
+  void decryptRaw(DoubleCRT& ptxt, const Ctxt &ciphertxt) const;
+
 public:
   vector<DoubleCRT> sKeys; // The secret key(s) themselves
 
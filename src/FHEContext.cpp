@@ -16,17 +16,21 @@
 #include <NTL/vec_long.h>
 #include "NumbTh.h"
 #include "FHEContext.h"
+#include "ThreadPool.h"
 
 #include "DoubleCRT.h" // include this to pick up USE_ALT_CRT macro
 
 #define pSize (NTL_SP_NBITS/2) /* The size of levels in the chain */
 
+#include <mutex>
+
 NTL_CLIENT
 
 
 
 
-long FindM(long k, long L, long c, long p, long d, long s, long chosen_m, bool verbose)
+long FindM(long k, long L, long c, long p, long d, long s, long chosen_m,
+           bool verbose, bool powerOfTwo)
 {
   // get a lower-bound on the parameter N=phi(m):
   // 1. Each level in the modulus chain corresponds to pSize=NTL_SP_NBITS/2
@@ -72,6 +76,19 @@ long FindM(long k, long L, long c, long p, long d, long s, long chosen_m, bool v
       }
     }
   }
+  else if (powerOfTwo) { // phi(m)=m/2, the FFT is then a negacyclic NTT
+    if (p % 2 == 0)
+      Error("FindM: a power-of-two m requires an odd plaintext modulus");
+    for (long candidate = 2; candidate < 10*N; candidate *= 2) {
+      if (candidate/2 < N) continue; // phi(m) too small
+      long ordP = multOrd(p,candidate);
+      if (d>1 && ordP%d!=0 ) continue;
+      if (candidate/(2*ordP) < s) continue; // not enough slots
+      m = candidate;
+      break;
+    }
+    if (m==0) Error("FindM: no suitable power-of-two m");
+  }
   else if (p==2) { // use pre-computed table, divisors of 2^n-1 for some n's
 
     static long ms[][4] = {  // pre-computed values of [phi(m),m,d]
@@ -157,20 +174,208 @@ void FHEcontext::productOfPrimes(ZZ& p, const IndexSet& s) const
     p *= ithPrime(i);
 }
 
+// Protects the caches of automorphism, mod-down and CRT tables, so that
+// automorph, toPoly and the mod-down can be called from several threads
+static mutex tableCacheLock;
+
+// The gather table for X -> X^k: if j is the i'th element of Zm* then
+// the entry for i is the index of j*k mod m, since new[j] = old[j*k mod m]
+shared_ptr< const vector<long> > FHEcontext::getAutomorphTable(long k) const
+{
+  {
+    lock_guard<mutex> lock(tableCacheLock);
+    map<long, AutomorphEntry>::iterator it = automorphCache.find(k);
+    if (it != automorphCache.end()) {
+      it->second.lastUse = ++automorphClock;
+      return it->second.table;
+    }
+  }
+
+  if (!zMStar.inZmStar(k))
+    Error("FHEcontext::getAutomorphTable: k not in Zm*");
+
+  long m = zMStar.getM();
+  vector<long>* table = new vector<long>(zMStar.getPhiM());
+  for (long j=1; j<m; j++) {
+    long idx = zMStar.indexInZmstar(j); // returns -1 if j \notin (Z/mZ)*
+    if (idx>=0) (*table)[idx] = zMStar.indexInZmstar(MulMod(j,k,m));
+  }
+  shared_ptr< const vector<long> > ptr(table);
+
+  // The table was built without the lock, another thread may have added
+  // the same one in the meantime
+  lock_guard<mutex> lock(tableCacheLock);
+  if (automorphCacheSize <= 0) return ptr;
+
+  map<long, AutomorphEntry>::iterator it = automorphCache.find(k);
+  if (it != automorphCache.end()) {
+    it->second.lastUse = ++automorphClock;
+    return it->second.table;
+  }
+  if ((long)automorphCache.size() >= automorphCacheSize)
+    evictAutomorphTable();
+  AutomorphEntry& entry = automorphCache[k];
+  entry.table = ptr;
+  entry.lastUse = ++automorphClock;
+  return ptr;
+}
+
+ModDownTable::ModDownTable(const FHEcontext& context,
+                           const IndexSet& dSet, const IndexSet& kSet)
+{
+  for (long i = dSet.first(); i <= dSet.last(); i = dSet.next(i))
+    dropped.push_back(i);
+  for (long j = kSet.first(); j <= kSet.last(); j = kSet.next(j))
+    kept.push_back(j);
+
+  // mulModWide rather than NTL's MulMod, the primes may be wide
+  long nd = dropped.size(), nk = kept.size();
+  hatInv.resize(nd); hatInvPre.resize(nd); dRecip.resize(nd);
+  for (long i = 0; i < nd; i++) {
+    long di = context.ithPrime(dropped[i]);
+    long hat = 1; // D/d_i mod d_i
+    for (long k = 0; k < nd; k++)
+      if (k != i) hat = mulModWide(hat, context.ithPrime(dropped[k]) % di, di);
+    hatInv[i] = InvMod(hat, di);
+    hatInvPre[i] = shoupPrecon(hatInv[i], di);
+    dRecip[i] = 1.0/di;
+  }
+
+  dInv.resize(nk*nd); dInvPre.resize(nk*nd);
+  DInv.resize(nk); DInvPre.resize(nk);
+  hatMod.resize(nk*nd); hatModPre.resize(nk*nd);
+  DMod.resize(nk); DModPre.resize(nk);
+  for (long j = 0; j < nk; j++) {
+    long qj = context.ithPrime(kept[j]);
+    long prod = 1 % qj, prodInv = 1 % qj;
+    for (long i = 0; i < nd; i++) {
+      long di = context.ithPrime(dropped[i]) % qj;
+      long inv = InvMod(di, qj);
+      dInv[j*nd+i] = inv;
+      dInvPre[j*nd+i] = shoupPrecon(inv, qj);
+      prod = mulModWide(prod, di, qj);
+      prodInv = mulModWide(prodInv, inv, qj);
+    }
+    DInv[j] = prodInv;
+    DInvPre[j] = shoupPrecon(prodInv, qj);
+    DMod[j] = prod;
+    DModPre[j] = shoupPrecon(prod, qj);
+    for (long i = 0; i < nd; i++) { // D/d_i = D * d_i^{-1}
+      hatMod[j*nd+i] = mulModWide(prod, dInv[j*nd+i], qj);
+      hatModPre[j*nd+i] = shoupPrecon(hatMod[j*nd+i], qj);
+    }
+  }
+}
+
+shared_ptr<const ModDownTable>
+FHEcontext::getModDownTable(const IndexSet& dropped,
+                            const IndexSet& kept) const
+{
+  assert(empty(dropped & kept));
+  assert(dropped.last() < numPrimes() && kept.last() < numPrimes());
+
+  vector<long> key;
+  for (long i = dropped.first(); i <= dropped.last(); i = dropped.next(i))
+    key.push_back(i);
+  key.push_back(-1);
+  for (long j = kept.first(); j <= kept.last(); j = kept.next(j))
+    key.push_back(j);
+
+  lock_guard<mutex> lock(tableCacheLock);
+  shared_ptr<const ModDownTable>& tab = modDownCache[key];
+  if (!tab) tab = make_shared<ModDownTable>(*this, dropped, kept);
+  return tab;
+}
+
+CRTTable::CRTTable(const FHEcontext& context, const IndexSet& s)
+{
+  for (long i = s.first(); i <= s.last(); i = s.next(i))
+    primes.push_back(i);
+
+  long n = primes.size();
+  context.productOfPrimes(prod, s);
+  RightShift(halfProd, prod, 1);
+  negate(negHalfProd, halfProd);
+
+  // a sum of n terms below P needs NumBits(P)+NumBits(n) bits, plus a sign
+  nLimbs = (NumBits(prod) + NumBits(n) + 1 + 63)/64;
+  prodLimbs.resize(nLimbs);
+  ZZToLimbs(&prodLimbs[0], prod, nLimbs);
+
+  hatInv.resize(n); hatInvPre.resize(n); recip.resize(n);
+  hatLimbs.resize(n*nLimbs);
+  ZZ hat;
+  for (long k = 0; k < n; k++) {
+    long pk = context.ithPrime(primes[k]);
+    div(hat, prod, pk);
+    hatInv[k] = InvMod(rem(hat, pk), pk);
+    hatInvPre[k] = shoupPrecon(hatInv[k], pk);
+    recip[k] = 1.0/pk;
+    ZZToLimbs(&hatLimbs[k*nLimbs], hat, nLimbs);
+  }
+}
+
+shared_ptr<const CRTTable> FHEcontext::getCRTTable(const IndexSet& s) const
+{
+  assert(s.last() < numPrimes());
+
+  vector<long> key;
+  for (long i = s.first(); i <= s.last(); i = s.next(i)) key.push_back(i);
+
+  lock_guard<mutex> lock(tableCacheLock);
+  shared_ptr<const CRTTable>& tab = crtCache[key];
+  if (!tab) tab = make_shared<CRTTable>(*this, s);
+  return tab;
+}
+
+// Remove the least recently used table from the cache, the caller holds
+// tableCacheLock
+void FHEcontext::evictAutomorphTable() const
+{
+  map<long, AutomorphEntry>::iterator lru = automorphCache.begin();
+  for (map<long, AutomorphEntry>::iterator it = automorphCache.begin();
+       it != automorphCache.end(); ++it)
+    if (it->second.lastUse < lru->second.lastUse) lru = it;
+  automorphCache.erase(lru);
+}
+
+void FHEcontext::setAutomorphCacheSize(long n)
+{
+  lock_guard<mutex> lock(tableCacheLock);
+  automorphCacheSize = n;
+  while ((long)automorphCache.size() > max(n, 0L))
+    evictAutomorphTable();
+}
+
+void FHEcontext::setThreadCount(long nThreads)
+{
+  if (nThreads <= 1) threadPool.reset();
+  else threadPool.reset(new ThreadPool(nThreads));
+}
+
+long FHEcontext::getThreadCount() const
+{
+  return threadPool? threadPool->size() : 1;
+}
+
 // Find the next prime and add it to the chain
 long FHEcontext::AddPrime(long initialP, long delta, bool special)
 {
   long twoM = 2 * zMStar.getM();
   assert((initialP % twoM == 1) && (delta % twoM == 0));
 
+  long bound = primeBound();
+  if (widePrimes && !explicitFFT)
+    Error("AddPrime: wide primes need the explicit FFT tables");
+
   long p = initialP;
   do { p += delta; } // delta could be positive or negative
-  while (p>initialP/16 && p<NTL_SP_BOUND && !(ProbPrime(p) && !inChain(p)));
+  while (p>initialP/16 && p<bound && !(isPrimeWide(p) && !inChain(p)));
 
-  if (p<=initialP/16 || p>=NTL_SP_BOUND) return 0; // no prime found
+  if (p<=initialP/16 || p>=bound) return 0; // no prime found
 
   long i = moduli.size(); // The index of the new prime in the list
-  moduli.push_back( Cmodulus(zMStar, p, 0) );
+  moduli.push_back( Cmodulus(zMStar, p, 0, explicitFFT) );
 
   if (special)
     specialPrimes.insert(i);
@@ -192,7 +397,7 @@ long FHEcontext::AddFFTPrime(bool special)
   long i = moduli.size(); // The index of the new prime in the list
   long p = zz_p::modulus();
 
-  moduli.push_back( Cmodulus(zMStar, 0, 1) ); // a dummy Cmodulus object
+  moduli.push_back( Cmodulus(zMStar, 0, 1, explicitFFT) ); // a dummy object
 
   if (special)
     specialPrimes.insert(i);
@@ -222,10 +427,12 @@ double AddManyPrimes(FHEcontext& context, double totalSize,
   }
 #else
   // make p-1 divisible by m*2^k for as large k as possible
+  long bound = context.primeBound();
+  long nBitsBound = NumBits(bound-1);
   long twoM = 2 * context.zMStar.getM();
-  while (twoM < NTL_SP_BOUND/(NTL_SP_NBITS*2)) twoM *= 2;
+  while (twoM < bound/(nBitsBound*2)) twoM *= 2;
 
-  long bigP = NTL_SP_BOUND - (NTL_SP_BOUND%twoM) +1; // 1 mod 2m
+  long bigP = bound - (bound%twoM) +1; // 1 mod 2m
   long p = bigP+twoM; // The twoM is subtracted in the AddPrime function
 
   while (sizeSoFar < totalSize) {
@@ -301,6 +508,11 @@ void buildModChain(FHEcontext &context, long nLvls, long nDgts)
 #endif
 #endif
 
+  // Each wide prime covers FHE_WIDE_PRIME_BITS/NTL_SP_NBITS as many levels
+  if (context.widePrimes)
+    morePrimes = (morePrimes*NTL_SP_NBITS + FHE_WIDE_PRIME_BITS-1)
+                 / FHE_WIDE_PRIME_BITS;
+
   // Choose the next primes as large as possible
   if (morePrimes>0) AddPrimesByNumber(context, morePrimes);
 
@@ -443,7 +655,7 @@ istream& operator>> (istream &str, FHEcontext& context)
 #ifdef USE_ALT_CRT
     context.moduli.push_back(Cmodulus(context.zMStar,p,1)); // a dummy object
 #else
-    context.moduli.push_back(Cmodulus(context.zMStar,p,0)); // a real object
+    context.moduli.push_back(Cmodulus(context.zMStar,p,0,context.explicitFFT));
 #endif
     if (s.contains(i))
       context.specialPrimes.insert(i); // special prime
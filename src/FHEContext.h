@@ -20,6 +20,8 @@
  * @file FHEcontext.h
  * @brief Keeps the parameters of an instance of the cryptosystem
  **/
+#include <map>
+#include <memory>
 #include <NTL/xdouble.h>
 #include "PAlgebra.h"
 #include "CModulus.h"
@@ -34,10 +36,81 @@
  * @param d embedding degree (d ==0 or d==1 => no constraint)
  * @param s at least that many plaintext slots
  * @param chosen_m preselected value of m (0 => not preselected)
+ * @param powerOfTwo search only for m a power of two (requires odd p)
  * Fails with an error message if no suitable m is found
  * prints an informative message if verbose == true
  **/
-long FindM(long k, long L, long c, long p, long d, long s, long chosen_m, bool verbose=false);
+long FindM(long k, long L, long c, long p, long d, long s, long chosen_m,
+           bool verbose=false, bool powerOfTwo=false);
+
+class ThreadPool;
+class FHEcontext;
+
+/**
+ * @struct ModDownTable
+ * @brief Constants for dividing by the product D of a set of "dropped"
+ * primes d_i, without leaving the RNS representation wrt the "kept"
+ * primes q_j. See DoubleCRT::scaleDownToSet().
+ *
+ * Residues x_i of x modulo the d_i are converted to the balanced
+ * representative c = sum_i y_i*(D/d_i) - v*D of x mod D, where
+ * y_i = x_i*(D/d_i)^{-1} mod d_i and v = round(sum_i y_i/d_i). Since
+ * (D/d_i)/D = 1/d_i, dividing by D modulo q_j only needs d_i^{-1} mod q_j.
+ * Extending c itself to the q_j (as in DoubleCRT::breakIntoDigits()) uses
+ * D/d_i mod q_j and D mod q_j.
+ **/
+struct ModDownTable {
+  vector<long> dropped; // the indexes of the d_i, in increasing order
+  vector<long> kept;    // the indexes of the q_j, in increasing order
+
+  vector<unsigned long> hatInv, hatInvPre; // (D/d_i)^{-1} mod d_i
+  vector<double> dRecip;                   // 1/d_i
+
+  //! dInv[j*dropped.size()+i] = d_i^{-1} mod q_j
+  vector<unsigned long> dInv, dInvPre;
+  vector<unsigned long> DInv, DInvPre;     // D^{-1} mod q_j
+
+  //! hatMod[j*dropped.size()+i] = D/d_i mod q_j
+  vector<unsigned long> hatMod, hatModPre;
+  vector<unsigned long> DMod, DModPre;     // D mod q_j
+
+  ModDownTable(const FHEcontext& context,
+               const IndexSet& dropped, const IndexSet& kept);
+};
+
+/**
+ * @struct CRTTable
+ * @brief Constants for CRT reconstruction modulo the product P of a set of
+ * primes p_k. See DoubleCRT::toPoly().
+ *
+ * The balanced representative of (x_k mod p_k)_k is c = sum_k z_k*(P/p_k)
+ * - v*P, where z_k = x_k*(P/p_k)^{-1} mod p_k and v = round(sum_k z_k/p_k).
+ * The sum is accumulated in 64-bit limbs, so a ZZ is only built for the
+ * final result.
+ **/
+struct CRTTable {
+  vector<long> primes; // the indexes of the p_k, in increasing order
+
+  vector<unsigned long> hatInv, hatInvPre; // (P/p_k)^{-1} mod p_k
+  vector<double> recip;                    // 1/p_k
+
+  //! P/p_k and P as little-endian arrays of nLimbs 64-bit words each, with
+  //! room to spare for a sum of primes.size() terms and a sign bit
+  long nLimbs;
+  vector<unsigned long> hatLimbs; // primes.size()*nLimbs words
+  vector<unsigned long> prodLimbs;
+
+  ZZ prod, halfProd, negHalfProd; // P, floor(P/2), -floor(P/2)
+
+  CRTTable(const FHEcontext& context, const IndexSet& s);
+};
+
+//! @brief Default bound on the number of cached automorphism tables
+#define FHE_AUTOMORPH_CACHE_SIZE 64
+
+//! @brief The size of the primes in the chain when FHEcontext::widePrimes
+//! is set (the explicit tables need q < 2^61)
+#define FHE_WIDE_PRIME_BITS 60
 
 /**
  * @class FHEcontext
@@ -48,6 +121,27 @@ class FHEcontext {
   // This is private since the implementation assumes that the list of
   // primes only grows and no prime is ever modified or removed.
 
+  // A cache of gather tables for automorphisms, see getAutomorphTable().
+  // The entries are tagged by last use, the least recently used one is
+  // evicted when the cache is full. The cache is guarded by a lock (see
+  // FHEContext.cpp), so getAutomorphTable may be called from many threads.
+  struct AutomorphEntry {
+    shared_ptr< const vector<long> > table;
+    unsigned long lastUse;
+  };
+  mutable map<long, AutomorphEntry> automorphCache;
+  mutable unsigned long automorphClock;
+  long automorphCacheSize; // max number of tables to keep
+  void evictAutomorphTable() const;
+
+  // The mod-down tables, keyed by the dropped indexes, then -1, then the
+  // kept indexes. There are only a few (dropped,kept) pairs in the chain
+  // and each table is small, so nothing is evicted.
+  mutable map< vector<long>, shared_ptr<const ModDownTable> > modDownCache;
+  mutable map< vector<long>, shared_ptr<const CRTTable> > crtCache;
+
+  shared_ptr<ThreadPool> threadPool; // NULL means serial execution
+
 public:
   // FHEContext is meant for convenience, not encapsulation: Most data
   // members are public and can be initialized by the application program.
@@ -100,11 +194,36 @@ public:
 
   long fftPrimeCount;
 
+  //! @brief Compute the FFTs with explicit precomputed tables (the default).
+  //! If false, the primes that are added afterwards use NTL's routines,
+  //! and DoubleCRT operations run serially
+  bool explicitFFT;
+
+  //! @brief Choose the primes that are added afterwards (by AddManyPrimes
+  //! and buildModChain) with FHE_WIDE_PRIME_BITS bits rather than below
+  //! NTL_SP_BOUND: fewer rows per DoubleCRT for the same total modulus. The
+  //! DoubleCRT arithmetic then uses Montgomery/Shoup products (see rowops.h)
+  //! and requires explicitFFT
+  bool widePrimes;
+
+  //! @brief Let DoubleCRT objects keep, per prime, whichever of the
+  //! coefficient and evaluation forms is valid, and convert only when an
+  //! operation needs the other form (see DoubleCRT). Conversions may then
+  //! happen inside const methods, so a DoubleCRT that is read concurrently
+  //! by several threads should first be brought to evaluation form
+  bool lazyCRT;
+
+  //! @brief The bound on the primes that are added to the chain
+  long primeBound() const
+  { return widePrimes? (1L << FHE_WIDE_PRIME_BITS) : NTL_SP_BOUND; }
+
   // Constructors must ensure that alMod points to zMStar
 
   // constructor
   FHEcontext(unsigned long m, unsigned long p, unsigned long r): zMStar(m, p), alMod(zMStar, r)
-  { stdev=3.2; fftPrimeCount = 0; }
+  { stdev=3.2; fftPrimeCount = 0; explicitFFT = true; widePrimes = false;
+    lazyCRT = false;
+    automorphClock = 0; automorphCacheSize = FHE_AUTOMORPH_CACHE_SIZE; }
 
   bool operator==(const FHEcontext& other) const;
   bool operator!=(const FHEcontext& other) const { return !(*this==other); }
@@ -158,6 +277,47 @@ public:
     return ans;
   }
 
+  //! @brief The gather table for the automorphism X -> X^k, gcd(k,m)=1.
+  //! If t[] is the returned table, applying the automorphism to a row in
+  //! evaluation order is new[i] = old[t[i]], for i=0,...,phi(m)-1.
+  //! Tables are computed on first use and cached, the returned pointer
+  //! remains valid even if the table is later evicted from the cache.
+  shared_ptr< const vector<long> > getAutomorphTable(long k) const;
+
+  //! @brief Bound the number of cached automorphism tables (each one
+  //! takes phi(m) longs), n=0 disables the cache
+  void setAutomorphCacheSize(long n);
+  long getAutomorphCacheSize() const { return automorphCacheSize; }
+
+  //! @brief The constants for dividing by the product of the primes in
+  //! dropped while working modulo the primes in kept (the two sets must be
+  //! disjoint). Tables are computed on first use and cached
+  shared_ptr<const ModDownTable>
+  getModDownTable(const IndexSet& dropped, const IndexSet& kept) const;
+
+  //! @brief The CRT constants for the primes in s, computed on first use
+  //! and cached
+  shared_ptr<const CRTTable> getCRTTable(const IndexSet& s) const;
+
+  ///@{
+  /**
+   * @name Parallel execution
+   * DoubleCRT operations split their work, across primes and across chunks
+   * of each row, among the threads of the pool that is attached to their
+   * context. Without a pool (the default) they run serially. The results
+   * do not depend on the number of threads.
+   **/
+  //! @brief Use a new pool of nThreads threads, nThreads<=1 is serial
+  void setThreadCount(long nThreads);
+  long getThreadCount() const;
+
+  //! @brief Attach an existing pool, which may be shared among contexts
+  //! (NULL means serial)
+  void setThreadPool(const shared_ptr<ThreadPool>& pool)
+  { threadPool = pool; }
+  ThreadPool* getThreadPool() const { return threadPool.get(); }
+  ///@}
+
   //! @brief Find the next prime and add it to the chain
   long AddPrime(long startFrom, long delta, bool special=false);
 
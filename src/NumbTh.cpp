@@ -14,10 +14,12 @@
  * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
  */
 #include "NumbTh.h"
+#include "ntt.h"
 
 #include <fstream>
 #include <cassert>
 #include <cctype>
+#include <algorithm>
 
 using namespace std;
 
@@ -347,6 +349,28 @@ void PolyRed(ZZX& out, const ZZX& in, const ZZ& q, bool abs)
     }
 }
 
+// NTL's byte conversions are little-endian, independently of the host
+void ZZToLimbs(unsigned long* w, const ZZ& a, long n)
+{
+  static thread_local vector<unsigned char> buf;
+  buf.resize(8*n);
+  BytesFromZZ(&buf[0], a, 8*n);
+  for (long i = 0; i < n; i++) {
+    unsigned long x = 0;
+    for (long j = 7; j >= 0; j--) x = (x << 8) | buf[8*i+j];
+    w[i] = x;
+  }
+}
+
+void ZZFromLimbs(ZZ& x, const unsigned long* w, long n)
+{
+  static thread_local vector<unsigned char> buf;
+  buf.resize(8*n);
+  for (long i = 0; i < n; i++)
+    for (long j = 0; j < 8; j++) buf[8*i+j] = (unsigned char) (w[i] >> (8*j));
+  ZZFromBytes(x, &buf[0], 8*n);
+}
+
 void PolyRed(ZZX& out, const ZZX& in, long q, bool abs)
 {
   // ensure that out has the same degree as in
@@ -408,7 +432,7 @@ long is_in(long x,int* X,long sz)
 template <class zzvec>
 bool intVecCRT(vec_ZZ& vp, const ZZ& p, const zzvec& vq, long q)
 {
-  long pInv = InvMod(rem(p,q), q); // p^{-1} mod q
+  long pInv = InvMod(rem(p,q), q); // p^{-1} mod q, q may be a wide prime
   long n = min(vp.length(),vq.length());
   long q_over_2 = q/2;
   ZZ tmp;
@@ -417,7 +441,7 @@ bool intVecCRT(vec_ZZ& vp, const ZZ& p, const zzvec& vq, long q)
     conv(vqi, vq[i]); // convert to single precision
     long vq_minus_vp_mod_q = SubMod(vqi, rem(vp[i],q), q);
 
-    long delta_times_pInv = MulMod(vq_minus_vp_mod_q, pInv, q);
+    long delta_times_pInv = mulModWide(vq_minus_vp_mod_q, pInv, q);
     if (delta_times_pInv > q_over_2) delta_times_pInv -= q;
 
     mul(tmp, delta_times_pInv, p); // tmp = [(vq_i-vp_i)*p^{-1}]_q * p
@@ -427,7 +451,7 @@ bool intVecCRT(vec_ZZ& vp, const ZZ& p, const zzvec& vq, long q)
   for (long i=vq.length(); i<vp.length(); i++) {
     long minus_vp_mod_q = NegateMod(rem(vp[i],q), q);
 
-    long delta_times_pInv = MulMod(minus_vp_mod_q, pInv, q);
+    long delta_times_pInv = mulModWide(minus_vp_mod_q, pInv, q);
     if (delta_times_pInv > q_over_2) delta_times_pInv -= q;
 
     mul(tmp, delta_times_pInv, p); // tmp = [(vq_i-vp_i)*p^{-1}]_q * p
@@ -439,6 +463,74 @@ bool intVecCRT(vec_ZZ& vp, const ZZ& p, const zzvec& vq, long q)
 template bool intVecCRT(vec_ZZ&, const ZZ&, const vec_ZZ&, long);
 template bool intVecCRT(vec_ZZ&, const ZZ&, const vec_long&, long);
 
+// ChaCha20 (Bernstein's original variant: 64-bit counter and nonce)
+#define CHACHA_ROTL(v,c) (((v) << (c)) | ((v) >> (32-(c))))
+#define CHACHA_QR(a,b,c,d) {                      \
+  a += b; d ^= a; d = CHACHA_ROTL(d,16);          \
+  c += d; b ^= c; b = CHACHA_ROTL(b,12);          \
+  a += b; d ^= a; d = CHACHA_ROTL(d, 8);          \
+  c += d; b ^= c; b = CHACHA_ROTL(b, 7); }
+
+PRGStream::PRGStream(const ZZ& seed, unsigned long nonce)
+{
+  unsigned char key[32];
+  BytesFromZZ(key, seed, 32); // the low 256 bits, little endian
+
+  state[0] = 0x61707865; state[1] = 0x3320646e; // "expand 32-byte k"
+  state[2] = 0x79622d32; state[3] = 0x6b206574;
+  for (long i = 0; i < 8; i++)
+    state[4+i] = (uint32_t) key[4*i] | ((uint32_t) key[4*i+1] << 8)
+      | ((uint32_t) key[4*i+2] << 16) | ((uint32_t) key[4*i+3] << 24);
+  state[12] = state[13] = 0; // block counter
+  state[14] = (uint32_t) nonce;
+  state[15] = (uint32_t) (nonce >> 32);
+  pos = 16; // no output yet
+}
+
+void PRGStream::nextBlock()
+{
+  uint32_t x[16];
+  for (long i = 0; i < 16; i++) x[i] = state[i];
+  for (long r = 0; r < 10; r++) { // 20 rounds
+    CHACHA_QR(x[0], x[4], x[ 8], x[12]);
+    CHACHA_QR(x[1], x[5], x[ 9], x[13]);
+    CHACHA_QR(x[2], x[6], x[10], x[14]);
+    CHACHA_QR(x[3], x[7], x[11], x[15]);
+    CHACHA_QR(x[0], x[5], x[10], x[15]);
+    CHACHA_QR(x[1], x[6], x[11], x[12]);
+    CHACHA_QR(x[2], x[7], x[ 8], x[13]);
+    CHACHA_QR(x[3], x[4], x[ 9], x[14]);
+  }
+  for (long i = 0; i < 16; i++) block[i] = x[i] + state[i];
+  if (++state[12] == 0) ++state[13];
+  pos = 0;
+}
+
+unsigned long PRGStream::nextWord()
+{
+  if (pos >= 16) nextBlock();
+  unsigned long w = (unsigned long) block[pos]
+    | ((unsigned long) block[pos+1] << 32);
+  pos += 2;
+  return w;
+}
+
+long PRGStream::nextBnd(long n)
+{
+  assert(n > 0);
+  if (n == 1) return 0;
+  unsigned long mask = (1UL << NumBits(n-1)) - 1;
+  unsigned long x;
+  do { x = nextWord() & mask; } while (x >= (unsigned long) n); // rejection
+  return (long) x;
+}
+
+recursive_mutex& getNTLModulusMutex()
+{
+  static recursive_mutex mtx;
+  return mtx;
+}
+
 // MinGW hack
 #ifndef lrand48
 #if defined(__MINGW32__) || defined(WIN32)
@@ -447,51 +539,61 @@ template bool intVecCRT(vec_ZZ&, const ZZ&, const vec_long&, long);
 #endif
 #endif
 
-void sampleHWt(ZZX &poly, long Hwt, long n)
+void sampleHWt(vector<long>& poly, long Hwt, long n)
 {
-  if (n<=0) n=deg(poly)+1; if (n<=0) return;
-  clear(poly);          // initialize to zero
-  poly.SetMaxLength(n); // allocate space for degree-(n-1) polynomial
+  poly.assign(max(n,0L), 0); // initialize to zero
+  if (n<=0) return;
 
   long b,u,i=0;
   if (Hwt>n) Hwt=n;
   while (i<Hwt) {  // continue until exactly Hwt nonzero coefficients
     u=lrand48()%n; // The next coefficient to choose
-    if (IsZero(coeff(poly,u))) { // if we didn't choose it already
+    if (poly[u]==0) { // if we didn't choose it already
       b = lrand48()&2; // b random in {0,2}
       b--;             //   random in {-1,1}
-      SetCoeff(poly,u,b);
+      poly[u] = b;
 
       i++; // count another nonzero coefficient
     }
   }
-  poly.normalize(); // need to call this after we work on the coeffs
 }
 
-void sampleSmall(ZZX &poly, long n)
+void sampleHWt(ZZX &poly, long Hwt, long n)
 {
   if (n<=0) n=deg(poly)+1; if (n<=0) return;
-  poly.SetMaxLength(n); // allocate space for degree-(n-1) polynomial
+  vector<long> c;
+  sampleHWt(c, Hwt, n);
+  convert(poly, c);
+}
+
+void sampleSmall(vector<long>& poly, long n)
+{
+  poly.resize(max(n,0L));
 
   for (long i=0; i<n; i++) {    // Chosse coefficients, one by one
     long u = lrand48();
     if (u&1) {                 // with prob. 1/2 choose between -1 and +1
       u = (u & 2) -1;
-      SetCoeff(poly, i, u);
+      poly[i] = u;
     }
-    else SetCoeff(poly, i, 0); // with ptob. 1/2 set to 0
+    else poly[i] = 0;          // with ptob. 1/2 set to 0
   }
-  poly.normalize(); // need to call this after we work on the coeffs
 }
 
-void sampleGaussian(ZZX &poly, long n, double stdev)
+void sampleSmall(ZZX &poly, long n)
+{
+  if (n<=0) n=deg(poly)+1; if (n<=0) return;
+  vector<long> c;
+  sampleSmall(c, n);
+  convert(poly, c);
+}
+
+void sampleGaussian(vector<long>& poly, long n, double stdev)
 {
   static double const Pi=4.0*atan(1.0); // Pi=3.1415..
   static long const bignum = 0xfffffff;
 
-  if (n<=0) n=deg(poly)+1; if (n<=0) return;
-  poly.SetMaxLength(n); // allocate space for degree-(n-1) polynomial
-  for (long i=0; i<n; i++) SetCoeff(poly, i, ZZ::zero());
+  poly.assign(max(n,0L), 0);
 
   // Uses the Box-Muller method to get two Normal(0,stdev^2) variables
   for (long i=0; i<n; i+=2) {
@@ -503,14 +605,18 @@ void sampleGaussian(ZZX &poly, long n, double stdev)
     assert(rr < 8*stdev); // sanity-check, no more than 8 standard deviations
 
     // Generate two Gaussians RV's, rounded to integers
-    long x = (long) floor(rr*cos(theta) +0.5);
-    SetCoeff(poly, i, x);
-    if (i+1 < n) {
-      x = (long) floor(rr*sin(theta) +0.5);
-      SetCoeff(poly, i+1, x);
-    }
+    poly[i] = (long) floor(rr*cos(theta) +0.5);
+    if (i+1 < n)
+      poly[i+1] = (long) floor(rr*sin(theta) +0.5);
   }
-  poly.normalize(); // need to call this after we work on the coeffs
+}
+
+void sampleGaussian(ZZX &poly, long n, double stdev)
+{
+  if (n<=0) n=deg(poly)+1; if (n<=0) return;
+  vector<long> c;
+  sampleGaussian(c, n, stdev);
+  convert(poly, c);
 }
 
 void sampleUniform(ZZX& poly, const ZZ& B, long n)
@@ -679,6 +785,15 @@ void convert(vector< vector<ZZX> >& X, const mat_zz_pE& A)
       convert(X[i], A[i]);
 }
 
+void convert(ZZX& X, const vector<long>& A)
+{
+   long n = A.size();
+   X.rep.SetLength(n);
+   for (long i = 0; i < n; i++)
+      conv(X.rep[i], A[i]);
+   X.normalize();
+}
+
 void mul(vector<ZZX>& x, const vector<ZZX>& a, long b)
 {
    long n = a.size();
@@ -35,6 +35,8 @@
 #include <NTL/GF2XFactoring.h>
 #include <unordered_map>
 #include <string>
+#include <mutex>
+#include <stdint.h>
 NTL_CLIENT
 
 
@@ -164,6 +166,11 @@ inline ZZX MulMod(const ZZX& f, long a, long q, bool abs=true) {
   return res;
 }
 
+//! @brief Write |a| mod 2^{64n} as n 64-bit words, least significant first
+void ZZToLimbs(unsigned long* w, const ZZ& a, long n);
+//! @brief The inverse of ZZToLimbs, x = sum_i w[i]*2^{64i}
+void ZZFromLimbs(ZZ& x, const unsigned long* w, long n);
+
 ///@{
 //! @name Some enhanced conversion routines
 inline void convert(long& x1, const GF2X& x2)
@@ -178,6 +185,7 @@ void convert(vec_zz_pE& X, const vector<ZZX>& A);
 void convert(mat_zz_pE& X, const vector< vector<ZZX> >& A);
 void convert(vector<ZZX>& X, const vec_zz_pE& A);
 void convert(vector< vector<ZZX> >& X, const mat_zz_pE& A);
+void convert(ZZX& X, const vector<long>& A); // coefficients A[0..n-1]
 ///@}
 
 //! A generic template that resolves to NTL's conv routine
@@ -285,6 +293,13 @@ void sampleGaussian(ZZX &poly, long n=0, double stdev=1.0);
 //! over [-B..B]
 void sampleUniform(ZZX& poly, const ZZ& B, long n=0);
 
+// The same samplers with the n coefficients in a vector<long>, for the
+// small-coefficient conversion to DoubleCRT (see DoubleCRT.h). The ZZX
+// versions above draw the same random values and convert them.
+void sampleSmall(vector<long>& poly, long n);
+void sampleHWt(vector<long>& poly, long Hwt, long n);
+void sampleGaussian(vector<long>& poly, long n, double stdev=1.0);
+
 
 /**
  * @brief Facility for "restoring" the NTL PRG state.
@@ -333,6 +348,63 @@ private:
   RandomState& operator=(const RandomState&); // disable assignment
 };
 
+/**
+ * @brief A deterministic pseudorandom stream, without any global state.
+ *
+ * The stream is the ChaCha20 keystream with the low 256 bits of the seed as
+ * the key and a 64-bit nonce. Unlike NTL's PRG, which is a single global
+ * generator, every PRGStream object is independent, so different threads
+ * can use different streams concurrently, and the substreams for different
+ * nonces (e.g., for different rows of a pseudorandom DoubleCRT) can be
+ * generated in any order.
+ **/
+class PRGStream {
+  uint32_t state[16]; // the ChaCha20 input block
+  uint32_t block[16]; // the current output block
+  long pos;           // the next unused word of block
+
+  void nextBlock();
+
+public:
+  PRGStream(const ZZ& seed, unsigned long nonce);
+
+  //! @brief The next 64 random bits
+  unsigned long nextWord();
+
+  //! @brief A uniform random integer in [0,n), for n>0
+  long nextBnd(long n);
+};
+
+/**
+ * @name Locking NTL's current moduli
+ * @brief NTL keeps the current modulus of zz_p, ZZ_p, zz_pE and GF2E in
+ * global variables, so two threads that use different moduli must not run
+ * concurrently. Code that sets one of these moduli and then relies on it
+ * should hold the (recursive) NTL modulus lock while doing so. The easiest
+ * way is to use a LockedBak, e.g. LockedBak<zz_pBak> instead of zz_pBak.
+ *
+ * The lock must never be requested inside a ThreadPool job, since the job
+ * may run on a worker thread while the caller of the parallel loop holds it.
+ **/
+///@{
+//! @brief The global NTL modulus lock
+recursive_mutex& getNTLModulusMutex();
+
+//! @brief Holds the NTL modulus lock during its lifetime
+class NTLModulusLock {
+  NTLModulusLock(const NTLModulusLock&);            // not copyable
+  NTLModulusLock& operator=(const NTLModulusLock&);
+public:
+  NTLModulusLock() { getNTLModulusMutex().lock(); }
+  ~NTLModulusLock() { getNTLModulusMutex().unlock(); }
+};
+
+//! @brief An NTL backup object (zz_pBak, zz_pEBak, etc.) that also holds the
+//! lock. The lock is acquired before the backup and released only after the
+//! saved modulus is restored by the destructor.
+template<class Bak> class LockedBak: private NTLModulusLock, public Bak {};
+///@}
+
 //! @brief Advance the input stream beyond white spaces and a single instance of the char cc
 void seekPastChar(istream& str, int cc);
 
@@ -249,7 +249,8 @@ void PAlgebra::printout() const
   }
 }
 
-// Generate the representation of Z_m^* for a given odd integer m
+// Generate the representation of Z_m^* for a given integer m (usually odd,
+// or a power of two for the negacyclic FFT)
 // and plaintext base p
 PAlgebra::PAlgebra(unsigned long mm, unsigned long pp)
 {
@@ -54,6 +54,7 @@
 #include <NTL/GF2EX.h>
 #include <NTL/lzz_pEX.h>
 #include "cloned_ptr.h"
+#include "NumbTh.h"
 NTL_CLIENT
 
 class PAlgebra {
@@ -253,12 +254,12 @@ public:
   typedef GF2X RX;
   typedef vec_GF2X vec_RX;
   typedef GF2XModulus RXModulus;
-  typedef DummyBak RBak;
+  typedef DummyBak RBak; // GF2X has no modulus to lock
   typedef DummyContext RContext;
   typedef GF2E RE;
   typedef vec_GF2E vec_RE;
   typedef GF2EX REX;
-  typedef GF2EBak REBak;
+  typedef LockedBak<GF2EBak> REBak;
   typedef vec_GF2EX vec_REX;
   typedef GF2EContext REContext;
 };
@@ -272,12 +273,12 @@ public:
   typedef zz_pX RX;
   typedef vec_zz_pX vec_RX;
   typedef zz_pXModulus RXModulus;
-  typedef zz_pBak RBak;
+  typedef LockedBak<zz_pBak> RBak; // see NTLModulusLock in NumbTh.h
   typedef zz_pContext RContext;
   typedef zz_pE RE;
   typedef vec_zz_pE vec_RE;
   typedef zz_pEX REX;
-  typedef zz_pEBak REBak;
+  typedef LockedBak<zz_pEBak> REBak;
   typedef vec_zz_pEX vec_REX;
   typedef zz_pEContext REContext;
 };
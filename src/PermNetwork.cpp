@@ -17,6 +17,7 @@
 #include "Ctxt.h"
 #include "permutations.h"
 #include "EncryptedArray.h"
+#include "PreparedConstant.h"
 
 ostream& operator<< (ostream &s, const PermNetwork &net)
 {
@@ -78,6 +79,8 @@ void PermNetwork::buildNetwork(const Permut& pi, const GeneratorTrees& trees)
   Vec<long> dims;
   trees.getCubeSubDims(dims);
 
+  maskCache.clear(); // the masks of the previous network, if any
+
   //  std::cerr << "pi =      "<<pi<<endl;
   //  std::cerr << "map2cube ="<<trees.mapToCube()<<endl;
   //  std::cerr << "map2array="<<trees.mapToArray()<<endl;
@@ -203,13 +206,26 @@ makeMask(vector<long>& mask, Vec<long>& haystack, long needle)
 
 // Apply a permutation network to a ciphertext
 // FIXME: Do we need to also give an EncryptedArray object as paramter?
-void PermNetwork::applyToCtxt(Ctxt& c) const
+// Compute the masks of every layer, and the automorphisms that go with them.
+// Each mask is automorphed here once, so applyToCtxt can rotate first and
+// multiply by the prepared (rotated) masks
+shared_ptr<const PermNetwork::LayerMasks>
+PermNetwork::prepareMasks(const FHEcontext& context) const
 {
-  const PAlgebra& al = c.getContext().zMStar;
-  EncryptedArray ea(c.getContext());
+  lock_guard<mutex> lock(maskLock.mtx);
+  map<const FHEcontext*, shared_ptr<const LayerMasks> >::iterator it
+    = maskCache.find(&context);
+  if (it != maskCache.end()) return it->second; // already done
+
+  const PAlgebra& al = context.zMStar;
+  EncryptedArray ea(context);
   // Use G(X)=X for this ea object, this works since we only have 0/1 entries
 
-  // Apply the layers, one at a time
+  shared_ptr<LayerMasks> lm(new LayerMasks);
+  vector< vector< shared_ptr<const PreparedConstant> > >& masks = lm->masks;
+  vector< vector<long> >& maskVals = lm->vals;
+  masks.resize(layers.length());
+  maskVals.resize(layers.length());
   for (long i=0; i<layers.length(); i++) {
     const PermNetLayer& lyr = layers[i];
     if (lyr.isID) continue; // this layer is the identity permutation
@@ -219,31 +235,52 @@ void PermNetwork::applyToCtxt(Ctxt& c) const
 
     Vec<long> unused = lyr.shifts; // copy to a new vector
     vector<long> mask(lyr.shifts.length());  // buffer to hold masks
-    Ctxt sum(c.getPubKey(), c.getPtxtSpace()); // an empty ciphertext
-
     long shamt = 0;
-    bool frst = true;
     while (true) {
       pair<long,bool> ret=makeMask(mask, unused, shamt); // compute mask
       if (ret.second) { // non-empty mask
-	Ctxt tmp = c;
+	long val = PowerMod(g2e, shamt, al.getM());
 	ZZX maskPoly;
-	ea.encode(maskPoly, mask);    // encode mask as polynomial
-	tmp.multByConstant(maskPoly); // multiply by mask
-	if (shamt!=0) // rotate if the shift amount is nonzero
-	  tmp.smartAutomorph(PowerMod(g2e, shamt, al.getM()));
-	if (frst) {
-	  sum = tmp;
-	  frst = false;
-	}
-	else
-	  sum += tmp;
+	ea.encode(maskPoly, mask); // encode mask as polynomial
+	DoubleCRT maskCRT(maskPoly, context);
+	maskCRT.automorph(val);
+	maskCRT.toPoly(maskPoly);
+	masks[i].push_back(shared_ptr<const PreparedConstant>(
+	                    new PreparedConstant(maskPoly, context)));
+	maskVals[i].push_back(val);
       }
       if (ret.first >= 0)
 	shamt = unused[ret.first]; // next shift amount to use
 
       else break; // unused is all-zero, done with this layer
     }
-    c = sum; // update the cipehrtext c before the next layer
+  }
+  maskCache[&context] = lm;
+  return lm;
+}
+
+void PermNetwork::applyToCtxt(Ctxt& c) const
+{
+  // The masks for this context, computed on the first call with it
+  shared_ptr<const LayerMasks> lm = prepareMasks(c.getContext());
+  const vector< vector< shared_ptr<const PreparedConstant> > >& masks
+    = lm->masks;
+  const vector< vector<long> >& maskVals = lm->vals;
+
+  // Apply the layers, one at a time
+  for (long i=0; i<layers.length(); i++) {
+    const PermNetLayer& lyr = layers[i];
+    if (lyr.isID) continue; // this layer is the identity permutation
+
+    // Rotate first and then multiply by the rotated masks, so that all the
+    // rotations of c share a single digit decomposition
+    vector<Ctxt> rotated;
+    c.hoistedAutomorph(rotated, maskVals[i]);
+    for (size_t j=0; j<rotated.size(); j++) {
+      rotated[j].multByConstant(*masks[i][j]);
+      if (j>0) rotated[0] += rotated[j];
+    }
+    if (rotated.empty()) c.clear(); // no non-empty masks
+    else c = std::move(rotated[0]); // update the cipehrtext c before the next layer
   }
 }
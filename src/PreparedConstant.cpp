@@ -0,0 +1,131 @@
+/* Copyright (C) 2012,2013 IBM Corp.
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+/* PreparedConstant.cpp - plaintext constants that keep their DoubleCRT
+ * forms, and a bounded LRU cache of such constants
+ */
+#include "PreparedConstant.h"
+#include "FHEContext.h"
+#include "timing.h"
+
+PreparedConstant::PreparedConstant(const ZZX& _poly, const FHEcontext& _context)
+  : context(_context), poly(_poly)
+{}
+
+const DoubleCRT& PreparedConstant::getDCRT(const IndexSet& s) const
+{
+  lock_guard<mutex> lock(mtx);
+
+  // Look for this set, or for a superset of it to drop primes from
+  list< pair<IndexSet, DoubleCRT> >::iterator sup = forms.end();
+  for (list< pair<IndexSet, DoubleCRT> >::iterator it = forms.begin();
+       it != forms.end(); ++it) {
+    if (it->first == s) return it->second;
+    if (s <= it->first && 
+        (sup == forms.end() || card(it->first) < card(sup->first)))
+      sup = it;
+  }
+
+  FHE_TIMER_START;
+  if (sup != forms.end()) {
+    // The copy shares the rows of the superset (see RowMap), so removing
+    // the other primes does not copy anything
+    forms.push_back(make_pair(s, sup->second));
+    forms.back().second.removePrimes(sup->first / s);
+  }
+  else
+    forms.push_back(make_pair(s, DoubleCRT(poly, context, s)));
+
+  // The form is read by many threads from now on, which is only allowed
+  // in evaluation form (see DoubleCRT::toEvalForm)
+  forms.back().second.toEvalForm();
+  assert(forms.back().second.inEvalForm());
+  FHE_TIMER_STOP;
+  return forms.back().second;
+}
+
+long PreparedConstant::numForms() const
+{
+  lock_guard<mutex> lock(mtx);
+  return forms.size();
+}
+
+
+PreparedConstantCache::PreparedConstantCache(long _capacity)
+  : capacity(_capacity)
+{
+  assert(capacity > 0);
+}
+
+PreparedConstantCache::PreparedConstantCache(const PreparedConstantCache& other)
+  : capacity(other.capacity)
+{}
+
+PreparedConstantCache& 
+PreparedConstantCache::operator=(const PreparedConstantCache& other)
+{
+  if (this == &other) return *this;
+  clear();
+  capacity = other.capacity;
+  return *this;
+}
+
+shared_ptr<const PreparedConstant>
+PreparedConstantCache::get(long a, long b, long c, const FHEcontext& context,
+                           const function<void(ZZX&)>& build)
+{
+  Key key(a, make_pair(b, c));
+  {
+    lock_guard<mutex> lock(mtx);
+    map<Key, EntryList::iterator>::iterator it = index.find(key);
+    if (it != index.end()) { // a hit, move it to the front
+      entries.splice(entries.begin(), entries, it->second);
+      return it->second->second;
+    }
+  }
+
+  // A miss: build the constant without holding the lock, build may use
+  // NTL's current modulus
+  ZZX poly;
+  build(poly);
+  shared_ptr<const PreparedConstant> pc(new PreparedConstant(poly, context));
+
+  lock_guard<mutex> lock(mtx);
+  map<Key, EntryList::iterator>::iterator it = index.find(key);
+  if (it != index.end()) { // another thread was faster
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->second;
+  }
+  entries.push_front(make_pair(key, pc));
+  index[key] = entries.begin();
+  if ((long) entries.size() > capacity) { // evict the least recently used
+    index.erase(entries.back().first);
+    entries.pop_back();
+  }
+  return pc;
+}
+
+long PreparedConstantCache::size() const
+{
+  lock_guard<mutex> lock(mtx);
+  return entries.size();
+}
+
+void PreparedConstantCache::clear()
+{
+  lock_guard<mutex> lock(mtx);
+  entries.clear();
+  index.clear();
+}
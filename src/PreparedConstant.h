@@ -0,0 +1,114 @@
+/* Copyright (C) 2012,2013 IBM Corp.
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+#ifndef _PreparedConstant_H_
+#define _PreparedConstant_H_
+/**
+ * @file PreparedConstant.h
+ * @brief Plaintext constants that keep their DoubleCRT forms
+ **/
+#include <list>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <functional>
+#include <NTL/ZZX.h>
+#include "DoubleCRT.h"
+
+NTL_CLIENT
+
+/**
+ * @class PreparedConstant
+ * @brief A constant polynomial together with its DoubleCRT forms
+ *
+ * Multiplying a ciphertext by a ZZX first converts the ZZX to a DoubleCRT
+ * over the primes of the ciphertext, which takes an FFT per prime. A
+ * PreparedConstant does this conversion once for every set of primes that
+ * it is used with, and remembers the result. The form for a set of primes
+ * that is contained in one that was already computed is obtained by just
+ * dropping primes, so a constant that is used at decreasing levels is only
+ * converted once.
+ *
+ * The forms are computed lazily by the const method getDCRT, which may be
+ * called concurrently from different threads.
+ **/
+class PreparedConstant {
+  const FHEcontext& context;
+  ZZX poly;
+
+  mutable mutex mtx; // protects forms
+  mutable list< pair<IndexSet, DoubleCRT> > forms; // references stay valid
+
+  PreparedConstant(const PreparedConstant&);            // not copyable
+  PreparedConstant& operator=(const PreparedConstant&);
+
+public:
+  PreparedConstant(const ZZX& poly, const FHEcontext& context);
+
+  const FHEcontext& getContext() const { return context; }
+  const ZZX& getPoly() const { return poly; }
+
+  //! @brief The DoubleCRT form of the constant over the primes in s
+  const DoubleCRT& getDCRT(const IndexSet& s) const;
+
+  //! @brief The number of prime sets for which a form was computed
+  long numForms() const;
+};
+
+/**
+ * @class PreparedConstantCache
+ * @brief A bounded cache of PreparedConstants, with LRU replacement
+ *
+ * The constants are identified by a key of three integers whose meaning is
+ * up to the user (e.g., EncryptedArray uses a kind of mask, a generator and
+ * a rotation amount). Each entry holds all the levels at which the constant
+ * was used (see PreparedConstant). The cache may be used concurrently from
+ * different threads; the entries are returned as shared pointers, so they
+ * remain valid after they are evicted.
+ **/
+class PreparedConstantCache {
+public:
+  typedef pair<long, pair<long,long> > Key;
+
+private:
+  long capacity; // the maximal number of entries
+  mutable mutex mtx;
+
+  // the entries, most recently used first, and an index into this list
+  typedef list< pair< Key, shared_ptr<const PreparedConstant> > > EntryList;
+  EntryList entries;
+  map<Key, EntryList::iterator> index;
+
+public:
+  //! @brief An empty cache with at most capacity entries
+  explicit PreparedConstantCache(long capacity=64);
+
+  //! @brief Copying a cache gives an empty cache with the same capacity
+  PreparedConstantCache(const PreparedConstantCache& other);
+  PreparedConstantCache& operator=(const PreparedConstantCache& other);
+
+  //! @brief The constant with key (a,b,c). On a miss, build(poly) is called
+  //! to compute the polynomial, and the least recently used entry is evicted
+  //! if the cache is full
+  shared_ptr<const PreparedConstant>
+  get(long a, long b, long c, const FHEcontext& context,
+      const function<void(ZZX&)>& build);
+
+  long size() const;
+  long getCapacity() const { return capacity; }
+  void clear();
+};
+
+#endif // _PreparedConstant_H_
@@ -0,0 +1,208 @@
+/* Copyright (C) 2012,2013 IBM Corp.
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+/* RowMap.cpp - contiguous, cache-line-aligned storage of equal-length rows
+ *
+ * All the rows live in a single buffer of nRows*stride longs, where stride
+ * is the row length rounded up to a whole number of cache lines. The table
+ * slot[] maps an index to the row that holds its data. Removed rows are
+ * kept on a free list and are reused by subsequent insertions.
+ *
+ * Copies share the buffer (and have the same slot[] table), unshare()
+ * before the first write copies the rows in use to a new one. A free row
+ * of one map may still be in use by another map that shares the buffer,
+ * which is fine since it is only written to after the copy.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <NTL/tools.h>
+
+#include "RowMap.h"
+
+NTL_CLIENT
+
+static long roundUpStride(long len)
+{
+  const long perLine = ROWMAP_ALIGN / sizeof(long);
+  return ((len + perLine - 1) / perLine) * perLine;
+}
+
+RowMap::RowMap(long rowLength)
+{
+  len = rowLength;
+  stride = roundUpStride(len);
+  nRows = 0;
+  buf = NULL;
+}
+
+// copies share the buffer
+RowMap::RowMap(const RowMap& other):
+  len(other.len), stride(other.stride), nRows(other.nRows),
+  store(other.store), buf(other.buf), slot(other.slot),
+  freeRows(other.freeRows), indexSet(other.indexSet)
+{}
+
+RowMap& RowMap::operator=(const RowMap& other)
+{
+  if (this == &other) return *this;
+
+  len = other.len;
+  stride = other.stride;
+  nRows = other.nRows;
+  store = other.store;
+  buf = other.buf;
+  slot = other.slot;
+  freeRows = other.freeRows;
+  indexSet = other.indexSet;
+  return *this;
+}
+
+RowMap::RowMap(RowMap&& other) noexcept:
+  len(other.len), stride(other.stride), nRows(0), buf(NULL)
+{
+  swap(other);
+}
+
+RowMap& RowMap::operator=(RowMap&& other) noexcept
+{
+  if (this != &other) {
+    RowMap tmp(std::move(other));
+    swap(tmp); // the old rows of *this are released with tmp
+  }
+  return *this;
+}
+
+// The private copy is compacted: only the rows in use are allocated
+void RowMap::unshare()
+{
+  if (!shared()) return;
+
+  shared_ptr<long> oldStore = store; // keeps the old buffer alive
+  vector<long> oldSlot = slot;
+  IndexSet s = indexSet;
+
+  store.reset();
+  buf = NULL;
+  nRows = 0;
+  slot.assign(slot.size(), -1);
+  freeRows.clear();
+  indexSet.clear();
+  insert(s);
+
+  for (long i = s.first(); i <= s.last(); i = s.next(i))
+    memcpy(buf + slot[i]*stride, oldStore.get() + oldSlot[i]*stride,
+           len*sizeof(long));
+}
+
+void RowMap::freeSpace()
+{
+  store.reset();
+  buf = NULL;
+  nRows = 0;
+  slot.clear();
+  freeRows.clear();
+  indexSet.clear();
+}
+
+// Ensure that the buffer can hold at least n rows. The content of the
+// rows that are in use is preserved, and their row numbers do not change.
+void RowMap::reserveRows(long n)
+{
+  if (n <= nRows) return;
+
+  if (stride > 0) {
+    void* newBuf = NULL;
+    if (posix_memalign(&newBuf, ROWMAP_ALIGN, n*stride*sizeof(long)) != 0)
+      Error("RowMap: out of memory");
+    if (buf != NULL) memcpy(newBuf, buf, nRows*stride*sizeof(long));
+    store.reset((long*) newBuf, free); // a shared old buffer stays alive
+    buf = (long*) newBuf;
+  }
+
+  // push the new rows in reverse, so they are handed out in order
+  for (long r = n-1; r >= nRows; r--) freeRows.push_back(r);
+  nRows = n;
+}
+
+void RowMap::insert(long j)
+{
+  if (indexSet.contains(j)) return;
+
+  if (freeRows.empty()) reserveRows(nRows+1);
+  if (j >= (long)slot.size()) slot.resize(j+1, -1);
+
+  slot[j] = freeRows.back();
+  freeRows.pop_back();
+  indexSet.insert(j);
+}
+
+void RowMap::insert(const IndexSet& s)
+{
+  long nNew = card(s / indexSet);
+  if (nNew > (long)freeRows.size())  // allocate all the new rows at once
+    reserveRows(nRows + nNew - (long)freeRows.size());
+
+  for (long i = s.first(); i <= s.last(); i = s.next(i))
+    insert(i);
+}
+
+void RowMap::remove(long j)
+{
+  if (!indexSet.contains(j)) return;
+
+  freeRows.push_back(slot[j]);
+  slot[j] = -1;
+  indexSet.remove(j);
+}
+
+void RowMap::remove(const IndexSet& s)
+{
+  for (long i = s.first(); i <= s.last(); i = s.next(i))
+    remove(i);
+}
+
+void RowMap::clear()
+{
+  const IndexSet& s = indexSet;
+  for (long i = s.first(); i <= s.last(); i = s.next(i))
+    freeRows.push_back(slot[i]);
+  slot.clear();
+  indexSet.clear();
+}
+
+void RowMap::swap(RowMap& other)
+{
+  std::swap(len, other.len);
+  std::swap(stride, other.stride);
+  std::swap(nRows, other.nRows);
+  store.swap(other.store);
+  std::swap(buf, other.buf);
+  slot.swap(other.slot);
+  freeRows.swap(other.freeRows);
+  std::swap(indexSet, other.indexSet);
+}
+
+bool operator==(const RowMap& map1, const RowMap& map2)
+{
+  if (map1.rowLength() != map2.rowLength()) return false;
+  if (map1.getIndexSet() != map2.getIndexSet()) return false;
+
+  const IndexSet& s = map1.getIndexSet();
+  long len = map1.rowLength();
+  for (long i = s.first(); i <= s.last(); i = s.next(i))
+    if (memcmp(map1[i], map2[i], len*sizeof(long)) != 0) return false;
+  return true;
+}
@@ -0,0 +1,133 @@
+/* Copyright (C) 2012,2013 IBM Corp.
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+#ifndef _RowMap
+#define _RowMap
+/**
+ * @file RowMap.h
+ * @brief Contiguous, cache-line-aligned storage of equal-length rows
+ * indexed by a dynamic set of integers.
+ **/
+
+#include "IndexSet.h"
+#include <vector>
+#include <memory>
+#include <iostream>
+#include <cassert>
+
+using namespace std;
+
+//! @brief Alignment (in bytes) of the buffer and of each row in a RowMap
+#define ROWMAP_ALIGN 64
+
+/**
+ * @class RowMap
+ * @brief A map from a dynamic index set to rows of longs of a fixed length.
+ *
+ * This is the storage behind DoubleCRT: all the rows live in one
+ * cache-line-aligned buffer, and each row starts on a cache-line boundary.
+ * Rows are accessed directly by their index (e.g., the index of a prime in
+ * the modulus chain) through a small lookup table, so there is no hashing
+ * and no per-row allocation.
+ *
+ * Removing an index only marks its row as free, and inserting an index
+ * first reuses a free row, so the buffer is reallocated only when the
+ * number of rows in use exceeds its capacity.
+ *
+ * The buffer is reference counted and copy-on-write: copies share it, and
+ * every operation that writes to the rows must first call unshare(), which
+ * gives the map a private (compacted) copy if the buffer is shared. So a
+ * copy costs O(1) row operations until one of the maps is modified. The
+ * non-const operator[] only asserts that the buffer is private: it is
+ * called from the parallel loops, after the unshare() of the operation.
+ **/
+class RowMap {
+  long len;     // the length of every row
+  long stride;  // distance between the beginning of consecutive rows
+  long nRows;   // number of rows allocated in the buffer
+  shared_ptr<long> store; // the aligned buffer, shared with the copies
+  long* buf;    // store.get()
+
+  vector<long> slot;      // slot[j] is the row of index j, or -1
+  vector<long> freeRows;  // rows in buf that are not in use
+  IndexSet indexSet;
+
+  // ensure that the buffer can hold at least n rows
+  void reserveRows(long n);
+  void freeSpace();
+
+public:
+
+  //! @brief An empty map whose rows have the given length
+  explicit RowMap(long rowLength=0);
+
+  RowMap(const RowMap& other);
+  RowMap& operator=(const RowMap& other);
+  ~RowMap() { freeSpace(); }
+
+  //! @brief Moving takes over the buffer, other is left empty
+  RowMap(RowMap&& other) noexcept;
+  RowMap& operator=(RowMap&& other) noexcept;
+
+  //! @brief Get the underlying index set
+  const IndexSet& getIndexSet() const { return indexSet; }
+
+  //! @brief The length of each row
+  long rowLength() const { return len; }
+
+  //! @brief Access functions: will raise an error
+  //! if j does not belong to the current index set. Writing requires a
+  //! private buffer, see unshare()
+  long* operator[] (long j) {
+    assert(indexSet.contains(j));
+    assert(!shared());
+    return buf + slot[j]*stride;
+  }
+  const long* operator[] (long j) const {
+    assert(indexSet.contains(j));
+    return buf + slot[j]*stride;
+  }
+
+  //! @brief Insert indexes to the IndexSet.
+  //! The content of newly inserted rows is undefined.
+  void insert(long j);
+  void insert(const IndexSet& s);
+
+  //! @brief Delete indexes from IndexSet, their rows are kept for reuse
+  void remove(long j);
+  void remove(const IndexSet& s);
+
+  //! @brief Empty the map (the buffer is kept for reuse)
+  void clear();
+
+  //! @brief Is the buffer shared with other maps?
+  bool shared() const { return store.use_count() > 1; }
+
+  //! @brief Make the buffer private to this map, copying the rows in use
+  //! if it is shared
+  void unshare();
+
+  void swap(RowMap& other);
+};
+
+inline void swap(RowMap& map1, RowMap& map2) { map1.swap(map2); }
+
+//! @brief Comparing maps, by comparing all the rows
+bool operator==(const RowMap& map1, const RowMap& map2);
+
+inline bool operator!=(const RowMap& map1, const RowMap& map2)
+{ return !(map1 == map2); }
+
+#endif
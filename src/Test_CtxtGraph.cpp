@@ -0,0 +1,206 @@
+/* Copyright (C) 2012,2013 IBM Corp.
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+#include "FHE.h"
+#include "CtxtGraph.h"
+#include "timing.h"
+#include "EncryptedArray.h"
+
+#include <cassert>
+
+
+/**************
+
+The circuit, on inputs x0,x1,x2,x3 and a random constant k:
+
+  s  = x0*x1 + x2*x3
+  o1 = s*s + automorph(x0)*k
+  o2 = -s
+
+s is used by a multiplication and o1 is an output, so the plan has two
+re-linearizations (rather than the three of the direct computation).
+
+**************/
+
+
+// Compare the decryption of c with that of the direct computation
+bool compare(const EncryptedArray& ea, const FHESecKey& secretKey,
+             const Ctxt& c, const Ctxt& direct, const char* name)
+{
+  PlaintextArray pp(ea), pd(ea);
+  ea.decrypt(c, secretKey, pp);
+  ea.decrypt(direct, secretKey, pd);
+  if (pp.equals(pd)) return true;
+  cerr << "  " << name << " oops\n";
+  return false;
+}
+
+
+void  TestIt(long p, long r, long d, long c, long k, long w,
+               long L, long m, long T, bool lazy)
+{
+  cerr << "*** TestIt: p=" << p
+       << ", r=" << r
+       << ", d=" << d
+       << ", c=" << c
+       << ", k=" << k
+       << ", w=" << w
+       << ", L=" << L
+       << ", m=" << m
+       << ", T=" << T
+       << (lazy? ", lazyCRT" : "")
+       << endl;
+
+  FHEcontext context(m, p, r);
+  context.lazyCRT = lazy;
+  buildModChain(context, L, c);
+
+  context.zMStar.printout();
+  cerr << endl;
+
+  FHESecKey secretKey(context);
+  const FHEPubKey& publicKey = secretKey;
+  secretKey.GenSecKey(w); // A Hamming-weight-w secret key
+
+  ZZX G;
+  if (d == 0)
+    G = context.alMod.getFactorsOverZZ()[0];
+  else
+    G = makeIrredPoly(p, d);
+
+  cerr << "generating key-switching matrices... ";
+  addSome1DMatrices(secretKey); // compute key-switching matrices that we need
+  cerr << "done\n";
+
+  EncryptedArray ea(context, G);
+
+  vector<Ctxt> x(4, Ctxt(publicKey));
+  for (long i = 0; i < 4; i++) {
+    PlaintextArray pi(ea);
+    pi.random();
+    ea.encrypt(x[i], publicKey, pi);
+  }
+  PlaintextArray kp(ea);
+  kp.random();
+  ZZX kpoly;
+  ea.encode(kpoly, kp);
+  long g = context.zMStar.ZmStarGen(0);
+
+  // The direct computation
+  Ctxt s(x[0]), tmp(x[2]);
+  s.multiplyBy(x[1]);
+  tmp.multiplyBy(x[3]);
+  s += tmp;
+  Ctxt o1(s), o2(s);
+  o1.multiplyBy(s);
+  tmp = x[0];
+  tmp.smartAutomorph(g);
+  tmp.multByConstant(kpoly);
+  o1 += tmp;
+  o2.negate();
+
+  // The same with a graph
+  CtxtGraph graph(publicKey);
+  vector<long> in(4);
+  for (long i = 0; i < 4; i++) in[i] = graph.input(x[i]);
+  long ns = graph.add(graph.mul(in[0], in[1]), graph.mul(in[2], in[3]));
+  long nr = graph.multByConstant(graph.automorph(in[0], g), kpoly);
+  long no1 = graph.add(graph.mul(ns, ns), nr);
+  long no2 = graph.negate(ns);
+  graph.markOutput(no1);
+  graph.markOutput(no2);
+
+  bool ok = true;
+  long nReLin = graph.numReLinearizations();
+  if (nReLin != 2) {
+    cerr << "  " << nReLin << " re-linearizations, expected 2\n";
+    ok = false;
+  }
+
+  // Serial, then parallel: the second evaluation starts from the same
+  // inputs, so it must give the same results. With lazyCRT the threads
+  // share values that must not be converted while they read them
+  long nThreads[2] = {1, T};
+  for (long t = 0; t < 2; t++) {
+    graph.evaluate(nThreads[t]);
+    ok = compare(ea, secretKey, graph.getResult(no1), o1, "o1") && ok;
+    ok = compare(ea, secretKey, graph.getResult(no2), o2, "o2") && ok;
+    const Ctxt& res1 = graph.getResult(no1);
+    if (!res1.inCanonicalForm(res1.getKeyID())) {
+      cerr << "  o1 is not canonical\n";
+      ok = false;
+    }
+    cerr << "evaluate(" << nThreads[t] << (ok? "): Nice!!\n" : "): Grrr...\n");
+  }
+}
+
+
+void usage(char *prog)
+{
+  cerr << "Usage: "<<prog<<" [ optional parameters ]...\n";
+  cerr << "  optional parameters have the form 'attr1=val1 attr2=val2 ...'\n";
+  cerr << "  e.g, 'p=2 k=80 T=4'\n\n";
+  cerr << "  p is the plaintext base [default=2]" << endl;
+  cerr << "  r is the lifting [default=1]" << endl;
+  cerr << "  d is the degree of the field extension [default==1]\n";
+  cerr << "    (d == 0 => factors[0] defined the extension)\n";
+  cerr << "  c is number of columns in the key-switching matrices [default=2]\n";
+  cerr << "  k is the security parameter [default=80]\n";
+  cerr << "  L is the # of primes in the modulus chai [default=6]\n";
+  cerr << "  s is the minimum number of slots [default=4]\n";
+  cerr << "  m is a specific modulus\n";
+  cerr << "  T is the number of threads of the parallel evaluation [default=4]\n";
+  exit(0);
+}
+
+
+int main(int argc, char *argv[])
+{
+  argmap_t argmap;
+  argmap["p"] = "2";
+  argmap["r"] = "1";
+  argmap["d"] = "1";
+  argmap["c"] = "2";
+  argmap["k"] = "80";
+  argmap["L"] = "6";
+  argmap["s"] = "0";
+  argmap["m"] = "0";
+  argmap["T"] = "4";
+
+  // get parameters from the command line
+  if (!parseArgs(argc, argv, argmap)) usage(argv[0]);
+
+  long p = atoi(argmap["p"]);
+  long r = atoi(argmap["r"]);
+  long d = atoi(argmap["d"]);
+  long c = atoi(argmap["c"]);
+  long k = atoi(argmap["k"]);
+  long L = atoi(argmap["L"]);
+  long s = atoi(argmap["s"]);
+  long chosen_m = atoi(argmap["m"]);
+  long T = atoi(argmap["T"]);
+
+  long w = 64; // Hamming weight of secret key
+
+  long m = FindM(k, L, c, p, d, s, chosen_m, true);
+
+  setTimersOn();
+  TestIt(p, r, d, c, k, w, L, m, T, false);
+  TestIt(p, r, d, c, k, w, L, m, T, true);
+
+  cerr << endl;
+  printAllTimers();
+  cerr << endl;
+}
@@ -0,0 +1,333 @@
+/* Copyright (C) 2012,2013 IBM Corp.
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+/* Test_DoubleCRT.cpp - the DoubleCRT arithmetic and the layers under it:
+ * the row kernels, the copy-on-write rows, the thread pool, the FFTs, and
+ * the wide-prime and lazy-form contexts. Every check prints OK or NOT OK.
+ */
+#include "FHEContext.h"
+#include "DoubleCRT.h"
+#include "RowMap.h"
+#include "rowops.h"
+#include "ntt.h"
+#include "ThreadPool.h"
+#include "timing.h"
+
+#include <cassert>
+#include <stdexcept>
+
+static bool allOK = true;
+
+static void report(const char* name, bool ok)
+{
+  cout << "  " << name << (ok? " OK\n" : " NOT OK\n");
+  if (!ok) allOK = false;
+}
+
+// A random polynomial of degree < n with coefficients in [-B,B]
+static void randomPoly(ZZX& a, long n, long B)
+{
+  a.SetLength(n);
+  for (long i = 0; i < n; i++) a[i] = RandomBnd(2*B+1) - B;
+  a.normalize();
+}
+
+
+// The dispatched (SIMD) row kernels against the scalar ones
+void testRowOps(long q, long n)
+{
+  cout << "row kernels (" << rowOpsKernel() << "), q=" << q << "\n";
+  double qinv = 1/(double)q;
+
+  vector<long> x(n), y(n), z(n), idx(n);
+  for (long i = 0; i < n; i++) {
+    x[i] = RandomBnd(q);
+    y[i] = RandomBnd(q);
+    z[i] = RandomBnd(q);
+    idx[i] = RandomBnd(n);
+  }
+  long c = RandomBnd(q);
+
+  // apply every kernel in turn, with the kernels selected by scalar
+  vector<long> res[2];
+  for (long scalar = 0; scalar < 2; scalar++) {
+    setRowOpsScalar(scalar != 0);
+    vector<long> a = x, b(n);
+    rowAddMod(&a[0], &y[0], n, q);
+    rowMulMod(&a[0], &z[0], n, q, qinv);
+    rowSubMod(&a[0], &y[0], n, q);
+    rowMulAddMod(&a[0], &y[0], &z[0], n, q, qinv);
+    rowAddModConst(&a[0], c, n, q);
+    rowMulModConst(&a[0], c, n, q, qinv);
+    rowNegateMod(&b[0], &a[0], n, q);
+    rowGather(&a[0], &b[0], &idx[0], n);
+    res[scalar] = a;
+  }
+  setRowOpsScalar(false);
+
+  bool ok = (res[0] == res[1]);
+  report("SIMD vs scalar", ok);
+
+  // the same with NTL's single-precision arithmetic
+  ok = true;
+  vector<long> neg(n);
+  for (long i = 0; i < n; i++) {
+    long a = AddMod(x[i], y[i], q);
+    a = MulMod(a, z[i], q);
+    a = SubMod(a, y[i], q);
+    a = AddMod(a, MulMod(y[i], z[i], q), q);
+    a = AddMod(a, c, q);
+    neg[i] = NegateMod(MulMod(a, c, q), q);
+  }
+  for (long i = 0; i < n; i++)
+    if (res[1][i] != neg[idx[i]]) ok = false;
+  report("scalar vs NTL", ok);
+}
+
+
+// Copy-on-write rows: a copy shares the buffer until it is unshared
+// before a write
+void testRowMap()
+{
+  cout << "RowMap\n";
+  long n = 100;
+  RowMap a(n);
+  a.insert(IndexSet(0, 2));
+  for (long j = 0; j < 3; j++)
+    for (long i = 0; i < n; i++) a[j][i] = j*n + i;
+
+  RowMap b(a);
+  const RowMap& cb = b;
+  bool ok = a.shared() && b.shared() && cb[1] == ((const RowMap&) a)[1];
+  report("copy shares", ok);
+
+  b.unshare();
+  b[1][5] = -1;
+  ok = !a.shared() && !b.shared() && a[1][5] == n+5 && b[1][5] == -1
+       && b[2][7] == 2*n+7;
+  report("unshare before write", ok);
+
+  RowMap c(a);
+  c.unshare();
+  ok = !a.shared() && !c.shared() && c[0][3] == 3;
+  report("unshare", ok);
+}
+
+
+// parallelFor visits every index exactly once, for any number of threads
+void testThreadPool(long nThreads)
+{
+  cout << "ThreadPool(" << nThreads << ")\n";
+  ThreadPool pool(nThreads);
+  long n = 1000;
+  vector<long> count(n, 0);
+  pool.parallelFor(n, [&](long first, long last) {
+    for (long i = first; i < last; i++) count[i]++;
+  });
+  bool ok = true;
+  for (long i = 0; i < n; i++)
+    if (count[i] != 1) ok = false;
+  report("parallelFor", ok);
+
+  // a nested call runs serially rather than deadlocking
+  vector<long> inner(n, 0);
+  pool.parallelFor(2, [&](long first, long last) {
+    for (long t = first; t < last; t++)
+      pool.parallelFor(n/2, [&](long f, long l) {
+        for (long i = f; i < l; i++) inner[t*(n/2) + i]++;
+      });
+  });
+  ok = true;
+  for (long i = 0; i < n; i++)
+    if (inner[i] != 1) ok = false;
+  report("nested parallelFor", ok);
+
+  // an exception in any chunk reaches the caller, and the pool is usable
+  // again afterwards
+  for (long part = 0; part < nThreads; part++) {
+    long thrower = (n*part)/nThreads; // the first index of that chunk
+    ok = false;
+    try {
+      pool.parallelFor(n, [&](long first, long) {
+        if (first == thrower) throw runtime_error("chunk");
+      });
+    }
+    catch (const runtime_error&) { ok = true; }
+    if (!ok) break;
+  }
+  count.assign(n, 0);
+  pool.parallelFor(n, [&](long first, long last) {
+    for (long i = first; i < last; i++) count[i]++;
+  });
+  for (long i = 0; i < n; i++)
+    if (count[i] != 1) ok = false;
+  report("exception in parallelFor", ok);
+}
+
+
+// The negacyclic NTT against the product modulo X^N+1 computed by NTL
+void testNegacyclicNTT(long logN)
+{
+  long N = 1L << logN;
+  unsigned long q = getNTTPrime(0);
+  cout << "NegacyclicNTT, N=" << N << "\n";
+  NegacyclicNTT ntt(q, primitiveRootWide(q, 2*N), logN);
+
+  vector<unsigned long> a(N), b(N), a0;
+  ZZX pa, pb;
+  pa.SetLength(N);
+  pb.SetLength(N);
+  ZZ Q = to_ZZ((long) q);
+  for (long i = 0; i < N; i++) {
+    a[i] = to_long(RandomBnd(Q)); // in [0,q)
+    b[i] = RandomBnd(1L << 30);
+    pa[i] = to_ZZ(a[i]);
+    pb[i] = to_ZZ(b[i]);
+  }
+  pa.normalize();
+  pb.normalize();
+  a0 = a;
+
+  ntt.forward(&a[0]);
+  vector<unsigned long> a1 = a;
+  ntt.inverse(&a1[0]);
+  report("round trip", a1 == a0);
+
+  ntt.forward(&b[0]);
+  for (long i = 0; i < N; i++) a[i] = mulModWide(a[i], b[i], q);
+  ntt.inverse(&a[0]);
+
+  ZZX XN1; // X^N+1
+  SetCoeff(XN1, N);
+  SetCoeff(XN1, 0);
+  ZZX prod;
+  MulMod(prod, pa, pb, XN1);
+  bool ok = true;
+  for (long i = 0; i < N; i++) {
+    ZZ c = coeff(prod, i) % Q;
+    if (c != to_ZZ(a[i])) ok = false;
+  }
+  report("negacyclic product", ok);
+}
+
+
+// The FFTs of every prime, and the DoubleCRT arithmetic against NTL's
+// arithmetic modulo Phi_m(X), serially, with nThreads threads, and with
+// the scalar row kernels
+void testDoubleCRT(long m, long p, bool widePrimes, bool lazyCRT,
+                   long nThreads)
+{
+  cout << "DoubleCRT: m=" << m << ", p=" << p
+       << (widePrimes? ", widePrimes" : "") << (lazyCRT? ", lazyCRT" : "")
+       << ", threads=" << nThreads << "\n";
+
+  FHEcontext context(m, p, 1);
+  context.widePrimes = widePrimes;
+  context.lazyCRT = lazyCRT;
+  buildModChain(context, 5, 2);
+
+  long phim = context.zMStar.getPhiM();
+  const ZZX& PhimX = context.zMStar.getPhimX();
+
+  // FFT and iFFT with every prime
+  ZZX a, b, c;
+  randomPoly(a, phim, 1000);
+  randomPoly(b, phim, 1000);
+  randomPoly(c, phim, 1000);
+  bool ok = true;
+  vector<long> y(phim), x(phim);
+  for (long i = 0; i < context.numPrimes(); i++) {
+    const Cmodulus& mod = context.ithModulus(i);
+    long q = mod.getQ();
+    mod.FFT(&y[0], a);
+    mod.iFFT(&x[0], &y[0]);
+    for (long j = 0; j < phim; j++) {
+      long aj = rem(coeff(a, j), q);
+      if (x[j] != aj) ok = false;
+    }
+  }
+  report("FFT/iFFT round trip", ok);
+
+  // the same expression with NTL
+  ZZX ref, tmp;
+  MulMod(ref, a, b, PhimX);
+  MulMod(tmp, c, c, PhimX);
+  ref += tmp;
+  ref -= a;
+  ref *= 3;
+
+  ZZX res[2];
+  bool cow = true;
+  for (long scalar = 0; scalar < 2; scalar++) {
+    context.setThreadCount(scalar? 1 : nThreads);
+    setRowOpsScalar(scalar != 0);
+
+    DoubleCRT A(a, context), B(b, context), C(c, context);
+    DoubleCRT A0(A); // shares the rows of A
+    DoubleCRT D(A);
+    D *= B;
+    DoubleCRT E(C);
+    E *= C;
+    D += E;
+    D -= A;
+    D *= 3L;
+
+    // the copies were not modified by the operations on D and E
+    ZZX a1, c1;
+    A0.toPoly(a1);
+    C.toPoly(c1);
+    if (a1 != a || c1 != c) cow = false;
+    D.toPoly(res[scalar]);
+  }
+  setRowOpsScalar(false);
+  context.setThreadCount(1);
+
+  report("copy-on-write", cow);
+  report("product mod Phi_m", res[0] == ref);
+  report("scalar, serial == dispatched, threaded", res[0] == res[1]);
+}
+
+
+void usage(char *prog)
+{
+  cerr << "Usage: "<<prog<<" [ optional parameters ]...\n";
+  cerr << "  optional parameters have the form 'attr1=val1 attr2=val2 ...'\n";
+  cerr << "  T is the number of threads [default=4]\n";
+  exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+  argmap_t argmap;
+  argmap["T"] = "4";
+  if (!parseArgs(argc, argv, argmap)) usage(argv[0]);
+  long T = atoi(argmap["T"]);
+
+  testRowOps(GenPrime_long(NTL_SP_NBITS), 1001);
+  testRowMap();
+  testThreadPool(1);
+  testThreadPool(T);
+  testNegacyclicNTT(10);
+
+  // a power of two (negacyclic NTT), a prime and a composite m
+  long ms[3] = {4096, 4099, 4369};
+  long ps[3] = {3, 2, 2};
+  for (long i = 0; i < 3; i++)
+    for (long flags = 0; flags < 3; flags++)
+      testDoubleCRT(ms[i], ps[i], flags == 1, flags == 2, T);
+
+  cout << (allOK? "all OK\n" : "some checks NOT OK\n");
+  return allOK? 0 : 1;
+}
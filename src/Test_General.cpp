@@ -217,6 +217,84 @@ void  TestIt(long R, long p, long r, long d, long c, long k, long w,
   }
   if (!fail) cerr << "incrementalProduct works\n";
 
+  // Hoisted automorphisms and rotations against one at a time, in every
+  // dimension. addSome1DMatrices only adds matrices for some of the amounts,
+  // so some of these go through the smartAutomorph fallback
+  const PAlgebra& al = context.zMStar;
+  p1.random();
+  ea.encrypt(c1, publicKey, p1);
+  PlaintextArray q0(ea), q1(ea), q2(ea), q3(ea);
+  fail = false;
+  long noMatrix = 0;
+  for (long i = 0; i < ea.dimension(); i++) {
+    long ord = ea.sizeOfDimension(i);
+    vector<long> amts, vals;
+    for (long j = -1; j < ord; j++) {
+      amts.push_back(j);
+      vals.push_back(PowerMod(al.ZmStarGen(i), j, al.getM()));
+      if (!publicKey.haveKeySWmatrix(1, vals.back())) noMatrix++;
+    }
+
+    vector<Ctxt> hoisted, rotated;
+    c1.hoistedAutomorph(hoisted, vals);
+    ea.rotate1D(rotated, c1, i, amts);
+    for (size_t j = 0; j < amts.size(); j++) {
+      Ctxt tmp1(c1), tmp2(c1);
+      tmp1.smartAutomorph(vals[j]);
+      ea.rotate1D(tmp2, i, amts[j]);
+
+      ea.decrypt(hoisted[j], secretKey, q0);
+      ea.decrypt(tmp1, secretKey, q1);
+      ea.decrypt(rotated[j], secretKey, q2);
+      ea.decrypt(tmp2, secretKey, q3);
+      if (!q0.equals(q1) || !q2.equals(q3)) {
+        fail = true;
+        cerr << "hoisted rotation oops: dim " << i
+             << ", amount " << amts[j] << endl;
+      }
+    }
+  }
+  if (!fail) cerr << "hoisted rotations work ("
+                  << noMatrix << " amounts with no direct matrix)\n";
+
+  // Inner product and multiply-accumulate, each with a single
+  // re-linearization at the end
+  const long nTerms = 3;
+  vector<Ctxt> va(nTerms, c1), vb(nTerms, c1);
+  PlaintextArray sum(ea), term(ea);
+  sum.encode(0);
+  for (long i = 0; i < nTerms; i++) {
+    q0.random();
+    q1.random();
+    ea.encrypt(va[i], publicKey, q0);
+    ea.encrypt(vb[i], publicKey, q1);
+    term = q0;
+    term.mul(q1);
+    sum.add(term);
+  }
+
+  Ctxt ip(publicKey);
+  innerProduct(ip, va, vb);
+  ea.decrypt(ip, secretKey, q0);
+  if (!q0.equals(sum)) cerr << "innerProduct oops\n";
+  else if (!ip.inCanonicalForm()) cerr << "innerProduct not canonical\n";
+  else cerr << "innerProduct works\n";
+
+  Ctxt acc(publicKey, va[0].getPtxtSpace()); // an encryption of zero
+  for (long i = 0; i < nTerms; i++) acc.multiplyAdd(va[i], vb[i]);
+  acc.reLinearize();
+  ea.decrypt(acc, secretKey, q1);
+  if (!q1.equals(sum)) cerr << "multiplyAdd oops\n";
+  else if (!acc.inCanonicalForm()) cerr << "multiplyAdd not canonical\n";
+  else cerr << "multiplyAdd works\n";
+
+  // the result may alias one of the arguments
+  vector<Ctxt> va1(va);
+  innerProduct(va1[0], va1, vb);
+  ea.decrypt(va1[0], secretKey, q0);
+  if (!q0.equals(sum)) cerr << "innerProduct in place oops\n";
+  else cerr << "innerProduct in place works\n";
+
   cerr << "\ntime for circuit: " << t << "\n";
 }
 
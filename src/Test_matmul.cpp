@@ -165,6 +165,135 @@ buildRandomMatrix(const EncryptedArray& ea)
 }
 
 
+// A matrix with only a few non-zero generalized diagonals: mat(i,j) is
+// non-zero only if the hypercube offset from i to j (taken dimension by
+// dimension) is one of offsets[0..]. It overrides getDiag, so mat_mul skips
+// the zero diagonals without looking at their elements.
+template<class type> 
+class SparseDiagMatrix : public  PlaintextMatrixInterface<type> {
+public:
+  PA_INJECT(type) 
+
+private:
+  const EncryptedArray& ea;
+
+  vector< vector<long> > offsets;
+  vector< vector< RX > > data; // data[t][j] is the entry of column j for offsets[t]
+
+  // The hypercube offset from i to j
+  void offsetOf(vector<long>& offs, long i, long j) const {
+    offs.resize(ea.dimension());
+    for (long d = 0; d < ea.dimension(); d++) {
+      long sz = ea.sizeOfDimension(d);
+      offs[d] = ((ea.coordinate(d, j) - ea.coordinate(d, i)) % sz + sz) % sz;
+    }
+  }
+
+  long findOffset(long i, long j) const {
+    vector<long> offs;
+    offsetOf(offs, i, j);
+    for (long t = 0; t < (long) offsets.size(); t++)
+      if (offsets[t] == offs) return t;
+    return -1;
+  }
+
+public:
+  ~SparseDiagMatrix() { cerr << "destructor: sparse diagonal matrix\n"; }
+
+  // The offsets are zero, minus one in every dimension (the largest offset,
+  // so it needs a giant step), and a random one
+  SparseDiagMatrix(const EncryptedArray& _ea) : ea(_ea) { 
+    long n = ea.size();
+    long d = ea.getDegree();
+    long ndims = ea.dimension();
+
+    offsets.resize(3, vector<long>(ndims, 0));
+    for (long dim = 0; dim < ndims; dim++) {
+      offsets[1][dim] = ea.sizeOfDimension(dim) - 1;
+      offsets[2][dim] = RandomBnd(ea.sizeOfDimension(dim));
+    }
+
+    RBak bak; bak.save(); ea.getContext().alMod.restoreContext();
+
+    data.resize(offsets.size());
+    for (long t = 0; t < (long) offsets.size(); t++) {
+      data[t].resize(n);
+      for (long j = 0; j < n; j++)
+        random(data[t][j], d);
+    }
+  }
+
+  virtual const EncryptedArray& getEA() const {
+    return ea;
+  }
+
+  virtual void get(RX& out, long i, long j) const {
+    assert(i >= 0 && i < ea.size());
+    assert(j >= 0 && j < ea.size());
+    long t = findOffset(i, j);
+    if (t < 0)
+      out = 0;
+    else
+      out = data[t][j];
+  }
+
+  // All the elements of a generalized diagonal have the same offset
+  virtual bool getDiag(vector<RX>& diag, const vector<long>& idx) const {
+    long t = findOffset(idx[0], 0);
+    if (t < 0) return false;
+
+    diag.resize(idx.size());
+    for (long j = 0; j < (long) idx.size(); j++) {
+      assert(findOffset(idx[j], j) == t);
+      diag[j] = data[t][j];
+    }
+    return true;
+  }
+};
+
+
+PlaintextMatrixBaseInterface *
+buildSparseDiagMatrix(const EncryptedArray& ea)
+{
+  switch (ea.getContext().alMod.getTag()) {
+    case PA_GF2_tag: {
+      return new SparseDiagMatrix<PA_GF2>(ea);
+    }
+
+    case PA_zz_p_tag: {
+      return new SparseDiagMatrix<PA_zz_p>(ea);
+    }
+
+    default: return 0;
+  }
+}
+
+
+// Multiply an encrypted random vector by mat, and compare the result with
+// the product of the plaintext vector
+bool TestMatMul(const EncryptedArray& ea, const FHESecKey& secretKey,
+                PlaintextMatrixBaseInterface* mat, const char* name)
+{
+  const FHEPubKey& publicKey = secretKey;
+  PlaintextArray v(ea);
+  v.random();
+
+  Ctxt ctxt(publicKey);
+  ea.encrypt(ctxt, publicKey, v);
+
+  v.mat_mul(*mat);         // multiply the plaintext vector
+  ea.mat_mul(ctxt, *mat);  // multiply the ciphertext vector
+
+  PlaintextArray v1(ea);
+  ea.decrypt(ctxt, secretKey, v1); // decrypt the ciphertext vector
+
+  bool ok = v.equals(v1);
+  cout << "  " << name << (ok? ": Nice!!\n" : ": Grrr...\n");
+  delete mat;
+  return ok;
+}
+
+
 
 void  TestIt(long R, long p, long r, long d, long c, long k, long w, 
                long L, long m)
@@ -210,38 +339,59 @@ void  TestIt(long R, long p, long r, long d, long c, long k, long w,
   EncryptedArray ea(context, G);
   cerr << "done\n";
 
-  // choose a random plaintext square matrix
+  cerr << "dimensions:";
+  for (long i = 0; i < ea.dimension(); i++)
+    cerr << " " << ea.sizeOfDimension(i)
+         << (ea.nativeDimension(i)? "" : "(bad)");
+  cerr << "\n";
+
+  // the total sums, with totalSums
   PlaintextMatrixBaseInterface *ptr = buildTotalSumMatrix(ea);
 
   // choose a random plaintext vector
   PlaintextArray v(ea);
-
-/* v.encode(1);  
-   v.print(cout); cout << "\n";
-   v.alt_mul(*ptr);
-*/
   v.random();
-  // v.print(cout); cout << "\n";
 
   // encrypt the random vector
   Ctxt ctxt(publicKey);
   ea.encrypt(ctxt, publicKey, v);
 
   v.mat_mul(*ptr);         // multiply the plaintext vector
-  // ea.mat_mul(ctxt, *ptr);  // multiply the ciphertext vector
   totalSums(ea, ctxt);  // multiply the ciphertext vector
+  delete ptr;
 
   PlaintextArray v1(ea);
-  //  v1 = v;
   ea.decrypt(ctxt, secretKey, v1); // decrypt the ciphertext vector
 
   if (v.equals(v1))        // check that we've got the right answer
-    cout << "Nice!!\n";
+    cout << "  totalSums: Nice!!\n";
   else
-    cout << "Grrr...\n";
+    cout << "  totalSums: Grrr...\n";
+
+  // the same and other matrices, with mat_mul
+  TestMatMul(ea, secretKey, buildTotalSumMatrix(ea), "total sums");
+  TestMatMul(ea, secretKey, buildRunningSumMatrix(ea), "running sums");
+  TestMatMul(ea, secretKey, buildRandomMatrix(ea), "random matrix");
+  TestMatMul(ea, secretKey, buildSparseDiagMatrix(ea), "sparse diagonals");
+}
+
 
-  // v.print(cout); cout << "\n";
-  // v1.print(cout); cout << "\n";
+// The first m >= from (with at least 4 slots, and with d | ord(p)) for
+// which some dimension of Z_m^*/(p) is not native, so that mat_mul has to
+// rotate in a bad dimension
+long FindBadDimensionM(long p, long d, long from)
+{
+  for (long m = from; m < 100*from; m++) {
+    if (GCD(m, p) != 1) continue;
+    long ordP = multOrd(p, m);
+    if (d > 1 && ordP % d != 0) continue;
+
+    PAlgebra al(m, p);
+    if (al.getNSlots() < 4) continue;
+    for (long i = 0; i < (long) al.numOfGens(); i++)
+      if (!al.SameOrd(i)) return m;
+  }
+  return 0;
 }
 
 
@@ -305,6 +455,15 @@ int main(int argc, char *argv[])
   setTimersOn();
   TestIt(R, p, r, d, c, k, w, L, m);
 
+  // unless m was given, again with a bad dimension
+  if (chosen_m == 0) {
+    long bad_m = FindBadDimensionM(p, d, 100);
+    if (bad_m != 0)
+      TestIt(R, p, r, d, c, k, w, L, bad_m);
+    else
+      cerr << "no m with a bad dimension found\n";
+  }
+
   cerr << endl;
   printAllTimers();
   cerr << endl;
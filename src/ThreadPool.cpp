@@ -0,0 +1,136 @@
+/* Copyright (C) 2012,2013 IBM Corp.
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+/* ThreadPool.cpp - a fixed pool of worker threads for parallel loops
+ *
+ * Every job is split into jobParts contiguous chunks, chunk 0 is processed
+ * by the caller and chunk i (i>0) by worker i. Workers wait for a new
+ * generation number, process their chunk (if any), and report back.
+ */
+#include "ThreadPool.h"
+
+// the chunk [first,last) of the range [0,n) split into nParts parts
+static inline void chunkOf(long& first, long& last, long part,
+                           long n, long nParts)
+{
+  first = (n*part)/nParts;
+  last = (n*(part+1))/nParts;
+}
+
+ThreadPool::ThreadPool(long nThreads)
+{
+  job = NULL;
+  jobSize = jobParts = pending = 0;
+  generation = 0;
+  stopping = false;
+  busy = false;
+
+  for (long i = 1; i < nThreads; i++)
+    workers.push_back(thread(&ThreadPool::workerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    lock_guard<mutex> lock(mtx);
+    stopping = true;
+  }
+  workReady.notify_all();
+  for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+}
+
+void ThreadPool::workerLoop(long id)
+{
+  unsigned long seen = 0;
+  for (;;) {
+    const function<void(long,long)>* f;
+    long n, nParts;
+    {
+      unique_lock<mutex> lock(mtx);
+      while (!stopping && generation == seen) workReady.wait(lock);
+      if (stopping) return;
+      seen = generation;
+      f = job;
+      n = jobSize;
+      nParts = jobParts;
+    }
+    if (id >= nParts) continue; // no chunk for this worker
+
+    long first, last;
+    chunkOf(first, last, id, n, nParts);
+    exception_ptr err;
+    try {
+      if (first < last) (*f)(first, last);
+    }
+    catch (...) {
+      err = current_exception(); // passed on to the caller of parallelFor
+    }
+
+    {
+      lock_guard<mutex> lock(mtx);
+      if (err && !jobError) jobError = err;
+      if (--pending == 0) workDone.notify_one();
+    }
+  }
+}
+
+void ThreadPool::parallelFor(long n, const function<void(long,long)>& f)
+{
+  if (n <= 0) return;
+
+  long nParts = min(size(), n);
+  bool expected = false;
+  if (nParts <= 1 || !busy.compare_exchange_strong(expected, true)) {
+    f(0, n); // serial mode, or the pool is already in use
+    return;
+  }
+
+  {
+    lock_guard<mutex> lock(mtx);
+    job = &f;
+    jobSize = n;
+    jobParts = nParts;
+    pending = nParts-1;
+    generation++;
+  }
+  workReady.notify_all();
+
+  // Wait for the workers and release the pool on the way out, also when
+  // the caller's chunk throws: the workers still use f until then
+  struct JobGuard {
+    ThreadPool& pool;
+    exception_ptr& err;
+    JobGuard(ThreadPool& _pool, exception_ptr& _err): pool(_pool), err(_err) {}
+    ~JobGuard() {
+      {
+        unique_lock<mutex> lock(pool.mtx);
+        while (pool.pending > 0) pool.workDone.wait(lock);
+        pool.job = NULL;
+        err = pool.jobError;
+        pool.jobError = nullptr;
+      }
+      pool.busy = false;
+    }
+  };
+
+  exception_ptr err;
+  {
+    JobGuard guard(*this, err);
+    long first, last;
+    chunkOf(first, last, 0, n, nParts);
+    f(first, last);
+  }
+  if (err) rethrow_exception(err); // a worker threw
+}
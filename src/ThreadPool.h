@@ -0,0 +1,88 @@
+/* Copyright (C) 2012,2013 IBM Corp.
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+#ifndef _ThreadPool
+#define _ThreadPool
+/**
+ * @file ThreadPool.h
+ * @brief A fixed pool of worker threads for data-parallel loops
+ **/
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+
+using namespace std;
+
+/**
+ * @class ThreadPool
+ * @brief A fixed set of worker threads that execute parallel loops.
+ *
+ * The only operation is parallelFor(n, f), which splits the range [0,n)
+ * into (at most) one contiguous chunk per thread, calls f(first,last) on
+ * each chunk, and returns when all of them are done. The calling thread
+ * processes the first chunk itself, so a pool with nThreads threads runs
+ * nThreads-1 workers.
+ *
+ * A pool with a single thread is the serial mode, f(0,n) is then called
+ * directly. The same happens when parallelFor is called while the pool is
+ * already busy (e.g., a nested call from within f, or a call from another
+ * thread), so the pool never deadlocks. For the loops in this library the
+ * result does not depend on the number of threads.
+ *
+ * If f throws, parallelFor still waits for all the chunks to finish before
+ * it rethrows (the first exception, if several chunks threw), so the pool
+ * is left idle and f is never called after parallelFor returns.
+ **/
+class ThreadPool {
+  vector<thread> workers;
+  mutex mtx;
+  condition_variable workReady, workDone;
+
+  // the current job, protected by mtx
+  const function<void(long,long)>* job;
+  long jobSize;      // the range is [0,jobSize)
+  long jobParts;     // it is split into that many chunks
+  long pending;      // chunks not done yet, excluding the caller's
+  unsigned long generation; // incremented for every new job
+  bool stopping;
+  exception_ptr jobError;   // the first exception thrown by a worker
+
+  atomic<bool> busy; // is a job running?
+
+  void workerLoop(long id);
+
+  ThreadPool(const ThreadPool&);            // not copyable
+  ThreadPool& operator=(const ThreadPool&);
+
+public:
+  //! @brief A pool with nThreads threads (including the caller),
+  //! nThreads<=1 is the serial mode
+  explicit ThreadPool(long nThreads=1);
+  ~ThreadPool();
+
+  //! @brief The number of threads, including the calling thread
+  long size() const { return workers.size()+1; }
+
+  //! @brief Call f(first,last) on a partition of [0,n) into contiguous
+  //! chunks, in parallel, and wait for all of them to finish
+  void parallelFor(long n, const function<void(long,long)>& f);
+};
+
+#endif // _ThreadPool
@@ -24,8 +24,10 @@
  *                     ZZ_pX& powers, FFTRep& Rb);
  *   void BluesteinFFT(zz_pX& x, const zz_pX& a, long n, const zz_p& root,
  *                     zz_pX& powers, fftRep& Rb);
+ *   BluesteinPlan::init(n, q, root, scale), BluesteinPlan::apply(x)
  *
  */
+#include <cassert>
 #include <NTL/ZZX.h>
 #include <NTL/lzz_pX.h>
 #include <NTL/ZZ_pX.h>
@@ -287,6 +289,68 @@ void tDFT(zpX& x, const zpX& a, long n, const zp& root)
   x.normalize();
 }
 
+void BluesteinPlan::init(long _n, long _q, long root, long scale)
+{
+  n = _n;
+  q = _q;
+  assert(n >= 1 && scale > 0 && scale < _q);
+
+  // powers[i] = root^{i^2}, b[n-1+i] = b[n-1-i] = root^{-i^2}
+  unsigned long rInv = invModWide(root, q);
+  powers.resize(n); powersPre.resize(n);
+  outPowers.resize(n); outPowersPre.resize(n);
+  vector<long> b(2*n-1);
+  for (long i = 0; i < n; i++) {
+    unsigned long iSqr = mulModWide(i, i, 2*n); // i^2 mod 2n
+    powers[i] = powModWide(root, iSqr, q);
+    powersPre[i] = shoupPrecon(powers[i], q);
+    outPowers[i] = mulModWide(powers[i], scale, q);
+    outPowersPre[i] = shoupPrecon(outPowers[i], q);
+    b[n-1+i] = b[n-1-i] = powModWide(rInv, iSqr, q);
+  }
+
+  long k = NextPowerOfTwo(2*n-1);
+  mulB.init(q, &b[0], 2*n-1, n, k);
+}
+
+void BluesteinPlan::apply(long* x) const
+{
+  static thread_local vector<long> a;
+  if ((long) a.size() < n) a.resize(n);
+
+  for (long i = 0; i < n; i++)
+    a[i] = shoupMulMod(x[i], powers[i], powersPre[i], q);
+
+  // The length-N cyclic product has no wrap-around in the coefficients
+  // n-1..2n-2 as long as N >= 2n-1, see above
+  mulB.mul(x, &a[0], n, n-1, n);
+
+  for (long i = 0; i < n; i++)
+    x[i] = shoupMulMod(x[i], outPowers[i], outPowersPre[i], q);
+}
+
+void BluesteinPlan::apply(long* const* x, long nPolys) const
+{
+  if (nPolys == 1) { apply(x[0]); return; }
+  static thread_local vector<long> a;
+  static thread_local vector<const long*> ptrs;
+  if ((long) a.size() < nPolys*n) a.resize(nPolys*n);
+  ptrs.resize(nPolys);
+
+  for (long b = 0; b < nPolys; b++) {
+    long* ab = &a[b*n];
+    for (long i = 0; i < n; i++)
+      ab[i] = shoupMulMod(x[b][i], powers[i], powersPre[i], q);
+    ptrs[b] = ab;
+  }
+
+  mulB.mul(x, &ptrs[0], n, n-1, n, nPolys);
+
+  for (long b = 0; b < nPolys; b++)
+    for (long i = 0; i < n; i++)
+      x[b][i] = shoupMulMod(x[b][i], outPowers[i], outPowersPre[i], q);
+}
+
 // Instantiations of the templates above for ZZ_p/ZZ_pX/FFTRep
 // and for zz_p/zz_pX/fftrep
 
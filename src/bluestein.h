@@ -57,6 +57,7 @@
 #include <NTL/ZZX.h>
 #include <NTL/ZZ_pX.h>
 #include <NTL/lzz_pX.h>
+#include "ntt.h"
 
 NTL_CLIENT
 
@@ -73,4 +74,37 @@ void BluesteinFFT(zz_pX& x, long n,
                   const zz_p& root, zz_pX& powers, Vec<mulmod_precon_t>& powers_aux, 
                   fftRep& Rb, fftrep_aux& Rb_aux, fftRep& Ra);
 
+/**
+ * @class BluesteinPlan
+ * @brief A length-n FFT modulo a single-precision q, with explicit tables
+ *
+ * This is the same transform as BluesteinFFT above, but init() computes
+ * all the tables in advance (the powers of root and the transform of b,
+ * see ntt.h), and the transform itself does not use NTL's current modulus.
+ * Hence apply() is re-entrant, different threads can call it concurrently.
+ * Also the output is multiplied by a constant scale factor that is folded
+ * into the tables, e.g., scale = n^{-1} mod q for the inverse transform.
+ **/
+class BluesteinPlan {
+  long n;
+  unsigned long q;
+  vector<unsigned long> powers, powersPre;       // root^{i^2}
+  vector<unsigned long> outPowers, outPowersPre; // scale * root^{i^2}
+  FixedPolyMul mulB; // multiplication by b (see above)
+
+public:
+  BluesteinPlan(): n(0), q(0) {}
+
+  //! @brief root is a 2n-th root of unity mod q, and 0 < scale < q
+  void init(long n, long q, long root, long scale=1);
+
+  long size() const { return n; }
+
+  //! @brief x[0..n-1] = scale * DFT(x[0..n-1], root^2), entries in [0,q)
+  void apply(long* x) const;
+
+  //! @brief The same for the nPolys arrays x[0..nPolys-1] together
+  void apply(long* const* x, long nPolys) const;
+};
+
 #endif
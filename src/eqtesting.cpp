@@ -97,11 +97,11 @@ void incrementalZeroTest(Ctxt* res[], const EncryptedArray& ea,
     }
   }
 
-  vector<Ctxt> Conj(d, ctxt);
-  // initialize Cong[j] to ctxt^{2^j}
-  for (long j = 0; j < d; j++) {
-    Conj[j].smartAutomorph(1L << j);
-  }
+  vector<Ctxt> Conj;
+  // initialize Cong[j] to ctxt^{2^j}, all from one digit decomposition
+  vector<long> frobVals(d);
+  for (long j = 0; j < d; j++) frobVals[j] = 1L << j;
+  ctxt.hoistedAutomorph(Conj, frobVals);
 
   for (long i = 0; i < n; i++) {
     res[i]->clear();
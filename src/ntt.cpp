@@ -0,0 +1,626 @@
+/* Copyright (C) 2012,2013 IBM Corp.
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+/* ntt.cpp - polynomial arithmetic modulo a single-precision q, with
+ * explicit tables
+ *
+ * The NTT primes are in (2^61,2^62), so the butterflies can keep their
+ * inputs in [0,2p) without overflow, and all the multiplications are by
+ * precomputed constants (twiddles, the transform of the fixed operand, the
+ * CRT constants) using Shoup's method. The temporary space is thread_local,
+ * it is allocated on first use and then reused.
+ */
+#include <cassert>
+#include <map>
+#include <mutex>
+#include <algorithm>
+
+#include "ntt.h"
+
+unsigned long powModWide(unsigned long a, unsigned long e, unsigned long p)
+{
+  unsigned long res = 1 % p;
+  a %= p;
+  while (e > 0) {
+    if (e & 1) res = mulModWide(res, a, p);
+    a = mulModWide(a, a, p);
+    e >>= 1;
+  }
+  return res;
+}
+
+// Miller-Rabin with the first 12 primes as bases, which is deterministic
+// for all n < 3.3*10^24
+bool isPrimeWide(unsigned long n)
+{
+  static const unsigned long bases[] = {2,3,5,7,11,13,17,19,23,29,31,37};
+  const long nBases = sizeof(bases)/sizeof(bases[0]);
+
+  if (n < 2) return false;
+  for (long i = 0; i < nBases; i++)
+    if (n % bases[i] == 0) return (n == bases[i]);
+
+  unsigned long d = n-1;
+  long s = 0;
+  while ((d & 1) == 0) { d >>= 1; s++; }
+
+  for (long i = 0; i < nBases; i++) {
+    unsigned long x = powModWide(bases[i], d, n);
+    if (x == 1 || x == n-1) continue;
+    long r;
+    for (r = 1; r < s; r++) {
+      x = mulModWide(x, x, n);
+      if (x == n-1) break;
+    }
+    if (r == s) return false;
+  }
+  return true;
+}
+
+unsigned long primitiveRootWide(unsigned long q, long n)
+{
+  assert(n > 0 && (q-1) % n == 0);
+
+  vector<long> primes; // the distinct prime factors of n
+  long t = n;
+  for (long p = 2; p*p <= t; p++)
+    if (t % p == 0) {
+      primes.push_back(p);
+      while (t % p == 0) t /= p;
+    }
+  if (t > 1) primes.push_back(t);
+
+  // g^{(q-1)/n} is a primitive n'th root unless it is a root of a smaller
+  // order n/p, this happens with probability less than 1/2 for each g
+  for (unsigned long g = 2; g < q; g++) {
+    unsigned long r = powModWide(g, (q-1)/n, q);
+    bool primitive = true;
+    for (size_t i = 0; i < primes.size() && primitive; i++)
+      primitive = (powModWide(r, n/primes[i], q) != 1);
+    if (primitive) return r;
+  }
+  return 0; // not reached for a prime q
+}
+
+// The NTT primes, each one with a primitive 2^32'nd root of unity
+struct NTTPrime {
+  unsigned long p, root;
+};
+
+static vector<NTTPrime> findNTTPrimes()
+{
+  vector<NTTPrime> primes;
+  for (unsigned long c = (1UL << 30) - 1;
+       (long) primes.size() < NTT_MAX_PRIMES; c--) {
+    assert(c >= (1UL << 29)); // all the primes are above 2^61
+    unsigned long p = (c << 32) + 1;
+    if (!isPrimeWide(p)) continue;
+
+    // x^{(p-1)/2^32} has order exactly 2^32 iff its 2^31'st power is -1
+    NTTPrime np;
+    np.p = p;
+    for (unsigned long x = 2; ; x++) {
+      np.root = powModWide(x, c, p);
+      if (powModWide(np.root, 1UL << 31, p) == p-1) break;
+    }
+    primes.push_back(np);
+  }
+  return primes;
+}
+
+static const vector<NTTPrime>& nttPrimes()
+{
+  static const vector<NTTPrime> primes = findNTTPrimes();
+  return primes;
+}
+
+unsigned long getNTTPrime(long i)
+{
+  assert(i >= 0 && i < NTT_MAX_PRIMES);
+  return nttPrimes()[i].p;
+}
+
+shared_ptr<const NTTTables> getNTTTables(long i, long logN)
+{
+  assert(i >= 0 && i < NTT_MAX_PRIMES);
+  assert(logN >= 0 && logN <= 32);
+
+  static mutex mtx;
+  static map< pair<long,long>, shared_ptr<const NTTTables> > cache;
+
+  lock_guard<mutex> lock(mtx);
+  shared_ptr<const NTTTables>& tab = cache[make_pair(i, logN)];
+  if (!tab) {
+    const NTTPrime& np = nttPrimes()[i];
+    unsigned long root = powModWide(np.root, 1UL << (32-logN), np.p);
+    tab = make_shared<NTTTables>(np.p, root, logN);
+  }
+  return tab;
+}
+
+NTTTables::NTTTables(unsigned long _p, unsigned long root, long _logN)
+{
+  p = _p;
+  logN = _logN;
+  N = 1L << logN;
+  w.resize(N); wPre.resize(N);
+  iw.resize(N); iwPre.resize(N);
+
+  unsigned long rootInv = invModWide(root, p);
+  for (long len = 1; len < N; len <<= 1) {
+    unsigned long step = powModWide(root, N/(2*len), p);
+    unsigned long iStep = powModWide(rootInv, N/(2*len), p);
+    unsigned long x = 1, y = 1;
+    for (long j = 0; j < len; j++) {
+      w[len+j] = x;   wPre[len+j] = shoupPrecon(x, p);
+      iw[len+j] = y;  iwPre[len+j] = shoupPrecon(y, p);
+      x = mulModWide(x, step, p);
+      y = mulModWide(y, iStep, p);
+    }
+  }
+}
+
+// Gentleman-Sande butterflies with the values kept in [0,2p)
+void NTTTables::forward(unsigned long* a) const
+{
+  unsigned long p2 = 2*p;
+  for (long len = N/2; len >= 1; len >>= 1) {
+    const unsigned long* ww = &w[len];
+    const unsigned long* wp = &wPre[len];
+    for (long s = 0; s < N; s += 2*len) {
+      unsigned long* x = a + s;
+      unsigned long* y = a + s + len;
+      for (long j = 0; j < len; j++) {
+        unsigned long u = x[j], v = y[j];
+        unsigned long sum = u + v;
+        x[j] = (sum >= p2)? sum-p2 : sum;
+        y[j] = shoupMulModLazy(u + p2 - v, ww[j], wp[j], p);
+      }
+    }
+  }
+  for (long j = 0; j < N; j++) if (a[j] >= p) a[j] -= p;
+}
+
+// Cooley-Tukey butterflies with the values kept in [0,4p)
+void NTTTables::inverse(unsigned long* a) const
+{
+  unsigned long p2 = 2*p;
+  for (long len = 1; len < N; len <<= 1) {
+    const unsigned long* ww = &iw[len];
+    const unsigned long* wp = &iwPre[len];
+    for (long s = 0; s < N; s += 2*len) {
+      unsigned long* x = a + s;
+      unsigned long* y = a + s + len;
+      for (long j = 0; j < len; j++) {
+        unsigned long u = x[j];
+        if (u >= p2) u -= p2;
+        unsigned long v = shoupMulModLazy(y[j], ww[j], wp[j], p);
+        x[j] = u + v;
+        y[j] = u + p2 - v;
+      }
+    }
+  }
+  for (long j = 0; j < N; j++) {
+    unsigned long x = a[j];
+    if (x >= p2) x -= p2;
+    a[j] = (x >= p)? x-p : x;
+  }
+}
+
+void NTTTables::forward(unsigned long* const* a, long nPolys) const
+{
+  if (nPolys == 1) { forward(a[0]); return; }
+  unsigned long p2 = 2*p;
+  for (long len = N/2; len >= 1; len >>= 1) {
+    const unsigned long* ww = &w[len];
+    const unsigned long* wp = &wPre[len];
+    for (long s = 0; s < N; s += 2*len)
+      for (long j = 0; j < len; j++) {
+        unsigned long wj = ww[j], wjPre = wp[j];
+        for (long b = 0; b < nPolys; b++) {
+          unsigned long* x = a[b] + s + j;
+          unsigned long u = x[0], v = x[len];
+          unsigned long sum = u + v;
+          x[0] = (sum >= p2)? sum-p2 : sum;
+          x[len] = shoupMulModLazy(u + p2 - v, wj, wjPre, p);
+        }
+      }
+  }
+  for (long b = 0; b < nPolys; b++)
+    for (long j = 0; j < N; j++) if (a[b][j] >= p) a[b][j] -= p;
+}
+
+void NTTTables::inverse(unsigned long* const* a, long nPolys) const
+{
+  if (nPolys == 1) { inverse(a[0]); return; }
+  unsigned long p2 = 2*p;
+  for (long len = 1; len < N; len <<= 1) {
+    const unsigned long* ww = &iw[len];
+    const unsigned long* wp = &iwPre[len];
+    for (long s = 0; s < N; s += 2*len)
+      for (long j = 0; j < len; j++) {
+        unsigned long wj = ww[j], wjPre = wp[j];
+        for (long b = 0; b < nPolys; b++) {
+          unsigned long* x = a[b] + s + j;
+          unsigned long u = x[0];
+          if (u >= p2) u -= p2;
+          unsigned long v = shoupMulModLazy(x[len], wj, wjPre, p);
+          x[0] = u + v;
+          x[len] = u + p2 - v;
+        }
+      }
+  }
+  for (long b = 0; b < nPolys; b++)
+    for (long j = 0; j < N; j++) {
+      unsigned long x = a[b][j];
+      if (x >= p2) x -= p2;
+      a[b][j] = (x >= p)? x-p : x;
+    }
+}
+
+NegacyclicNTT::NegacyclicNTT(unsigned long _q, unsigned long psi, long _logN)
+  : q(_q), logN(_logN), N(1L << _logN), cyc(_q, mulModWide(psi, psi, _q), _logN)
+{
+  assert(q < (1UL << 62)); // for the lazy butterflies of NTTTables
+  psiPow.resize(N); psiPowPre.resize(N);
+  invPow.resize(N); invPowPre.resize(N);
+  bitRev.resize(N);
+
+  unsigned long psiInv = invModWide(psi, q);
+  unsigned long x = 1, y = invModWide(N % q, q);
+  for (long j = 0; j < N; j++) {
+    psiPow[j] = x; psiPowPre[j] = shoupPrecon(x, q);
+    invPow[j] = y; invPowPre[j] = shoupPrecon(y, q);
+    x = mulModWide(x, psi, q);
+    y = mulModWide(y, psiInv, q);
+
+    long r = 0;
+    for (long b = 0; b < logN; b++) if (j & (1L << b)) r |= 1L << (logN-1-b);
+    bitRev[j] = r;
+  }
+}
+
+// The bit-reversal permutation is an involution, swap the pairs in place
+void NegacyclicNTT::permute(unsigned long* a) const
+{
+  for (long j = 0; j < N; j++)
+    if (j < bitRev[j]) swap(a[j], a[bitRev[j]]);
+}
+
+void NegacyclicNTT::forward(unsigned long* a) const
+{
+  for (long j = 0; j < N; j++) a[j] = shoupMulMod(a[j], psiPow[j], psiPowPre[j], q);
+  cyc.forward(a); // bit-reversed output
+  permute(a);
+}
+
+void NegacyclicNTT::inverse(unsigned long* a) const
+{
+  permute(a);
+  cyc.inverse(a); // natural order, times N
+  for (long j = 0; j < N; j++) a[j] = shoupMulMod(a[j], invPow[j], invPowPre[j], q);
+}
+
+void NegacyclicNTT::forward(unsigned long* const* a, long nPolys) const
+{
+  if (nPolys == 1) { forward(a[0]); return; }
+  for (long b = 0; b < nPolys; b++) {
+    unsigned long* x = a[b];
+    for (long j = 0; j < N; j++) x[j] = shoupMulMod(x[j], psiPow[j], psiPowPre[j], q);
+  }
+  cyc.forward(a, nPolys);
+  for (long b = 0; b < nPolys; b++) permute(a[b]);
+}
+
+void NegacyclicNTT::inverse(unsigned long* const* a, long nPolys) const
+{
+  if (nPolys == 1) { inverse(a[0]); return; }
+  for (long b = 0; b < nPolys; b++) permute(a[b]);
+  cyc.inverse(a, nPolys);
+  for (long b = 0; b < nPolys; b++) {
+    unsigned long* x = a[b];
+    for (long j = 0; j < N; j++) x[j] = shoupMulMod(x[j], invPow[j], invPowPre[j], q);
+  }
+}
+
+// the smallest k with 2^k >= n
+static long ceilLog2(long n)
+{
+  long k = 0;
+  while ((1L << k) < n) k++;
+  return k;
+}
+
+void FixedPolyMul::init(unsigned long _q, const long* b, long lenB,
+                        long maxLenA, long _logN)
+{
+  q = _q;
+  logN = _logN;
+  N = 1L << logN;
+  assert(q > 1 && q < (1UL << 61));
+  assert(lenB >= 1 && lenB <= N && maxLenA >= 1 && maxLenA <= N);
+
+  // Every coefficient of a*b mod X^N-1 is a sum of at most min(lenA,lenB)
+  // products, each smaller than q^2, and every NTT prime is above 2^61
+  long bits = ceilLog2(min(lenB, maxLenA));
+  for (unsigned long t = q-1; t > 0; t >>= 1) bits += 2;
+  nPrimes = max(1L, (bits + 60)/61);
+  assert(nPrimes <= NTT_MAX_PRIMES);
+
+  tabs.resize(nPrimes);
+  B.resize(nPrimes*N);
+  BPre.resize(nPrimes*N);
+  for (long k = 0; k < nPrimes; k++) {
+    tabs[k] = getNTTTables(k, logN);
+    unsigned long p = tabs[k]->getP();
+    unsigned long* Bk = &B[k*N];
+    for (long i = 0; i < N; i++) Bk[i] = (i < lenB)? b[i] : 0;
+    tabs[k]->forward(Bk);
+
+    // fold the 1/N of the inverse transform into the transform of b
+    unsigned long NInv = invModWide(N % p, p);
+    for (long i = 0; i < N; i++) {
+      Bk[i] = mulModWide(Bk[i], NInv, p);
+      BPre[k*N+i] = shoupPrecon(Bk[i], p);
+    }
+  }
+
+  pInv.assign(nPrimes*nPrimes, 0);
+  pInvPre.assign(nPrimes*nPrimes, 0);
+  pProd.resize(nPrimes);
+  pProdPre.resize(nPrimes);
+  for (long k = 0; k < nPrimes; k++) {
+    unsigned long pk = tabs[k]->getP();
+    for (long j = 0; j < k; j++) {
+      unsigned long inv = invModWide(tabs[j]->getP() % pk, pk);
+      pInv[k*nPrimes+j] = inv;
+      pInvPre[k*nPrimes+j] = shoupPrecon(inv, pk);
+    }
+    pProd[k] = (k == 0)? 1 % q
+      : mulModWide(pProd[k-1], tabs[k-1]->getP() % q, q);
+    pProdPre[k] = shoupPrecon(pProd[k], q);
+  }
+}
+
+void FixedPolyMul::mul(long* out, const long* a, long lenA,
+                       long first, long count) const
+{
+  assert(lenA >= 0 && lenA <= N);
+  assert(first >= 0 && count >= 0 && first+count <= N);
+
+  static thread_local vector<unsigned long> buf;
+  if ((long) buf.size() < nPrimes*N) buf.resize(nPrimes*N);
+
+  for (long k = 0; k < nPrimes; k++) {
+    unsigned long p = tabs[k]->getP();
+    unsigned long* A = &buf[k*N];
+    for (long i = 0; i < lenA; i++) A[i] = a[i];
+    for (long i = lenA; i < N; i++) A[i] = 0;
+
+    tabs[k]->forward(A);
+    const unsigned long* Bk = &B[k*N];
+    const unsigned long* BPk = &BPre[k*N];
+    for (long i = 0; i < N; i++) A[i] = shoupMulMod(A[i], Bk[i], BPk[i], p);
+    tabs[k]->inverse(A);
+  }
+
+  garner(out, &buf[0], first, count);
+}
+
+void FixedPolyMul::mul(long* const* out, const long* const* a, long lenA,
+                       long first, long count, long nPolys) const
+{
+  assert(lenA >= 0 && lenA <= N);
+  assert(first >= 0 && count >= 0 && first+count <= N);
+  if (nPolys <= 0) return;
+  if (nPolys == 1) { mul(out[0], a[0], lenA, first, count); return; }
+
+  static thread_local vector<unsigned long> buf;
+  static thread_local vector<unsigned long*> ptrs;
+  if ((long) buf.size() < nPolys*nPrimes*N) buf.resize(nPolys*nPrimes*N);
+  ptrs.resize(nPolys);
+
+  for (long k = 0; k < nPrimes; k++) {
+    unsigned long p = tabs[k]->getP();
+    for (long b = 0; b < nPolys; b++) {
+      unsigned long* A = &buf[(b*nPrimes + k)*N];
+      for (long i = 0; i < lenA; i++) A[i] = a[b][i];
+      for (long i = lenA; i < N; i++) A[i] = 0;
+      ptrs[b] = A;
+    }
+
+    tabs[k]->forward(&ptrs[0], nPolys);
+    const unsigned long* Bk = &B[k*N];
+    const unsigned long* BPk = &BPre[k*N];
+    for (long b = 0; b < nPolys; b++) {
+      unsigned long* A = ptrs[b];
+      for (long i = 0; i < N; i++) A[i] = shoupMulMod(A[i], Bk[i], BPk[i], p);
+    }
+    tabs[k]->inverse(&ptrs[0], nPolys);
+  }
+
+  for (long b = 0; b < nPolys; b++)
+    garner(out[b], &buf[b*nPrimes*N], first, count);
+}
+
+// Garner's mixed-radix CRT: c = v_0 + v_1*p_0 + v_2*p_0*p_1 + ...
+void FixedPolyMul::garner(long* out, const unsigned long* buf,
+                          long first, long count) const
+{
+  unsigned long v[NTT_MAX_PRIMES];
+  for (long t = 0; t < count; t++) {
+    long idx = first + t;
+    v[0] = buf[idx];
+    unsigned long acc = shoupMulMod(v[0], pProd[0], pProdPre[0], q);
+    for (long k = 1; k < nPrimes; k++) {
+      unsigned long pk = tabs[k]->getP();
+      unsigned long x = buf[k*N+idx];
+      for (long j = 0; j < k; j++) {
+        unsigned long vj = (v[j] >= pk)? v[j]-pk : v[j]; // v[j] < 2*pk
+        x = (x >= vj)? x-vj : x+pk-vj;
+        x = shoupMulMod(x, pInv[k*nPrimes+j], pInvPre[k*nPrimes+j], pk);
+      }
+      v[k] = x;
+      acc += shoupMulMod(x, pProd[k], pProdPre[k], q);
+      if (acc >= q) acc -= q;
+    }
+    out[t] = acc;
+  }
+}
+
+void FixedPolyRem::init(unsigned long _q, const long* f, long _d, long _n,
+                        const long* fRevInv)
+{
+  q = _q;
+  d = _d;
+  n = _n;
+  assert(d >= 1 && n > d && f[d] == 1);
+
+  long e = n - d; // the quotient has at most e coefficients
+  mulInv.init(q, fRevInv, e, e, ceilLog2(2*e-1));
+  mulF.init(q, f, d+1, e, ceilLog2(n)); // no wrap-around for the product
+}
+
+void FixedPolyRem::rem(long* r, const long* x) const
+{
+  long e = n - d;
+  static thread_local vector<long> quo, prod;
+  if ((long) quo.size() < e) quo.resize(e);
+  if ((long) prod.size() < d) prod.resize(d);
+
+  // rev(quotient) = rev(x) * rev(f)^{-1} mod X^e
+  for (long i = 0; i < e; i++) quo[i] = x[n-1-i];
+  mulInv.mul(&quo[0], &quo[0], e, 0, e);
+  reverse(quo.begin(), quo.begin()+e);
+
+  // remainder = x - quotient*f mod X^d
+  mulF.mul(&prod[0], &quo[0], e, 0, d);
+  for (long i = 0; i < d; i++)
+    r[i] = (x[i] >= prod[i])? x[i]-prod[i] : x[i]+(long)q-prod[i];
+}
+
+bool CyclotomicRem::init(unsigned long _q, long _m, long maxTerms)
+{
+  q = _q;
+  m = _m;
+  assert(m > 1);
+
+  vector<long> primes; // the distinct prime factors of m
+  long t = m;
+  for (long p = 2; p*p <= t; p++)
+    if (t % p == 0) {
+      primes.push_back(p);
+      while (t % p == 0) t /= p;
+    }
+  if (t > 1) primes.push_back(t);
+
+  n = 1;
+  phin = 1;
+  for (size_t i = 0; i < primes.size(); i++) {
+    n *= primes[i];
+    phin *= primes[i]-1;
+  }
+  s = m / n;
+
+  // the binomials Y^{n/d}-1 for all d|n, by the parity of mu(d)
+  vector<long> aBin;
+  bExps.clear();
+  for (long mask = 0; mask < (1L << primes.size()); mask++) {
+    long d = 1, parity = 0;
+    for (size_t i = 0; i < primes.size(); i++)
+      if (mask & (1L << i)) { d *= primes[i]; parity ^= 1; }
+    if (parity) bExps.push_back(n/d);
+    else        aBin.push_back(n/d);
+  }
+
+  degB = 0;
+  for (size_t i = 0; i < bExps.size(); i++) degB += bExps[i];
+
+  // expand A over the integers
+  vector<long> a(1, 1);
+  for (size_t i = 0; i < aBin.size(); i++) {
+    long k = aBin[i];
+    vector<long> b(a.size()+k, 0);
+    for (size_t j = 0; j < a.size(); j++) {
+      b[j+k] += a[j];
+      b[j] -= a[j];
+    }
+    a.swap(b);
+  }
+  degA = a.size()-1;
+  assert(degA - degB == phin && a[degA] == 1);
+
+  aExps.clear(); aCoef.clear(); aCoefPre.clear();
+  for (long j = 0; j < degA; j++)
+    if (a[j] != 0) {
+      unsigned long c = (a[j] > 0)? a[j] % q : q - ((-a[j]) % q);
+      aExps.push_back(j);
+      aCoef.push_back(c);
+      aCoefPre.push_back(shoupPrecon(c, q));
+    }
+  return (long) aExps.size() <= maxTerms;
+}
+
+void CyclotomicRem::rem(long* r, const long* x) const
+{
+  long len0 = n + degB;
+  static thread_local vector<long> buf;
+  if ((long) buf.size() < len0) buf.resize(len0);
+  long* h = &buf[0];
+  long ql = q;
+
+  for (long res = 0; res < s; res++) {
+    for (long j = 0; j < n; j++) h[j] = x[j*s + res];
+    long len = n;
+
+    // h *= B, one binomial at a time: h[i] = h[i-k] - h[i]
+    for (size_t t = 0; t < bExps.size(); t++) {
+      long k = bExps[t];
+      for (long i = len+k-1; i >= 0; i--) {
+        long hi = (i < len)? h[i] : 0;
+        long lo = (i >= k)? h[i-k] : 0;
+        h[i] = (lo >= hi)? lo-hi : lo+ql-hi;
+      }
+      len += k;
+    }
+
+    // h mod A, using Y^degA = -sum_t aCoef[t] Y^{aExps[t]}
+    for (long i = len-1; i >= degA; i--) {
+      unsigned long c = h[i];
+      if (c == 0) continue;
+      for (size_t t = 0; t < aExps.size(); t++) {
+        long& y = h[i - degA + aExps[t]];
+        long z = shoupMulMod(c, aCoef[t], aCoefPre[t], q);
+        y = (y >= z)? y-z : y+ql-z;
+      }
+    }
+    len = degA;
+
+    // divide exactly by the binomials of B: the quotient by Y^k-1 is the
+    // suffix sum with stride k, shifted down by k
+    long off = 0;
+    for (size_t t = 0; t < bExps.size(); t++) {
+      long k = bExps[t];
+      for (long i = off+len-1-k; i >= off; i--) {
+        long y = h[i] + h[i+k];
+        h[i] = (y >= ql)? y-ql : y;
+      }
+      off += k;
+      len -= k;
+    }
+
+    for (long j = 0; j < phin; j++) r[j*s + res] = h[off + j];
+  }
+}
@@ -0,0 +1,281 @@
+/* Copyright (C) 2012,2013 IBM Corp.
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+#ifndef _NTT_H_
+#define _NTT_H_
+/**
+ * @file ntt.h
+ * @brief Polynomial arithmetic modulo a single-precision q, with explicit
+ * tables
+ *
+ * Products of polynomials modulo q are computed with number-theoretic
+ * transforms (NTTs) modulo a few word-size primes p = 1 mod 2^32, followed
+ * by CRT reconstruction modulo q. Unlike NTL's zz_pX arithmetic, nothing
+ * here depends on a global "current modulus": all the tables are explicit
+ * objects that are read-only after initialization, and the temporary space
+ * is allocated per thread. Hence the const methods of the classes below can
+ * be called concurrently from different threads.
+ *
+ * The moduli q must be smaller than 2^61. This module uses the 128-bit
+ * integer type of gcc/clang.
+ **/
+#include <vector>
+#include <memory>
+
+using namespace std;
+
+//! @brief Shoup's precomputed quotient floor(w*2^64/p), for 0<=w<p<2^63
+inline unsigned long shoupPrecon(unsigned long w, unsigned long p)
+{
+  return (unsigned long) (((unsigned __int128) w << 64) / p);
+}
+
+//! @brief a*w mod p, for any a < 2^64, given wPre = shoupPrecon(w,p)
+inline unsigned long shoupMulMod(unsigned long a, unsigned long w,
+                                 unsigned long wPre, unsigned long p)
+{
+  unsigned long t = (unsigned long) (((unsigned __int128) a * wPre) >> 64);
+  unsigned long r = a*w - t*p; // in [0,2p)
+  return (r >= p)? r-p : r;
+}
+
+//! @brief a*w mod p up to a multiple of p, in [0,2p). Same conditions as
+//! shoupMulMod
+inline unsigned long shoupMulModLazy(unsigned long a, unsigned long w,
+                                     unsigned long wPre, unsigned long p)
+{
+  unsigned long t = (unsigned long) (((unsigned __int128) a * wPre) >> 64);
+  return a*w - t*p;
+}
+
+//! @brief a*b mod p for a,b < p (slow, used for precomputation)
+inline unsigned long mulModWide(unsigned long a, unsigned long b,
+                                unsigned long p)
+{
+  return (unsigned long) (((unsigned __int128) a * b) % p);
+}
+
+//! @brief a^e mod p (slow, used for precomputation)
+unsigned long powModWide(unsigned long a, unsigned long e, unsigned long p);
+
+//! @brief a^{-1} mod a prime p
+inline unsigned long invModWide(unsigned long a, unsigned long p)
+{
+  return powModWide(a, p-2, p);
+}
+
+//! @brief Is n prime? (deterministic for all 64-bit n)
+bool isPrimeWide(unsigned long n);
+
+//! @brief A primitive n'th root of unity modulo a prime q = 1 mod n
+unsigned long primitiveRootWide(unsigned long q, long n);
+
+/**
+ * @class NTTTables
+ * @brief Twiddle factors for length-N cyclic NTTs modulo one NTT prime
+ *
+ * forward() is a decimation-in-frequency transform that takes its input in
+ * the natural order and returns the output in bit-reversed order, inverse()
+ * goes the other way, so no bit-reversal permutation is needed when the
+ * transforms are only used for multiplication. Applying forward() and then
+ * inverse() multiplies the input by N.
+ *
+ * The butterflies are Harvey's lazy ones: the intermediate values are only
+ * reduced to [0,2p) (forward) or [0,4p) (inverse), which is why the NTT
+ * primes are below 2^62, and are fully reduced once at the end.
+ **/
+class NTTTables {
+  unsigned long p;
+  long logN, N;
+
+  // w[len+j] = omega^{j*N/(2len)} for 1<=len<N and 0<=j<len, so the
+  // twiddles of each level are contiguous; iw is the same for omega^{-1}
+  vector<unsigned long> w, wPre, iw, iwPre;
+
+public:
+  //! @brief Tables for N=2^logN, root is a primitive N'th root of unity mod p
+  NTTTables(unsigned long p, unsigned long root, long logN);
+
+  unsigned long getP() const { return p; }
+  long getLogN() const { return logN; }
+  long getN() const { return N; }
+
+  //! @brief a = NTT(a), entries in [0,p), natural to bit-reversed order
+  void forward(unsigned long* a) const;
+
+  //! @brief a = N * NTT^{-1}(a), bit-reversed to natural order
+  void inverse(unsigned long* a) const;
+
+  //! @brief The same for the nPolys arrays a[0..nPolys-1] together, every
+  //! twiddle factor is loaded once for all of them
+  void forward(unsigned long* const* a, long nPolys) const;
+  void inverse(unsigned long* const* a, long nPolys) const;
+};
+
+/**
+ * @class NegacyclicNTT
+ * @brief Evaluation of polynomials modulo (X^N+1, q) at the N odd powers
+ * of a primitive 2N'th root of unity psi
+ *
+ * forward() replaces the coefficients a[0..N-1] by a(psi^{2k+1}) for
+ * k=0,...,N-1, in this (natural) order, and inverse() is its exact inverse.
+ * The transform is the cyclic NTT with root psi^2 of (a[j]*psi^j)_j, so it
+ * works for any prime q < 2^62 with q = 1 mod 2N, without any padding.
+ **/
+class NegacyclicNTT {
+  unsigned long q;
+  long logN, N;
+  NTTTables cyc;                           // length N, root psi^2
+  vector<unsigned long> psiPow, psiPowPre; // psi^j
+  vector<unsigned long> invPow, invPowPre; // psi^{-j}/N
+  vector<long> bitRev;                     // the bit-reversal permutation
+
+  void permute(unsigned long* a) const;
+
+public:
+  NegacyclicNTT(unsigned long q, unsigned long psi, long logN);
+
+  unsigned long getQ() const { return q; }
+  long getN() const { return N; }
+
+  //! @brief a = evaluations of a(X), entries in [0,q)
+  void forward(unsigned long* a) const;
+
+  //! @brief a = coefficients of the polynomial with these evaluations
+  void inverse(unsigned long* a) const;
+
+  //! @brief The same for the nPolys arrays a[0..nPolys-1] together
+  void forward(unsigned long* const* a, long nPolys) const;
+  void inverse(unsigned long* const* a, long nPolys) const;
+};
+
+//! @brief The largest number of NTT primes that are used in one product
+#define NTT_MAX_PRIMES 4
+
+//! @brief The i'th NTT prime, i < NTT_MAX_PRIMES. These are the largest
+//! primes below 2^62 that are 1 mod 2^32, in decreasing order
+unsigned long getNTTPrime(long i);
+
+//! @brief The tables for the i'th NTT prime and N=2^logN, logN<=32. They
+//! are built on first use and shared by all callers
+shared_ptr<const NTTTables> getNTTTables(long i, long logN);
+
+/**
+ * @class FixedPolyMul
+ * @brief Cyclic multiplication by a fixed polynomial b modulo q
+ *
+ * mul() computes c = a*b mod (X^N - 1, q) and returns a range of the
+ * coefficients of c. The products are computed modulo as many NTT primes
+ * as needed for their product to exceed the largest possible integer
+ * coefficient of a*b, and are then reconstructed modulo q using Garner's
+ * CRT. The transform of b is precomputed by init().
+ **/
+class FixedPolyMul {
+  unsigned long q;
+  long logN, N, nPrimes;
+  vector< shared_ptr<const NTTTables> > tabs;
+
+  vector<unsigned long> B, BPre; // NTT(b)/N modulo every prime, nPrimes*N
+
+  // Garner's constants: pInv[k*nPrimes+j] = p_j^{-1} mod p_k for j<k,
+  // and pProd[k] = p_0*...*p_{k-1} mod q
+  vector<unsigned long> pInv, pInvPre, pProd, pProdPre;
+
+  // out[t] = c[first+t] from the products modulo the NTT primes in
+  // buf[k*N..k*N+N-1], using Garner's CRT
+  void garner(long* out, const unsigned long* buf,
+              long first, long count) const;
+
+public:
+  FixedPolyMul(): q(0), logN(0), N(0), nPrimes(0) {}
+
+  //! @brief Prepare the multiplication by b[0..lenB-1] modulo
+  //! (X^{2^logN}-1, q), for inputs a with at most maxLenA coefficients.
+  //! All the coefficients of b must be in [0,q)
+  void init(unsigned long q, const long* b, long lenB, long maxLenA,
+            long logN);
+
+  long getN() const { return N; }
+  long numPrimes() const { return nPrimes; }
+
+  //! @brief out[t] = c[first+t] for 0<=t<count, where c = a*b mod
+  //! (X^N-1,q) and a = a[0..lenA-1] has its coefficients in [0,q).
+  //! out may alias a
+  void mul(long* out, const long* a, long lenA, long first, long count) const;
+
+  //! @brief The same for nPolys inputs a[0..nPolys-1], all of them with
+  //! lenA coefficients, into out[0..nPolys-1]. The NTTs are batched
+  void mul(long* const* out, const long* const* a, long lenA,
+           long first, long count, long nPolys) const;
+};
+
+/**
+ * @class FixedPolyRem
+ * @brief Remainder modulo a fixed monic polynomial f(X) and q
+ *
+ * The remainder is computed with two multiplications by precomputed
+ * polynomials (the quotient comes from the reversed polynomials, as in
+ * NTL's zz_pXModulus).
+ **/
+class FixedPolyRem {
+  unsigned long q;
+  long d, n;          // f has degree d, the inputs have n coefficients
+  FixedPolyMul mulInv; // multiplication by rev(f)^{-1} mod X^{n-d}
+  FixedPolyMul mulF;   // multiplication by f
+
+public:
+  FixedPolyRem(): q(0), d(0), n(0) {}
+
+  //! @brief f[0..d] are the coefficients of f, f[d]=1, and fRevInv[0..n-d-1]
+  //! are those of rev(f)^{-1} mod (X^{n-d}, q), where rev(f)=X^d f(1/X)
+  void init(unsigned long q, const long* f, long d, long n,
+            const long* fRevInv);
+
+  //! @brief r[0..d-1] = x[0..n-1] mod (f,q), r may alias x
+  void rem(long* r, const long* x) const;
+};
+
+/**
+ * @class CyclotomicRem
+ * @brief Remainder modulo Phi_m(X) and q, using only sparse polynomials
+ *
+ * With n = rad(m) and s = m/n we have Phi_m(X) = Phi_n(X^s), so an input of
+ * degree < m splits into s interleaved polynomials of degree < n in Y=X^s.
+ * Each of these is reduced modulo Phi_n(Y) = A(Y)/B(Y), where
+ * A = prod_{mu(d)=1} (Y^{n/d}-1) and B = prod_{mu(d)=-1} (Y^{n/d}-1):
+ * for g of degree < n, g mod Phi_n = (g*B mod A)/B. Multiplying and (exactly)
+ * dividing by the binomials of B take linear time, and A has few terms when
+ * m has few prime factors, so there is no division by a dense polynomial.
+ **/
+class CyclotomicRem {
+  unsigned long q;
+  long m, n, s, phin;
+  vector<long> bExps;    // B(Y) = prod_k (Y^{bExps[k]}-1)
+  long degA, degB;
+  vector<long> aExps;    // A(Y) = Y^degA + sum_t aCoef[t]*Y^{aExps[t]}
+  vector<unsigned long> aCoef, aCoefPre;
+
+public:
+  CyclotomicRem(): q(0), m(0), n(0), s(0), phin(0), degA(0), degB(0) {}
+
+  //! @brief Prepare the reduction for m>1 and a prime q. Returns false (and
+  //! the object should not be used) if A has more than maxTerms terms
+  bool init(unsigned long q, long m, long maxTerms=64);
+
+  //! @brief r[0..phi(m)-1] = x[0..m-1] mod (Phi_m(X),q), r may alias x
+  void rem(long* r, const long* x) const;
+};
+
+#endif // _NTT_H_
@@ -21,6 +21,9 @@
 #define _PERMUTATIONS_H_
 
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include "matching.h"
 #include "hypercube.h"
 #include "PAlgebra.h"
@@ -492,6 +495,8 @@ class GeneratorTrees  {
 
 class Ctxt;
 class EncryptedArray;
+class FHEcontext;
+class PreparedConstant;
 class PermNetwork;
 
 //! @class PermNetLayer
@@ -515,6 +520,26 @@ class PermNetLayer {
 class PermNetwork {
   Vec<PermNetLayer> layers;
 
+  // The masks of every layer, each already automorphed by its shift, and
+  // the automorphisms for these shifts. They depend on the network and the
+  // context, so applyToCtxt computes them on its first call with every
+  // context and reuses them afterwards. The lock is not copied with the rest.
+  struct LayerMasks {
+    vector< vector< shared_ptr<const PreparedConstant> > > masks;
+    vector< vector<long> > vals;
+  };
+  struct MaskLock {
+    mutex mtx;
+    MaskLock() {}
+    MaskLock(const MaskLock&) {}
+    MaskLock& operator=(const MaskLock&) { return *this; }
+  };
+  mutable MaskLock maskLock;
+  mutable map<const FHEcontext*, shared_ptr<const LayerMasks> > maskCache;
+
+  //! Return the masks for this context, computing them if not done already
+  shared_ptr<const LayerMasks> prepareMasks(const FHEcontext& context) const;
+
   //! Copmute one or more layers corresponding to one network of a leaf
   void setLayers4Leaf(long lyrIdx, const ColPerm& p, const Vec<long>& benesLvls,
 		      long gIdx, const SubDimension& leafData,
@@ -25,31 +25,52 @@ FFTHelper::FFTHelper(long _m, zz_p x)
     if (coprime[i]) phim++;
   }
 
-  build(phimx, conv<zz_pX>( Cyclotomic(m) ));
+  long q = zz_p::modulus();
+  fwdPlan.init(m, q, rep(root));
+  invPlan.init(m, q, rep(iroot));
+
+  haveCycRem = (m > 1 && cycRem.init(q, m));
+  if (!haveCycRem)
+    build(phimx, conv<zz_pX>( Cyclotomic(m) ));
 }
 
 
 void FFTHelper::FFT(const zz_pX& f, Vec<zz_p>& v) const
 {
-  tmp = f;
-  BluesteinFFT(tmp, m, root, powers, powers_aux, Rb, Rb_aux, Ra);
+  // the coefficients of degree m and above are ignored, as in BluesteinFFT
+  static thread_local vector<long> buf;
+  buf.assign(m, 0);
+  long n = min(deg(f)+1, m);
+  for (long i = 0; i < n; i++) buf[i] = rep(f.rep[i]);
+
+  fwdPlan.apply(&buf[0]);
   v.SetLength(phim);
 
   for (long i = 0, j = 0; i < m; i++)
-    if (coprime[i]) v[j++] = coeff(tmp, i);
+    if (coprime[i]) v[j++].LoopHole() = buf[i];
 }
 
 void FFTHelper::iFFT(zz_pX& f, const Vec<zz_p>& v, bool normalize) const
 {
-  tmp.rep.SetLength(m);
-  for (long i = 0, j = 0; i < m; i++) {
-    if (coprime[i]) tmp.rep[i] = v[j++];
-  }
-  tmp.normalize();
-  
-  BluesteinFFT(tmp, m, iroot, ipowers, ipowers_aux, iRb, iRb_aux, Ra);
+  static thread_local vector<long> buf;
+  buf.resize(m);
+  for (long i = 0, j = 0; i < m; i++)
+    buf[i] = coprime[i]? rep(v[j++]) : 0;
 
-  rem(f, tmp, phimx);
+  invPlan.apply(&buf[0]);
+
+  if (haveCycRem) {
+    cycRem.rem(&buf[0], &buf[0]);
+    f.rep.SetLength(phim);
+    for (long i = 0; i < phim; i++) f.rep[i].LoopHole() = buf[i];
+    f.normalize();
+  }
+  else {
+    f.rep.SetLength(m);
+    for (long i = 0; i < m; i++) f.rep[i].LoopHole() = buf[i];
+    f.normalize();
+    rem(f, f, phimx);
+  }
 
   if (normalize) f *= m_inv;
 }
@@ -592,3 +613,216 @@ void mapPowerfulToPoly(ZZX& poly,
 
   poly = f % phimX;
 }
+
+
+// Implementation of PowerfulFFT
+
+// Dimensions of at most that many points use matrices, the others Bluestein
+#define POWERFUL_DIRECT_MAX 64
+
+// The first entry of every column along dimension d, where the dimensions
+// e<d (or all e!=d, if allShort) have only their first phi(m_e) entries
+static void columnBases(vector<long>& bases, long d, bool allShort,
+                        const Vec<long>& powVec, const Vec<long>& phiVec,
+                        const CubeSignature& longSig)
+{
+  long k = powVec.length();
+  vector<long> range(k), cnt(k, 0);
+  for (long e = 0; e < k; e++)
+    range[e] = (e == d)? 1 : ((e < d || allShort)? phiVec[e] : powVec[e]);
+
+  bases.clear();
+  for (;;) {
+    long base = 0;
+    for (long e = 0; e < k; e++) base += cnt[e] * longSig.getProd(e+1);
+    bases.push_back(base);
+
+    long e = k-1;
+    while (e >= 0 && ++cnt[e] == range[e]) cnt[e--] = 0;
+    if (e < 0) break;
+  }
+}
+
+PowerfulFFT::PowerfulFFT(const Vec< Pair<long, long> >& factors, long _m,
+                         unsigned long _q, unsigned long root)
+{
+  m = _m;
+  q = _q;
+
+  Vec<long> phiVec, powVec, divVec, invVec;
+  computePhiVec(phiVec, factors);
+  computePowVec(powVec, factors);
+  computeDivVec(divVec, m, powVec);
+  computeInvVec(invVec, divVec, powVec);
+  assert(computeProd(powVec) == m);
+  phim = computeProd(phiVec);
+
+  CubeSignature longSig(powVec), shortSig(phiVec);
+
+  Vec<long> p2c, c2p, s2l, p2s;
+  Vec< Vec<long> > compressed;
+  computePowerToCubeMap(p2c, c2p, m, powVec, invVec, longSig);
+  computeShortToLongMap(s2l, shortSig, longSig);
+  computeCompressedIndex(compressed, powVec);
+  computePowToCompressedIndexMap(p2s, m, powVec, compressed, shortSig);
+
+  polyToCube.resize(m);
+  cubeToPoly.resize(m);
+  for (long i = 0; i < m; i++) {
+    polyToCube[i] = p2c[i];
+    cubeToPoly[i] = c2p[i];
+    if (p2s[i] >= 0) outIdx.push_back(s2l[p2s[i]]);
+  }
+  assert((long) outIdx.size() == phim);
+
+  long k = factors.length();
+  dims.resize(k);
+  for (long d = 0; d < k; d++) {
+    Dim& dim = dims[d];
+    dim.m = powVec[d];
+    dim.phi = phiVec[d];
+    dim.p = factors[d].a;
+    dim.n1 = dim.m / dim.p;
+    dim.stride = longSig.getProd(d+1);
+    for (long j = 0; j < dim.m; j++)
+      if (GCD(j, dim.m) == 1) dim.prim.push_back(j);
+    columnBases(dim.fwdCols, d, false, powVec, phiVec, longSig);
+    columnBases(dim.invCols, d, true, powVec, phiVec, longSig);
+
+    // a 2m_d'th root, and the m_d'th root omega_d = rootD^2
+    unsigned long rootD = powModWide(root, divVec[d], q);
+    unsigned long omega = mulModWide(rootD, rootD, q);
+    unsigned long omegaInv = invModWide(omega, q);
+    unsigned long mInv = invModWide(dim.m % q, q);
+
+    if (dim.m <= POWERFUL_DIRECT_MAX) {
+      long phi = dim.phi;
+      dim.fwdMat.resize(phi*phi); dim.fwdMatPre.resize(phi*phi);
+      dim.invMat.resize(phi*phi); dim.invMatPre.resize(phi*phi);
+      for (long j = 0; j < phi; j++) // omega_d^{prim[j]*a}
+        for (long a = 0; a < phi; a++) {
+          unsigned long w = powModWide(omega, (dim.prim[j]*a) % dim.m, q);
+          dim.fwdMat[j*phi+a] = w;
+          dim.fwdMatPre[j*phi+a] = shoupPrecon(w, q);
+        }
+
+      // column t of the inverse is the interpolation of the t'th unit
+      // vector: m_d^{-1} sum_i omega_d^{-prim[t]*i} X^i mod Phi_{m_d}(X)
+      vector<long> b(dim.m);
+      for (long t = 0; t < phi; t++) {
+        for (long i = 0; i < dim.m; i++)
+          b[i] = mulModWide(mInv,
+                   powModWide(omegaInv, (dim.prim[t]*i) % dim.m, q), q);
+        reduceCyclotomic(&b[0], dim);
+        for (long a = 0; a < phi; a++) {
+          dim.invMat[a*phi+t] = b[a];
+          dim.invMatPre[a*phi+t] = shoupPrecon(b[a], q);
+        }
+      }
+    }
+    else {
+      dim.fwdPlan = make_shared<BluesteinPlan>();
+      dim.fwdPlan->init(dim.m, q, rootD);
+      dim.invPlan = make_shared<BluesteinPlan>();
+      dim.invPlan->init(dim.m, q, invModWide(rootD, q), mInv);
+    }
+  }
+}
+
+// Reduce a[0..m_d-1] modulo Phi_{m_d}(X) = sum_{t<p} X^{t*n1} in place, using
+// X^{phi+r} = -sum_{t<p-1} X^{t*n1+r}. The top n1 entries are then zero
+void PowerfulFFT::reduceCyclotomic(long* a, const Dim& dim) const
+{
+  for (long r = 0; r < dim.n1; r++) {
+    long c = a[dim.phi + r];
+    if (c == 0) continue;
+    a[dim.phi + r] = 0;
+    for (long t = 0; t < dim.p-1; t++) {
+      long& x = a[t*dim.n1 + r];
+      x = (x >= c)? x-c : x+(long)q-c;
+    }
+  }
+}
+
+// out[j] = sum_a mat[j*n+a]*in[a] mod q, for j < n
+static void matVecMod(long* out, const unsigned long* mat,
+                      const unsigned long* matPre, const long* in,
+                      long n, unsigned long q)
+{
+  for (long j = 0; j < n; j++) {
+    unsigned long acc = 0;
+    for (long a = 0; a < n; a++) {
+      acc += shoupMulMod(in[a], mat[j*n+a], matPre[j*n+a], q);
+      if (acc >= q) acc -= q;
+    }
+    out[j] = acc;
+  }
+}
+
+void PowerfulFFT::forward(long* y, const long* a) const
+{
+  static thread_local vector<long> cube, col, out;
+  cube.resize(m);
+  for (long i = 0; i < m; i++) cube[polyToCube[i]] = a[i];
+
+  for (size_t d = 0; d < dims.size(); d++) {
+    const Dim& dim = dims[d];
+    col.resize(dim.m);
+    out.resize(dim.phi);
+    for (size_t c = 0; c < dim.fwdCols.size(); c++) {
+      long* x = &cube[dim.fwdCols[c]];
+      for (long i = 0; i < dim.m; i++) col[i] = x[i*dim.stride];
+
+      if (dim.fwdPlan) { // evaluate at all m_d'th roots, keep the primitive
+        dim.fwdPlan->apply(&col[0]);
+        for (long j = 0; j < dim.phi; j++) out[j] = col[dim.prim[j]];
+      }
+      else {
+        reduceCyclotomic(&col[0], dim);
+        matVecMod(&out[0], &dim.fwdMat[0], &dim.fwdMatPre[0], &col[0],
+                  dim.phi, q);
+      }
+      for (long j = 0; j < dim.phi; j++) x[j*dim.stride] = out[j];
+    }
+  }
+
+  for (long t = 0; t < phim; t++) y[t] = cube[outIdx[t]];
+}
+
+void PowerfulFFT::inverse(long* a, const long* y) const
+{
+  static thread_local vector<long> cube, col, out;
+  cube.resize(m);
+  for (long t = 0; t < phim; t++) cube[outIdx[t]] = y[t];
+
+  for (size_t d = 0; d < dims.size(); d++) {
+    const Dim& dim = dims[d];
+    col.resize(dim.m);
+    out.resize(dim.phi);
+    for (size_t c = 0; c < dim.invCols.size(); c++) {
+      long* x = &cube[dim.invCols[c]];
+
+      if (dim.invPlan) { // zero at the non-primitive roots
+        for (long i = 0; i < dim.m; i++) col[i] = 0;
+        for (long j = 0; j < dim.phi; j++) col[dim.prim[j]] = x[j*dim.stride];
+        dim.invPlan->apply(&col[0]);
+        reduceCyclotomic(&col[0], dim);
+        for (long j = 0; j < dim.phi; j++) out[j] = col[j];
+      }
+      else {
+        for (long j = 0; j < dim.phi; j++) col[j] = x[j*dim.stride];
+        matVecMod(&out[0], &dim.invMat[0], &dim.invMatPre[0], &col[0],
+                  dim.phi, q);
+      }
+      for (long j = 0; j < dim.phi; j++) x[j*dim.stride] = out[j];
+    }
+  }
+
+  // the cube entries with all coordinates below phi(m_d) are the
+  // coefficients in the powerful basis, map them back to powers of X
+  for (long i = 0; i < m; i++) a[i] = 0;
+  for (long t = 0; t < phim; t++) {
+    long pos = outIdx[t];
+    a[cubeToPoly[pos]] = cube[pos];
+  }
+}
@@ -13,6 +13,8 @@
  * with this program; if not, write to the Free Software Foundation, Inc.,
  * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
  */
+#ifndef _POWERFUL_H_
+#define _POWERFUL_H_
 /**
  * @file powerful.h
  * @brief The "powerful basis" of a cyclotomic ring
@@ -34,22 +36,23 @@
 //!
 //! It is assumed that the zz_p-context is set prior to all
 //! constructor and method invocations.
+//!
+//! The transforms use explicit tables (BluesteinPlan, CyclotomicRem) that
+//! are built by the constructor, so the methods allocate nothing after the
+//! first call and do not touch NTL's FFT tables.
 class FFTHelper {
 
 private:
   long m;
   zz_p m_inv;
   zz_p root, iroot;
-  zz_pXModulus phimx;
+  zz_pXModulus phimx; // used only if cycRem is not available
   Vec<bool> coprime;
   long phim;
 
-  mutable zz_pX powers, ipowers;
-  mutable Vec<mulmod_precon_t> powers_aux, ipowers_aux;
-  mutable fftRep Rb, iRb;
-  mutable fftrep_aux Rb_aux, iRb_aux;
-  mutable fftRep Ra; 
-  mutable zz_pX tmp;
+  BluesteinPlan fwdPlan, invPlan; // invPlan is not scaled by 1/m
+  CyclotomicRem cycRem;
+  bool haveCycRem;
 
 public:
   FFTHelper(long _m, zz_p x);
@@ -264,3 +267,63 @@ void mapPowerfulToPoly(ZZX& poly,
                        const Vec<long>& divVec,
                        long m,
                        const ZZX& phimX);
+
+
+/**
+ * @class PowerfulFFT
+ * @brief A prime-factor (Good-Thomas) FFT modulo a single-precision q, for
+ * composite m
+ *
+ * With m = m_1 ... m_k, m_d = p_d^{e_d}, the map X^i -> prod_d X_d^{i_d}
+ * where i = sum_d i_d (m/m_d) mod m (see computePowerToCubeMap) turns the
+ * length-m transform into a tensor product of transforms of lengths m_d,
+ * one along every dimension of the cube (m_1, ..., m_k). Each dimension is
+ * only evaluated at the phi(m_d) primitive m_d'th roots of unity, so the
+ * transformed cube has dimensions (phi(m_1), ..., phi(m_k)), and its
+ * entries are permuted into Zm* order at the end.
+ *
+ * Short dimensions use precomputed matrices, longer ones use BluesteinPlan
+ * of length m_d. Like the other explicit tables, the object is read-only
+ * after construction and can be used concurrently from different threads.
+ **/
+class PowerfulFFT {
+  // The transform along one dimension
+  struct Dim {
+    long m, phi;    // m_d = p^e and phi(m_d)
+    long p, n1;     // the prime and p^{e-1}
+    long stride;    // the distance between consecutive entries in the cube
+    vector<long> prim;     // Z_{m_d}^*, in increasing order
+    vector<long> fwdCols;  // the first entry of every column, forward
+    vector<long> invCols;  // same, inverse (other dimensions have phi entries)
+
+    // phi x phi matrices for short dimensions, row-major
+    vector<unsigned long> fwdMat, fwdMatPre, invMat, invMatPre;
+    shared_ptr<BluesteinPlan> fwdPlan, invPlan; // for the longer ones
+  };
+
+  long m, phim;
+  unsigned long q;
+  vector<Dim> dims;
+  vector<long> polyToCube; // X^i is at cube position polyToCube[i]
+  vector<long> cubeToPoly; // and back
+  vector<long> outIdx;     // the t'th element of Zm* is at outIdx[t]
+
+  void reduceCyclotomic(long* a, const Dim& dim) const;
+
+public:
+  //! @brief Tables for m with the given factorization, q = 1 mod 2m, root
+  //! is a primitive 2m'th root of unity mod q. The transform evaluates at
+  //! the powers of root^2, as BluesteinFFT does
+  PowerfulFFT(const Vec< Pair<long, long> >& factors, long m,
+              unsigned long q, unsigned long root);
+
+  //! @brief y[0..phi(m)-1] = the evaluations of a(X) at root^{2i} for i in
+  //! Zm*, where a = a[0..m-1] has its coefficients in [0,q)
+  void forward(long* y, const long* a) const;
+
+  //! @brief a[0..m-1] = the coefficients of a polynomial of degree less than
+  //! m with these evaluations (not reduced modulo Phi_m(X))
+  void inverse(long* a, const long* y) const;
+};
+
+#endif // _POWERFUL_H_
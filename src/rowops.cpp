@@ -0,0 +1,752 @@
+/* Copyright (C) 2012,2013 IBM Corp.
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+/* rowops.cpp - modular arithmetic on whole rows of single-precision integers
+ *
+ * Three implementations of every kernel are provided: a scalar one that
+ * uses NTL's single-precision routines, and AVX2 and AVX-512 versions that
+ * are compiled with GCC/clang target attributes and selected at run time.
+ *
+ * The vector multiplication follows NTL's MulMod(a,b,q,qinv): a quotient
+ * estimate qhat = round(a*b*qinv) is computed in double precision, and
+ * the remainder a*b - qhat*q is computed exactly modulo 2^64 and then
+ * corrected into [0,q). For q < 2^50 the estimate is off by at most one,
+ * so a single correction in each direction suffices. The vector kernels
+ * are only used for such q, larger moduli always go to the scalar code.
+ *
+ * NTL's routines only work for q < NTL_SP_BOUND. The wide moduli of the
+ * chain (up to 2^62, see FHEcontext::widePrimes) use Montgomery products
+ * with R = 2^64 for row times row, and Shoup's products for row times
+ * constant, both with 128-bit intermediate results.
+ */
+#include <NTL/ZZ.h>
+#include "rowops.h"
+#include "ntt.h"
+
+NTL_CLIENT
+
+#if (defined(__x86_64__) && defined(__GNUC__))
+#define ROWOPS_X86
+#include <immintrin.h>
+#endif
+
+// The vector kernels are valid only for moduli below this bound
+#define ROWOPS_SIMD_BOUND (1L << 50)
+
+/********************************************************************/
+/* The scalar kernels                                               */
+
+static void scalarAdd(long* x, const long* y, long n, long q)
+{
+  for (long i = 0; i < n; i++) x[i] = AddMod(x[i], y[i], q);
+}
+
+static void scalarSub(long* x, const long* y, long n, long q)
+{
+  for (long i = 0; i < n; i++) x[i] = SubMod(x[i], y[i], q);
+}
+
+static void scalarNegate(long* x, const long* y, long n, long q)
+{
+  for (long i = 0; i < n; i++) x[i] = NegateMod(y[i], q);
+}
+
+static void scalarMul(long* x, const long* y, long n, long q, double qinv)
+{
+  for (long i = 0; i < n; i++) x[i] = MulMod(x[i], y[i], q, qinv);
+}
+
+static void scalarMulAdd(long* x, const long* a, const long* b,
+                         long n, long q, double qinv)
+{
+  for (long i = 0; i < n; i++)
+    x[i] = AddMod(x[i], MulMod(a[i], b[i], q, qinv), q);
+}
+
+static void scalarMulAdd2(long* x, const long* a, const long* b,
+                          const long* c, const long* d,
+                          long n, long q, double qinv)
+{
+  for (long i = 0; i < n; i++) {
+    long t = AddMod(MulMod(a[i], b[i], q, qinv), MulMod(c[i], d[i], q, qinv), q);
+    x[i] = AddMod(x[i], t, q);
+  }
+}
+
+static void scalarAddConst(long* x, long c, long n, long q)
+{
+  for (long i = 0; i < n; i++) x[i] = AddMod(x[i], c, q);
+}
+
+static void scalarMulConst(long* x, long c, long n, long q, double qinv)
+{
+  mulmod_precon_t cqinv = PrepMulModPrecon(c, q, qinv);
+  for (long i = 0; i < n; i++) x[i] = MulModPrecon(x[i], c, q, cqinv);
+}
+
+// how far ahead the scalar gather prefetches
+#define GATHER_PREFETCH 16
+
+static void scalarGather(long* x, const long* y, const long* idx, long n)
+{
+  long i = 0;
+#ifdef __GNUC__
+  for (; i+GATHER_PREFETCH < n; i++) {
+    __builtin_prefetch(y + idx[i+GATHER_PREFETCH]);
+    x[i] = y[idx[i]];
+  }
+#endif
+  for (; i < n; i++) x[i] = y[idx[i]];
+}
+
+/********************************************************************/
+/* The kernels for wide moduli, NTL_SP_BOUND <= q < 2^62            */
+
+// -q^{-1} mod 2^64 for an odd q, by Newton's iteration: q*q = 1 mod 8,
+// and every step doubles the number of correct low bits
+static inline unsigned long montNegInv(unsigned long q)
+{
+  unsigned long inv = q;
+  for (long i = 0; i < 5; i++) inv *= 2 - q*inv;
+  return -inv;
+}
+
+// t*2^{-64} mod q, up to a multiple of q, in [0,2q). For t < q*2^64
+static inline unsigned long montRedc(unsigned __int128 t, unsigned long q,
+                                     unsigned long qNegInv)
+{
+  unsigned long u = ((unsigned long) t) * qNegInv;
+  return (unsigned long) ((t + (unsigned __int128) u * q) >> 64);
+}
+
+// The constants for a*b mod q = REDC(REDC(a*b) * (2^128 mod q))
+class MontConst {
+public:
+  unsigned long q, qNegInv, r2;
+  explicit MontConst(long _q)
+  {
+    q = _q;
+    qNegInv = montNegInv(q);
+    unsigned long r = (unsigned long) ((((unsigned __int128) 1) << 64) % q);
+    r2 = mulModWide(r, r, q);
+  }
+
+  // t mod q in [0,q), for t < q*2^63
+  long reduce(unsigned __int128 t) const
+  {
+    unsigned long r = montRedc((unsigned __int128) montRedc(t, q, qNegInv) * r2,
+                               q, qNegInv);
+    return (r >= q)? r-q : r;
+  }
+};
+
+static void wideMul(long* x, const long* y, long n, long q, double)
+{
+  MontConst mc(q);
+  for (long i = 0; i < n; i++)
+    x[i] = mc.reduce((unsigned __int128) x[i] * (unsigned long) y[i]);
+}
+
+static void wideMulAdd(long* x, const long* a, const long* b,
+                       long n, long q, double)
+{
+  MontConst mc(q);
+  for (long i = 0; i < n; i++)
+    x[i] = AddMod(x[i], mc.reduce((unsigned __int128) a[i] * (unsigned long) b[i]), q);
+}
+
+// a*b + c*d < 2q^2 < q*2^63, so the two products share one reduction
+static void wideMulAdd2(long* x, const long* a, const long* b,
+                        const long* c, const long* d,
+                        long n, long q, double)
+{
+  MontConst mc(q);
+  for (long i = 0; i < n; i++) {
+    unsigned __int128 t = (unsigned __int128) a[i] * (unsigned long) b[i]
+                        + (unsigned __int128) c[i] * (unsigned long) d[i];
+    x[i] = AddMod(x[i], mc.reduce(t), q);
+  }
+}
+
+static void wideMulConst(long* x, long c, long n, long q, double)
+{
+  unsigned long cPre = shoupPrecon(c, q);
+  for (long i = 0; i < n; i++) x[i] = shoupMulMod(x[i], c, cPre, q);
+}
+
+#ifdef ROWOPS_X86
+
+/********************************************************************/
+/* AVX2 kernels, four entries at a time                             */
+
+#define AVX2 __attribute__((target("avx2")))
+
+// 2^52 as a double, and its bit pattern
+static const double magicD = 4503599627370496.0;
+static const long magicI = 0x4330000000000000L;
+
+// convert 0 <= a < 2^52 to double
+static inline AVX2 __m256d avx2ToDouble(__m256i a)
+{
+  __m256i bits = _mm256_or_si256(a, _mm256_set1_epi64x(magicI));
+  return _mm256_sub_pd(_mm256_castsi256_pd(bits), _mm256_set1_pd(magicD));
+}
+
+// round 0 <= d < 2^51 to the nearest integer
+static inline AVX2 __m256i avx2ToLong(__m256d d)
+{
+  __m256d t = _mm256_add_pd(d, _mm256_set1_pd(magicD));
+  return _mm256_sub_epi64(_mm256_castpd_si256(t), _mm256_set1_epi64x(magicI));
+}
+
+// the low 64 bits of a*b
+static inline AVX2 __m256i avx2MulLo(__m256i a, __m256i b)
+{
+  __m256i lo = _mm256_mul_epu32(a, b);
+  __m256i t1 = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b);
+  __m256i t2 = _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32));
+  return _mm256_add_epi64(lo, _mm256_slli_epi64(_mm256_add_epi64(t1, t2), 32));
+}
+
+// reduce -q <= r < 2q into [0,q)
+static inline AVX2 __m256i avx2Correct(__m256i r, __m256i qv)
+{
+  __m256i zero = _mm256_setzero_si256();
+  r = _mm256_add_epi64(r, _mm256_and_si256(_mm256_cmpgt_epi64(zero, r), qv));
+  __m256i t = _mm256_sub_epi64(r, qv);
+  return _mm256_blendv_epi8(t, r, _mm256_cmpgt_epi64(zero, t));
+}
+
+// a*b mod q for a,b in [0,q)
+static inline AVX2 __m256i avx2MulModVec(__m256i a, __m256i b,
+                                          __m256i qv, __m256d qinvv)
+{
+  __m256d t = _mm256_mul_pd(_mm256_mul_pd(avx2ToDouble(a), avx2ToDouble(b)),
+                            qinvv);
+  __m256i qhat = avx2ToLong(t);
+  __m256i r = _mm256_sub_epi64(avx2MulLo(a, b), avx2MulLo(qhat, qv));
+  return avx2Correct(r, qv);
+}
+
+// a+b mod q for a,b in [0,q)
+static inline AVX2 __m256i avx2AddModVec(__m256i a, __m256i b, __m256i qv)
+{
+  __m256i r = _mm256_add_epi64(a, b);
+  __m256i t = _mm256_sub_epi64(r, qv);
+  return _mm256_blendv_epi8(t, r, _mm256_cmpgt_epi64(_mm256_setzero_si256(), t));
+}
+
+static AVX2 void avx2Add(long* x, const long* y, long n, long q)
+{
+  __m256i qv = _mm256_set1_epi64x(q);
+  __m256i zero = _mm256_setzero_si256();
+  long i = 0;
+  for (; i+4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (x+i));
+    __m256i b = _mm256_loadu_si256((const __m256i*) (y+i));
+    __m256i r = _mm256_add_epi64(a, b);
+    __m256i t = _mm256_sub_epi64(r, qv);
+    r = _mm256_blendv_epi8(t, r, _mm256_cmpgt_epi64(zero, t));
+    _mm256_storeu_si256((__m256i*) (x+i), r);
+  }
+  scalarAdd(x+i, y+i, n-i, q);
+}
+
+static AVX2 void avx2Sub(long* x, const long* y, long n, long q)
+{
+  __m256i qv = _mm256_set1_epi64x(q);
+  __m256i zero = _mm256_setzero_si256();
+  long i = 0;
+  for (; i+4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (x+i));
+    __m256i b = _mm256_loadu_si256((const __m256i*) (y+i));
+    __m256i r = _mm256_sub_epi64(a, b);
+    r = _mm256_add_epi64(r, _mm256_and_si256(_mm256_cmpgt_epi64(zero, r), qv));
+    _mm256_storeu_si256((__m256i*) (x+i), r);
+  }
+  scalarSub(x+i, y+i, n-i, q);
+}
+
+static AVX2 void avx2Negate(long* x, const long* y, long n, long q)
+{
+  __m256i qv = _mm256_set1_epi64x(q);
+  __m256i zero = _mm256_setzero_si256();
+  long i = 0;
+  for (; i+4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (y+i));
+    __m256i r = _mm256_andnot_si256(_mm256_cmpeq_epi64(a, zero),
+                                    _mm256_sub_epi64(qv, a));
+    _mm256_storeu_si256((__m256i*) (x+i), r);
+  }
+  scalarNegate(x+i, y+i, n-i, q);
+}
+
+static AVX2 void avx2Mul(long* x, const long* y, long n, long q, double qinv)
+{
+  __m256i qv = _mm256_set1_epi64x(q);
+  __m256d qinvv = _mm256_set1_pd(qinv);
+  long i = 0;
+  for (; i+4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (x+i));
+    __m256i b = _mm256_loadu_si256((const __m256i*) (y+i));
+    _mm256_storeu_si256((__m256i*) (x+i), avx2MulModVec(a, b, qv, qinvv));
+  }
+  scalarMul(x+i, y+i, n-i, q, qinv);
+}
+
+static AVX2 void avx2MulAdd(long* x, const long* a, const long* b,
+                            long n, long q, double qinv)
+{
+  __m256i qv = _mm256_set1_epi64x(q);
+  __m256d qinvv = _mm256_set1_pd(qinv);
+  long i = 0;
+  for (; i+4 <= n; i += 4) {
+    __m256i av = _mm256_loadu_si256((const __m256i*) (a+i));
+    __m256i bv = _mm256_loadu_si256((const __m256i*) (b+i));
+    __m256i xv = _mm256_loadu_si256((const __m256i*) (x+i));
+    xv = avx2AddModVec(xv, avx2MulModVec(av, bv, qv, qinvv), qv);
+    _mm256_storeu_si256((__m256i*) (x+i), xv);
+  }
+  scalarMulAdd(x+i, a+i, b+i, n-i, q, qinv);
+}
+
+static AVX2 void avx2MulAdd2(long* x, const long* a, const long* b,
+                             const long* c, const long* d,
+                             long n, long q, double qinv)
+{
+  __m256i qv = _mm256_set1_epi64x(q);
+  __m256d qinvv = _mm256_set1_pd(qinv);
+  long i = 0;
+  for (; i+4 <= n; i += 4) {
+    __m256i av = _mm256_loadu_si256((const __m256i*) (a+i));
+    __m256i bv = _mm256_loadu_si256((const __m256i*) (b+i));
+    __m256i cv = _mm256_loadu_si256((const __m256i*) (c+i));
+    __m256i dv = _mm256_loadu_si256((const __m256i*) (d+i));
+    __m256i xv = _mm256_loadu_si256((const __m256i*) (x+i));
+    __m256i t = avx2AddModVec(avx2MulModVec(av, bv, qv, qinvv),
+                              avx2MulModVec(cv, dv, qv, qinvv), qv);
+    _mm256_storeu_si256((__m256i*) (x+i), avx2AddModVec(xv, t, qv));
+  }
+  scalarMulAdd2(x+i, a+i, b+i, c+i, d+i, n-i, q, qinv);
+}
+
+static AVX2 void avx2Gather(long* x, const long* y, const long* idx, long n)
+{
+  long i = 0;
+  for (; i+4 <= n; i += 4) {
+    __m256i iv = _mm256_loadu_si256((const __m256i*) (idx+i));
+    __m256i r = _mm256_i64gather_epi64((const long long*) y, iv, 8);
+    _mm256_storeu_si256((__m256i*) (x+i), r);
+  }
+  scalarGather(x+i, y, idx+i, n-i);
+}
+
+static AVX2 void avx2AddConst(long* x, long c, long n, long q)
+{
+  __m256i qv = _mm256_set1_epi64x(q);
+  __m256i cv = _mm256_set1_epi64x(c);
+  __m256i zero = _mm256_setzero_si256();
+  long i = 0;
+  for (; i+4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (x+i));
+    __m256i r = _mm256_add_epi64(a, cv);
+    __m256i t = _mm256_sub_epi64(r, qv);
+    r = _mm256_blendv_epi8(t, r, _mm256_cmpgt_epi64(zero, t));
+    _mm256_storeu_si256((__m256i*) (x+i), r);
+  }
+  scalarAddConst(x+i, c, n-i, q);
+}
+
+static AVX2 void avx2MulConst(long* x, long c, long n, long q, double qinv)
+{
+  __m256i qv = _mm256_set1_epi64x(q);
+  __m256i cv = _mm256_set1_epi64x(c);
+  __m256d cqinv = _mm256_set1_pd(((double) c) * qinv);
+  long i = 0;
+  for (; i+4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (x+i));
+    __m256i qhat = avx2ToLong(_mm256_mul_pd(avx2ToDouble(a), cqinv));
+    __m256i r = _mm256_sub_epi64(avx2MulLo(a, cv), avx2MulLo(qhat, qv));
+    _mm256_storeu_si256((__m256i*) (x+i), avx2Correct(r, qv));
+  }
+  scalarMulConst(x+i, c, n-i, q, qinv);
+}
+
+/********************************************************************/
+/* AVX-512 kernels (F+DQ), eight entries at a time                  */
+
+#define AVX512 __attribute__((target("avx512f,avx512dq")))
+
+// reduce -q <= r < 2q into [0,q)
+static inline AVX512 __m512i avx512Correct(__m512i r, __m512i qv)
+{
+  __m512i zero = _mm512_setzero_si512();
+  r = _mm512_mask_add_epi64(r, _mm512_cmplt_epi64_mask(r, zero), r, qv);
+  return _mm512_mask_sub_epi64(r, _mm512_cmpge_epi64_mask(r, qv), r, qv);
+}
+
+// a*b mod q for a,b in [0,q)
+static inline AVX512 __m512i avx512MulModVec(__m512i a, __m512i b,
+                                             __m512i qv, __m512d qinvv)
+{
+  __m512d t = _mm512_mul_pd(_mm512_mul_pd(_mm512_cvtepi64_pd(a),
+                                          _mm512_cvtepi64_pd(b)), qinvv);
+  __m512i qhat = _mm512_cvtpd_epi64(t); // round to nearest
+  __m512i r = _mm512_sub_epi64(_mm512_mullo_epi64(a, b),
+                               _mm512_mullo_epi64(qhat, qv));
+  return avx512Correct(r, qv);
+}
+
+// a+b mod q for a,b in [0,q)
+static inline AVX512 __m512i avx512AddModVec(__m512i a, __m512i b, __m512i qv)
+{
+  __m512i r = _mm512_add_epi64(a, b);
+  return _mm512_mask_sub_epi64(r, _mm512_cmpge_epi64_mask(r, qv), r, qv);
+}
+
+static AVX512 void avx512Add(long* x, const long* y, long n, long q)
+{
+  __m512i qv = _mm512_set1_epi64(q);
+  long i = 0;
+  for (; i+8 <= n; i += 8) {
+    __m512i r = _mm512_add_epi64(_mm512_loadu_si512(x+i),
+                                 _mm512_loadu_si512(y+i));
+    r = _mm512_mask_sub_epi64(r, _mm512_cmpge_epi64_mask(r, qv), r, qv);
+    _mm512_storeu_si512(x+i, r);
+  }
+  scalarAdd(x+i, y+i, n-i, q);
+}
+
+static AVX512 void avx512Sub(long* x, const long* y, long n, long q)
+{
+  __m512i qv = _mm512_set1_epi64(q);
+  __m512i zero = _mm512_setzero_si512();
+  long i = 0;
+  for (; i+8 <= n; i += 8) {
+    __m512i r = _mm512_sub_epi64(_mm512_loadu_si512(x+i),
+                                 _mm512_loadu_si512(y+i));
+    r = _mm512_mask_add_epi64(r, _mm512_cmplt_epi64_mask(r, zero), r, qv);
+    _mm512_storeu_si512(x+i, r);
+  }
+  scalarSub(x+i, y+i, n-i, q);
+}
+
+static AVX512 void avx512Negate(long* x, const long* y, long n, long q)
+{
+  __m512i qv = _mm512_set1_epi64(q);
+  __m512i zero = _mm512_setzero_si512();
+  long i = 0;
+  for (; i+8 <= n; i += 8) {
+    __m512i a = _mm512_loadu_si512(y+i);
+    __m512i r = _mm512_maskz_sub_epi64(_mm512_cmpneq_epi64_mask(a, zero), qv, a);
+    _mm512_storeu_si512(x+i, r);
+  }
+  scalarNegate(x+i, y+i, n-i, q);
+}
+
+static AVX512 void avx512Mul(long* x, const long* y, long n, long q, double qinv)
+{
+  __m512i qv = _mm512_set1_epi64(q);
+  __m512d qinvv = _mm512_set1_pd(qinv);
+  long i = 0;
+  for (; i+8 <= n; i += 8) {
+    __m512i a = _mm512_loadu_si512(x+i);
+    __m512i b = _mm512_loadu_si512(y+i);
+    _mm512_storeu_si512(x+i, avx512MulModVec(a, b, qv, qinvv));
+  }
+  scalarMul(x+i, y+i, n-i, q, qinv);
+}
+
+static AVX512 void avx512MulAdd(long* x, const long* a, const long* b,
+                                long n, long q, double qinv)
+{
+  __m512i qv = _mm512_set1_epi64(q);
+  __m512d qinvv = _mm512_set1_pd(qinv);
+  long i = 0;
+  for (; i+8 <= n; i += 8) {
+    __m512i t = avx512MulModVec(_mm512_loadu_si512(a+i),
+                                _mm512_loadu_si512(b+i), qv, qinvv);
+    _mm512_storeu_si512(x+i, avx512AddModVec(_mm512_loadu_si512(x+i), t, qv));
+  }
+  scalarMulAdd(x+i, a+i, b+i, n-i, q, qinv);
+}
+
+static AVX512 void avx512MulAdd2(long* x, const long* a, const long* b,
+                                 const long* c, const long* d,
+                                 long n, long q, double qinv)
+{
+  __m512i qv = _mm512_set1_epi64(q);
+  __m512d qinvv = _mm512_set1_pd(qinv);
+  long i = 0;
+  for (; i+8 <= n; i += 8) {
+    __m512i t1 = avx512MulModVec(_mm512_loadu_si512(a+i),
+                                 _mm512_loadu_si512(b+i), qv, qinvv);
+    __m512i t2 = avx512MulModVec(_mm512_loadu_si512(c+i),
+                                 _mm512_loadu_si512(d+i), qv, qinvv);
+    __m512i t = avx512AddModVec(t1, t2, qv);
+    _mm512_storeu_si512(x+i, avx512AddModVec(_mm512_loadu_si512(x+i), t, qv));
+  }
+  scalarMulAdd2(x+i, a+i, b+i, c+i, d+i, n-i, q, qinv);
+}
+
+static AVX512 void avx512Gather(long* x, const long* y, const long* idx, long n)
+{
+  long i = 0;
+  for (; i+8 <= n; i += 8) {
+    __m512i iv = _mm512_loadu_si512(idx+i);
+    __m512i r = _mm512_mask_i64gather_epi64(_mm512_setzero_si512(),
+                                            (__mmask8) 0xFF, iv, y, 8);
+    _mm512_storeu_si512(x+i, r);
+  }
+  scalarGather(x+i, y, idx+i, n-i);
+}
+
+static AVX512 void avx512AddConst(long* x, long c, long n, long q)
+{
+  __m512i qv = _mm512_set1_epi64(q);
+  __m512i cv = _mm512_set1_epi64(c);
+  long i = 0;
+  for (; i+8 <= n; i += 8) {
+    __m512i r = _mm512_add_epi64(_mm512_loadu_si512(x+i), cv);
+    r = _mm512_mask_sub_epi64(r, _mm512_cmpge_epi64_mask(r, qv), r, qv);
+    _mm512_storeu_si512(x+i, r);
+  }
+  scalarAddConst(x+i, c, n-i, q);
+}
+
+static AVX512 void avx512MulConst(long* x, long c, long n, long q, double qinv)
+{
+  __m512i qv = _mm512_set1_epi64(q);
+  __m512i cv = _mm512_set1_epi64(c);
+  __m512d cqinv = _mm512_set1_pd(((double) c) * qinv);
+  long i = 0;
+  for (; i+8 <= n; i += 8) {
+    __m512i a = _mm512_loadu_si512(x+i);
+    __m512i qhat = _mm512_cvtpd_epi64(_mm512_mul_pd(_mm512_cvtepi64_pd(a), cqinv));
+    __m512i r = _mm512_sub_epi64(_mm512_mullo_epi64(a, cv),
+                                 _mm512_mullo_epi64(qhat, qv));
+    _mm512_storeu_si512(x+i, avx512Correct(r, qv));
+  }
+  scalarMulConst(x+i, c, n-i, q, qinv);
+}
+
+#endif // ROWOPS_X86
+
+/********************************************************************/
+/* Lazy accumulation                                                */
+
+#define LAZY_MASK ((1UL << 52) - 1)
+
+static void scalarMulAddLazy(long* lo, long* hi, const long* a, const long* b,
+                             long n, long q, double qinv)
+{
+#ifdef __SIZEOF_INT128__
+  if (q < ROWOPS_SIMD_BOUND) {
+    unsigned long* ulo = (unsigned long*) lo;
+    unsigned long* uhi = (unsigned long*) hi;
+    for (long i = 0; i < n; i++) {
+      unsigned __int128 p = (unsigned __int128) a[i] * (unsigned long) b[i];
+      ulo[i] += ((unsigned long) p) & LAZY_MASK;
+      uhi[i] += (unsigned long) (p >> 52);
+    }
+    return;
+  }
+#endif
+  // reduce eagerly, hi stays zero
+  if (q >= NTL_SP_BOUND) wideMulAdd(lo, a, b, n, q, qinv);
+  else                   scalarMulAdd(lo, a, b, n, q, qinv);
+}
+
+// x mod q for any unsigned 64-bit x, using a floating-point estimate of
+// the quotient, which is off by at most one unless q is very small
+static inline long reduceWord(unsigned long x, long q, double qinv)
+{
+  unsigned long qhat = (unsigned long) (((double) x) * qinv);
+  long r = (long) (x - qhat * (unsigned long) q);
+  if (r < 0) r += q;
+  else if (r >= q) r -= q;
+  if (r < 0 || r >= q) { // only for tiny q
+    r %= q;
+    if (r < 0) r += q;
+  }
+  return r;
+}
+
+static void scalarReduceLazy(long* x, const long* lo, const long* hi,
+                             long n, long q, double qinv)
+{
+  long c = reduceWord(1UL << 52, q, qinv); // 2^52 mod q
+  mulmod_precon_t cqinv = PrepMulModPrecon(c, q, qinv);
+  for (long i = 0; i < n; i++) {
+    long h = reduceWord((unsigned long) hi[i], q, qinv);
+    long l = reduceWord((unsigned long) lo[i], q, qinv);
+    x[i] = AddMod(MulModPrecon(h, c, q, cqinv), l, q);
+  }
+}
+
+#ifdef ROWOPS_X86
+
+#define IFMA __attribute__((target("avx512f,avx512ifma")))
+
+// The 52-bit multiply-add instructions compute exactly what we need
+static IFMA void ifmaMulAddLazy(long* lo, long* hi, const long* a,
+                                const long* b, long n, long q, double qinv)
+{
+  long i = 0;
+  for (; i+8 <= n; i += 8) {
+    __m512i av = _mm512_loadu_si512(a+i);
+    __m512i bv = _mm512_loadu_si512(b+i);
+    __m512i l = _mm512_madd52lo_epu64(_mm512_loadu_si512(lo+i), av, bv);
+    __m512i h = _mm512_madd52hi_epu64(_mm512_loadu_si512(hi+i), av, bv);
+    _mm512_storeu_si512(lo+i, l);
+    _mm512_storeu_si512(hi+i, h);
+  }
+  scalarMulAddLazy(lo+i, hi+i, a+i, b+i, n-i, q, qinv);
+}
+
+static bool haveIFMA()
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx512ifma");
+}
+
+#endif // ROWOPS_X86
+
+/********************************************************************/
+/* Run-time dispatch                                                */
+
+class RowOps {
+public:
+  const char* name;
+  void (*add)(long*, const long*, long, long);
+  void (*sub)(long*, const long*, long, long);
+  void (*negate)(long*, const long*, long, long);
+  void (*mul)(long*, const long*, long, long, double);
+  void (*mulAdd)(long*, const long*, const long*, long, long, double);
+  void (*mulAdd2)(long*, const long*, const long*, const long*, const long*,
+                  long, long, double);
+  void (*addConst)(long*, long, long, long);
+  void (*mulConst)(long*, long, long, long, double);
+  void (*gather)(long*, const long*, const long*, long);
+};
+
+static const RowOps scalarOps = { "scalar", scalarAdd, scalarSub,
+  scalarNegate, scalarMul, scalarMulAdd, scalarMulAdd2, scalarAddConst,
+  scalarMulConst, scalarGather };
+
+// AddMod, SubMod and NegateMod only need q < 2^62
+static const RowOps wideOps = { "wide", scalarAdd, scalarSub,
+  scalarNegate, wideMul, wideMulAdd, wideMulAdd2, scalarAddConst,
+  wideMulConst, scalarGather };
+
+#ifdef ROWOPS_X86
+static const RowOps avx2Ops = { "avx2", avx2Add, avx2Sub,
+  avx2Negate, avx2Mul, avx2MulAdd, avx2MulAdd2, avx2AddConst,
+  avx2MulConst, avx2Gather };
+
+static const RowOps avx512Ops = { "avx512", avx512Add, avx512Sub,
+  avx512Negate, avx512Mul, avx512MulAdd, avx512MulAdd2, avx512AddConst,
+  avx512MulConst, avx512Gather };
+#endif
+
+static const RowOps* bestOps()
+{
+#ifdef ROWOPS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+    return &avx512Ops;
+  if (__builtin_cpu_supports("avx2"))
+    return &avx2Ops;
+#endif
+  return &scalarOps;
+}
+
+static bool forceScalar = false;
+
+static inline const RowOps& getOps(long q)
+{
+  static const RowOps* best = bestOps(); // initialized on first call
+  if (q >= NTL_SP_BOUND) return wideOps;
+  if (forceScalar || q >= ROWOPS_SIMD_BOUND) return scalarOps;
+  return *best;
+}
+
+const char* rowOpsKernel() { return getOps(0).name; }
+
+void setRowOpsScalar(bool toWhat) { forceScalar = toWhat; }
+
+void rowAddMod(long* x, const long* y, long n, long q)
+{ getOps(q).add(x, y, n, q); }
+
+void rowSubMod(long* x, const long* y, long n, long q)
+{ getOps(q).sub(x, y, n, q); }
+
+void rowNegateMod(long* x, const long* y, long n, long q)
+{ getOps(q).negate(x, y, n, q); }
+
+void rowMulMod(long* x, const long* y, long n, long q, double qinv)
+{ getOps(q).mul(x, y, n, q, qinv); }
+
+void rowMulAddMod(long* x, const long* a, const long* b,
+                  long n, long q, double qinv)
+{ getOps(q).mulAdd(x, a, b, n, q, qinv); }
+
+void rowMulAddMod(long* x, const long* a, const long* b,
+                  const long* c, const long* d, long n, long q, double qinv)
+{ getOps(q).mulAdd2(x, a, b, c, d, n, q, qinv); }
+
+void rowAddModConst(long* x, long c, long n, long q)
+{ getOps(q).addConst(x, c, n, q); }
+
+void rowMulModConst(long* x, long c, long n, long q, double qinv)
+{ getOps(q).mulConst(x, c, n, q, qinv); }
+
+void rowGather(long* x, const long* y, const long* idx, long n)
+{ getOps(0).gather(x, y, idx, n); }
+
+void rowMulAddLazy(long* lo, long* hi, const long* a, const long* b,
+                   long n, long q, double qinv)
+{
+#ifdef ROWOPS_X86
+  static bool ifma = haveIFMA();
+  if (ifma && !forceScalar && q < ROWOPS_SIMD_BOUND) {
+    ifmaMulAddLazy(lo, hi, a, b, n, q, qinv);
+    return;
+  }
+#endif
+  scalarMulAddLazy(lo, hi, a, b, n, q, qinv);
+}
+
+void rowAddLazy(long* lo, const long* a, long n, long q)
+{
+#ifdef __SIZEOF_INT128__
+  if (q < ROWOPS_SIMD_BOUND) { // no reduction, the sum is in [0,2^64)
+    unsigned long* ulo = (unsigned long*) lo;
+    for (long i = 0; i < n; i++) ulo[i] += (unsigned long) a[i];
+    return;
+  }
+#endif
+  rowAddMod(lo, a, n, q);
+}
+
+void rowReduceLazy(long* x, const long* lo, const long* hi,
+                   long n, long q, double qinv)
+{
+  if (q >= NTL_SP_BOUND) { // already reduced, see scalarMulAddLazy
+    if (x != lo) for (long i = 0; i < n; i++) x[i] = lo[i];
+    return;
+  }
+  scalarReduceLazy(x, lo, hi, n, q, qinv);
+}
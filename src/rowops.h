@@ -0,0 +1,97 @@
+/* Copyright (C) 2012,2013 IBM Corp.
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+#ifndef _ROWOPS_H_
+#define _ROWOPS_H_
+/**
+ * @file rowops.h
+ * @brief Modular arithmetic on whole rows of single-precision integers
+ *
+ * These kernels apply one modular operation to n consecutive entries, all
+ * of them in [0,q) for a single-word modulus q, which is either below
+ * NTL_SP_BOUND or an odd wide modulus below 2^62. They are the inner loops
+ * of the DoubleCRT arithmetic. On x86-64 the kernels are dispatched at run
+ * time to an AVX-512 or AVX2 implementation, if the processor supports it,
+ * and otherwise to a scalar implementation. Wide moduli always use scalar
+ * Montgomery/Shoup kernels, which ignore qinv.
+ *
+ * The multiplication kernels use the same floating-point quotient estimate
+ * as NTL's MulMod(a,b,q,qinv), with qinv = 1/(double)q precomputed by the
+ * caller (see Cmod::getQInv()). The output row may alias the input row.
+ **/
+
+//! x[i] = x[i] + y[i] mod q
+void rowAddMod(long* x, const long* y, long n, long q);
+
+//! x[i] = x[i] - y[i] mod q
+void rowSubMod(long* x, const long* y, long n, long q);
+
+//! x[i] = -y[i] mod q
+void rowNegateMod(long* x, const long* y, long n, long q);
+
+//! x[i] = x[i] * y[i] mod q
+void rowMulMod(long* x, const long* y, long n, long q, double qinv);
+
+//! x[i] = x[i] + a[i]*b[i] mod q
+void rowMulAddMod(long* x, const long* a, const long* b,
+                  long n, long q, double qinv);
+
+//! x[i] = x[i] + a[i]*b[i] + c[i]*d[i] mod q
+void rowMulAddMod(long* x, const long* a, const long* b,
+                  const long* c, const long* d, long n, long q, double qinv);
+
+//! x[i] = x[i] + c mod q, with c in [0,q)
+void rowAddModConst(long* x, long c, long n, long q);
+
+//! x[i] = x[i] * c mod q, with c in [0,q)
+void rowMulModConst(long* x, long c, long n, long q, double qinv);
+
+//! x[i] = y[idx[i]], with 0 <= idx[i] < n; x must not alias y
+void rowGather(long* x, const long* y, const long* idx, long n);
+
+/**
+ * @name Lazy accumulation
+ * @brief Sums of products that are reduced only once, at the end.
+ *
+ * A lazy sum is kept in two rows of unsigned words, as hi*2^52 + lo. For
+ * q < 2^50 adding a product a*b < 2^100 only adds its low 52 bits to lo
+ * and its high bits to hi, and up to ROWOPS_LAZY_TERMS terms (each one a
+ * product or an entry in [0,q)) can be added to a sum that was reduced
+ * before it may overflow. For larger q the kernels reduce eagerly, hi
+ * stays zero and lo stays in [0,q).
+ **/
+///@{
+#define ROWOPS_LAZY_TERMS 4095
+
+//! hi[i]*2^52 + lo[i] += a[i]*b[i]
+void rowMulAddLazy(long* lo, long* hi, const long* a, const long* b,
+                   long n, long q, double qinv);
+
+//! hi[i]*2^52 + lo[i] += a[i], with a[i] in [0,q)
+void rowAddLazy(long* lo, const long* a, long n, long q);
+
+//! x[i] = hi[i]*2^52 + lo[i] mod q, x may alias lo or hi
+void rowReduceLazy(long* x, const long* lo, const long* hi,
+                   long n, long q, double qinv);
+///@}
+
+//! @brief The kernels in use: "avx512", "avx2", or "scalar"
+const char* rowOpsKernel();
+
+//! @brief Force the scalar kernels (toWhat=true), e.g. for testing, or
+//! go back to run-time dispatch (toWhat=false)
+void setRowOpsScalar(bool toWhat=true);
+
+#endif // _ROWOPS_H_
@@ -22,6 +22,8 @@
 #include <utility>
 #include <cmath>
 #include <cstring>
+#include <memory>
+#include <mutex>
 
 using namespace std;
 
@@ -34,6 +36,15 @@ public:
   long numCalls;
 
   FHEtimer() { isOn=false; counter=0; numCalls=0; }
+
+  // the current value, including the running interval if any
+  clock_t value() const { return isOn? (counter + std::clock()) : counter; }
+
+  void reset() {
+    numCalls = 0;
+    counter = 0;
+    if (isOn) counter -= std::clock();
+  }
 };
 
 bool string_compare(const char *a, const char *b)
@@ -44,21 +55,77 @@ bool string_compare(const char *a, const char *b)
 bool FHEtimersOn=false;
 
 typedef unordered_map<const char*,FHEtimer>timerMap;
-static timerMap timers;
+
+// Timed functions may run in many threads, so every thread has its own
+// timers, and the timers of all the threads are only added up when they
+// are read. The lock of a thread is taken by that thread on every start
+// and stop, and by the readers, so it is not contended while timing.
+// When a thread exits, its timers are added to the retired ones.
+struct ThreadTimers {
+  mutex lock;
+  timerMap timers;
+};
+
+static mutex registryLock; // protects registry and retired
+static vector< shared_ptr<ThreadTimers> > registry; // the running threads
+static timerMap retired;   // the sums of the timers of the exited threads
+
+namespace {
+struct TimersHandle {
+  shared_ptr<ThreadTimers> mine;
+
+  TimersHandle(): mine(new ThreadTimers) {
+    lock_guard<mutex> lock(registryLock);
+    registry.push_back(mine);
+  }
+
+  ~TimersHandle() {
+    lock_guard<mutex> lock(registryLock);
+    lock_guard<mutex> lock1(mine->lock);
+    for (timerMap::iterator it = mine->timers.begin();
+         it != mine->timers.end(); ++it) {
+      FHEtimer& t = retired[it->first];
+      t.counter += it->second.value();
+      t.numCalls += it->second.numCalls;
+    }
+    registry.erase(find(registry.begin(), registry.end(), mine));
+  }
+};
+}
+
+// The timers of the calling thread
+static ThreadTimers& myTimers()
+{
+  static thread_local TimersHandle handle;
+  return *handle.mine;
+}
+
+// Apply fn to the timer fncName of every thread (including the retired
+// ones), registryLock must be held
+template<class Fun> static void forEachThread(const char *fncName, Fun fn)
+{
+  for (size_t i = 0; i < registry.size(); i++) {
+    lock_guard<mutex> lock(registry[i]->lock);
+    timerMap::iterator it = registry[i]->timers.find(fncName);
+    if (it != registry[i]->timers.end()) fn(it->second);
+  }
+  timerMap::iterator it = retired.find(fncName);
+  if (it != retired.end()) fn(it->second);
+}
 
 // Reset a timer for some label to zero
 void resetFHEtimer(const char *fncName)
 {
-  FHEtimer& t = timers[fncName];   // insert to map if not already there
-  t.numCalls = 0;
-  t.counter = 0;
-  if (t.isOn) t.counter -= std::clock();
+  lock_guard<mutex> lock(registryLock);
+  forEachThread(fncName, [](FHEtimer& t) { t.reset(); });
 }
 
 // Start a timer
 void startFHEtimer(const char *fncName)
 {
-  FHEtimer& t = timers[fncName];   // insert to map if not already there
+  ThreadTimers& tt = myTimers();
+  lock_guard<mutex> lock(tt.lock);
+  FHEtimer& t = tt.timers[fncName];   // insert to map if not already there
   if (!t.isOn) {
     t.isOn = true;
     t.numCalls++;
@@ -69,49 +136,81 @@ void startFHEtimer(const char *fncName)
 // Stop a timer
 void stopFHEtimer(const char *fncName)
 {
-  FHEtimer& t = timers[fncName];   // insert to map if not already there
+  ThreadTimers& tt = myTimers();
+  lock_guard<mutex> lock(tt.lock);
+  FHEtimer& t = tt.timers[fncName];   // insert to map if not already there
   if (t.isOn) {
     t.isOn = false;
     t.counter += std::clock();
   }
 }
 
+// The sums of a timer over all the threads, registryLock must be held
+static void sumTimer(const char *fncName, clock_t& c, long& n)
+{
+  c = 0;
+  n = 0;
+  forEachThread(fncName, [&](FHEtimer& t) {
+    c += t.value();
+    n += t.numCalls;
+  });
+}
+
 // Read the value of a timer (in seconds)
 double getTime4func(const char *fncName) // returns time in seconds
 {
-  FHEtimer& t = timers[fncName];   // insert to map if not already there
-
-  // If the counter is currently counting, add the clock() value
-  clock_t c = t.isOn? (t.counter + std::clock()) : t.counter;
+  lock_guard<mutex> lock(registryLock);
+  clock_t c;
+  long n;
+  sumTimer(fncName, c, n);
   return ((double)c)/CLOCKS_PER_SEC;
 }
 
 // Returns number of calls for that timer
 long getNumCalls4func(const char *fncName) 
 {
-    FHEtimer& t = timers[fncName];   // insert to map if not already there
-    return t.numCalls;
+  lock_guard<mutex> lock(registryLock);
+  clock_t c;
+  long n;
+  sumTimer(fncName, c, n);
+  return n;
 }
 
 void resetAllTimers()
 {
-  for (timerMap::iterator it = timers.begin(); it != timers.end(); ++it)
-    resetFHEtimer(it->first);
+  lock_guard<mutex> lock(registryLock);
+  for (size_t i = 0; i < registry.size(); i++) {
+    lock_guard<mutex> lock1(registry[i]->lock);
+    for (timerMap::iterator it = registry[i]->timers.begin();
+         it != registry[i]->timers.end(); ++it)
+      it->second.reset();
+  }
+  for (timerMap::iterator it = retired.begin(); it != retired.end(); ++it)
+    it->second.reset();
 }
 
 // Print the value of all timers to stream
 void printAllTimers(std::ostream& str)
 {
+  lock_guard<mutex> lock(registryLock);
   vector<const char *> vec;
-  for (timerMap::iterator it = timers.begin(); it != timers.end(); ++it) {
-    vec.push_back(it->first);
+  for (size_t i = 0; i < registry.size(); i++) {
+    lock_guard<mutex> lock1(registry[i]->lock);
+    for (timerMap::iterator it = registry[i]->timers.begin();
+         it != registry[i]->timers.end(); ++it)
+      vec.push_back(it->first);
   }
+  for (timerMap::iterator it = retired.begin(); it != retired.end(); ++it)
+    vec.push_back(it->first);
 
   sort(vec.begin(), vec.end(), string_compare);
+  vec.erase(unique(vec.begin(), vec.end()), vec.end());
 
   for (vector<const char *>::iterator it = vec.begin(); it != vec.end(); ++it) {
-    double t =  getTime4func(*it);
-    long n = getNumCalls4func(*it);
+    clock_t c;
+    long n;
+    sumTimer(*it, c, n);
+    double t = ((double)c)/CLOCKS_PER_SEC;
     double ave;
     if (n > 0) { 
       ave = t/n;
@@ -31,6 +31,10 @@
  * built-in macro \_\_func\_\_). We can also use the "lower level" methods
  * startFHEtimer(name), stopFHEtimer(name), and resetFHEtimer(name) to add
  * timers with arbitrary names (not necessarily associated with functions).
+ *
+ * Every thread has its own timers, so the timed functions can run in many
+ * threads at once; the values that are read or printed are the sums over
+ * all the threads.
  **/
 #ifndef _TIMING_H_
 #define _TIMING_H_